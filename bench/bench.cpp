@@ -0,0 +1,270 @@
+#include <benchmark/benchmark.h>
+#include <abt/aabb_tree.hpp>
+
+#include <cmath>
+#include <random>
+#include <string>
+
+/*! \file bench.cpp
+
+  Throughput and tree quality benchmarks over representative workloads.
+  Every benchmark is registered for Dim = 2 and 3, float and double, and
+  uniform, clustered and polydisperse boxes, at sizes from 1k to 10M
+  entries. Select a subset with --benchmark_filter, e.g.
+
+    bench --benchmark_filter='query_box/3d/double/clustered/100000'
+*/
+
+using namespace abt;
+
+enum class distribution { uniform, clustered, polydisperse };
+
+const char *name(distribution dist)
+{
+  switch (dist) {
+    case distribution::uniform:
+      return "uniform";
+    case distribution::clustered:
+      return "clustered";
+    case distribution::polydisperse:
+      return "polydisperse";
+  }
+  return "";
+}
+
+const char *name(build_strategy strategy)
+{
+  switch (strategy) {
+    case build_strategy::binned_sah:
+      return "binned_sah";
+    case build_strategy::lbvh:
+      return "lbvh";
+    case build_strategy::ploc:
+      return "ploc";
+  }
+  return "";
+}
+
+/// The entry counts every benchmark runs at.
+constexpr long sizes[] = {1000, 10000, 100000, 1000000, 10000000};
+
+/// The number of distinct queries cycled through by the query benchmarks.
+constexpr unsigned int query_count = 4096;
+
+//! A workload: n entries in a periodic box sized to a fixed packing.
+template <unsigned Dim, typename ValTy>
+struct workload {
+  using aabb = abt::aabb<Dim, ValTy>;
+  using vec = std::array<ValTy, Dim>;
+
+  workload(distribution dist, std::size_t n, unsigned int seed = 42)
+  {
+    // Unit entries fill about a tenth of the box whatever n is.
+    double side = std::pow(10.0 * n, 1.0 / Dim);
+    box.fill(ValTy(side));
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> coord(0, side);
+    std::normal_distribution<double> spread(0, side / 100);
+    std::uniform_real_distribution<double> logSize(std::log(0.25), std::log(20.0));
+
+    std::vector<std::array<double, Dim>> centres(dist == distribution::clustered ? 100 : 0);
+    for (auto &c : centres)
+      for (unsigned int d = 0; d < Dim; d++)
+        c[d] = coord(rng);
+
+    auto box_at = [&](const std::array<double, Dim> &position, double size) {
+      typename aabb::point lower, upper;
+      for (unsigned int d = 0; d < Dim; d++) {
+        lower[d] = ValTy(position[d]);
+        upper[d] = ValTy(position[d] + size);
+      }
+      return aabb{lower, upper};
+    };
+
+    auto random_position = [&] {
+      std::array<double, Dim> p;
+      if (dist == distribution::clustered) {
+        const auto &c = centres[rng() % centres.size()];
+        for (unsigned int d = 0; d < Dim; d++)
+          p[d] = std::fmod(std::fmod(c[d] + spread(rng), side) + side, side);
+      }
+      else {
+        for (unsigned int d = 0; d < Dim; d++)
+          p[d] = coord(rng);
+      }
+      return p;
+    };
+
+    entries.reserve(n);
+    for (std::size_t i = 0; i < n; i++) {
+      double size = dist == distribution::polydisperse ? std::exp(logSize(rng)) : 1;
+      entries.push_back(box_at(random_position(), size));
+    }
+    for (unsigned int i = 0; i < query_count; i++)
+      queries.push_back(box_at(random_position(), 2));
+  }
+
+  /// The periodic box.
+  vec box;
+
+  std::vector<aabb> entries;
+  std::vector<aabb> queries;
+};
+
+template <unsigned Dim, typename ValTy>
+void report_quality(benchmark::State &state, const tree<Dim, ValTy> &t)
+{
+  auto stats = t.stats();
+  state.counters["sah_cost"] = stats.sah_cost;
+  state.counters["height"] = stats.height;
+  state.counters["sibling_overlap"] = stats.sibling_overlap;
+  state.counters["bytes_per_entry"] = double(stats.memory_bytes) / stats.leaves;
+}
+
+template <unsigned Dim, typename ValTy>
+void insert(benchmark::State &state, distribution dist)
+{
+  workload<Dim, ValTy> w(dist, state.range(0));
+  tree<Dim, ValTy> t;
+  for (auto _ : state) {
+    t = tree<Dim, ValTy>();
+    for (const auto &bb : w.entries)
+      t.insert(bb);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * w.entries.size());
+  report_quality(state, t);
+}
+
+template <unsigned Dim, typename ValTy>
+void update(benchmark::State &state, distribution dist)
+{
+  workload<Dim, ValTy> w(dist, state.range(0));
+  tree<Dim, ValTy> t(w.entries);
+
+  // Entries jiggle by up to a tenth of their size, as in a short MD step.
+  // The tight boxes are moved, as the tree only holds fattened ones.
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> jiggle(-0.1, 0.1);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    auto &bb = w.entries[i];
+    for (unsigned int d = 0; d < Dim; d++) {
+      double step = jiggle(rng);
+      bb.lowerBound[d] += step;
+      bb.upperBound[d] += step;
+    }
+    benchmark::DoNotOptimize(t.update(typename tree<Dim, ValTy>::node_id(i), bb));
+    i = (i + 1) % w.entries.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <unsigned Dim, typename ValTy>
+void remove_insert(benchmark::State &state, distribution dist)
+{
+  workload<Dim, ValTy> w(dist, state.range(0));
+  tree<Dim, ValTy> t;
+  std::vector<typename tree<Dim, ValTy>::node_id> ids;
+  for (const auto &bb : w.entries)
+    ids.push_back(t.insert(bb));
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    t.remove(ids[i]);
+    ids[i] = t.insert(w.entries[i]);
+    i = (i + 1) % w.entries.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <unsigned Dim, typename ValTy, bool Point, bool Periodic>
+void query(benchmark::State &state, distribution dist)
+{
+  workload<Dim, ValTy> w(dist, state.range(0));
+  tree<Dim, ValTy> t(Periodic ? w.box : typename tree<Dim, ValTy>::template vec<ValTy>{},
+                     w.entries);
+
+  std::size_t hits = 0, i = 0;
+  for (auto _ : state) {
+    const auto &q = w.queries[i];
+    if constexpr (Point)
+      t.visit_overlaps(q.centre, [&hits] { hits++; });
+    else
+      t.visit_overlaps(q, [&hits] { hits++; });
+    i = (i + 1) % query_count;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["hits_per_query"] = double(hits) / state.iterations();
+
+  // Count the traversal work in a separate pass, so the timed loop runs
+  // the uncounted query.
+  query_counters counters;
+  for (const auto &q : w.queries) {
+    if constexpr (Point)
+      t.visit_overlaps(q.centre, [] {}, counters);
+    else
+      t.visit_overlaps(q, [] {}, counters);
+  }
+  state.counters["nodes_per_query"] = double(counters.nodes_visited) / query_count;
+  state.counters["leaves_per_query"] = double(counters.leaves_tested) / query_count;
+  state.counters["false_positives_per_query"] = double(counters.false_positives) / query_count;
+}
+
+template <unsigned Dim, typename ValTy>
+void build(benchmark::State &state, distribution dist, build_strategy strategy)
+{
+  workload<Dim, ValTy> w(dist, state.range(0));
+  tree<Dim, ValTy> t;
+  for (auto _ : state) {
+    t = tree<Dim, ValTy>(w.entries, build_options{strategy});
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * w.entries.size());
+  report_quality(state, t);
+}
+
+template <unsigned Dim, typename ValTy>
+void register_all(const std::string &type)
+{
+  auto add = [](const std::string &name, auto fn) {
+    auto *b = benchmark::RegisterBenchmark(name.c_str(), fn);
+    for (long n : sizes)
+      b->Arg(n);
+    b->Unit(benchmark::kMicrosecond);
+  };
+
+  for (auto dist : {distribution::uniform, distribution::clustered, distribution::polydisperse}) {
+    std::string suffix = "/" + std::to_string(Dim) + "d/" + type + "/" + name(dist);
+    add("insert" + suffix, [dist](benchmark::State &s) { insert<Dim, ValTy>(s, dist); });
+    add("update" + suffix, [dist](benchmark::State &s) { update<Dim, ValTy>(s, dist); });
+    add("remove_insert" + suffix,
+        [dist](benchmark::State &s) { remove_insert<Dim, ValTy>(s, dist); });
+    add("query_box" + suffix,
+        [dist](benchmark::State &s) { query<Dim, ValTy, false, false>(s, dist); });
+    add("query_point" + suffix,
+        [dist](benchmark::State &s) { query<Dim, ValTy, true, false>(s, dist); });
+    add("query_box_periodic" + suffix,
+        [dist](benchmark::State &s) { query<Dim, ValTy, false, true>(s, dist); });
+    for (auto strategy : {build_strategy::binned_sah, build_strategy::lbvh, build_strategy::ploc}) {
+      add(std::string("build_") + name(strategy) + suffix,
+          [dist, strategy](benchmark::State &s) { build<Dim, ValTy>(s, dist, strategy); });
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  register_all<2, float>("float");
+  register_all<2, double>("double");
+  register_all<3, float>("float");
+  register_all<3, double>("double");
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -201,7 +201,7 @@ int main(int argc, char **argv)
 
         aabb = fattened(abt::aabb2d::of_sphere(position, radiusLarge), maxDisp);
       } while (treeLarge.any_overlap(
-        aabb, [&](unsigned id, const aabb2d& overlap) {
+        aabb, [&](tree2d::node_id id, const aabb2d& overlap) {
           // Cut-off distance.
           double cutOff = 2.0 * radiusLarge;
           cutOff *= cutOff;
@@ -230,7 +230,7 @@ int main(int argc, char **argv)
       aabb = fattened(aabb2d::of_sphere(position, radiusSmall), maxDisp);
     } while (
         treeLarge.any_overlap(aabb,
-                              [&](unsigned id, const aabb2d &overlap) {
+                              [&](tree2d::node_id id, const aabb2d &overlap) {
                                 // Cut-off distance.
                                 double cutOff = radiusSmall + radiusLarge;
                                 cutOff *= cutOff;
@@ -241,7 +241,7 @@ int main(int argc, char **argv)
             },
             true, boxSize) ||
         treeSmall.any_overlap(aabb,
-                              [&](unsigned id, const aabb2d &overlap) {
+                              [&](tree2d::node_id id, const aabb2d &overlap) {
                                 // Cut-off distance.
                                 double cutOff = 2.0 * radiusSmall;
                                 cutOff *= cutOff;
@@ -270,11 +270,11 @@ int main(int argc, char **argv)
   unsigned int sampleFlag = 0;
   unsigned int nSampled = 0;
 
-  std::vector<unsigned> largeParticle_ids;
-  std::vector<unsigned> smallParticle_ids;
+  std::vector<tree2d::node_id> largeParticle_ids;
+  std::vector<tree2d::node_id> smallParticle_ids;
 
-  treeLarge.for_each([&](unsigned id, const auto &) { largeParticle_ids.push_back(id); });
-  treeSmall.for_each([&](unsigned id, const auto &) { smallParticle_ids.push_back(id); });
+  treeLarge.for_each([&](tree2d::node_id id, const auto &) { largeParticle_ids.push_back(id); });
+  treeSmall.for_each([&](tree2d::node_id id, const auto &) { smallParticle_ids.push_back(id); });
 
   std::cout << "\nRunning dynamics ...\n";
   for (unsigned int i = 0; i < nSweeps; i++) {
@@ -294,19 +294,20 @@ int main(int argc, char **argv)
       // Initialise vectors.
       vec<double> displacement;
       point2d position;
+      tree2d::node_id particle_id;
 
       // Calculate the new particle position and displacement
       if (particleType == 0) {
-        particle = smallParticle_ids[particle];
+        particle_id = smallParticle_ids[particle];
         displacement[0] = maxDisp * diameterSmall * (2.0 * rng() - 1.0);
         displacement[1] = maxDisp * diameterSmall * (2.0 * rng() - 1.0);
-        position = treeSmall.get_aabb(particle).centre + displacement;
+        position = treeSmall.get_aabb(particle_id).centre + displacement;
       }
       else {
-        particle = largeParticle_ids[particle];
+        particle_id = largeParticle_ids[particle];
         displacement[0] = maxDisp * diameterLarge * (2.0 * rng() - 1.0);
         displacement[1] = maxDisp * diameterLarge * (2.0 * rng() - 1.0);
-        position = treeLarge.get_aabb(particle).centre + displacement;
+        position = treeLarge.get_aabb(particle_id).centre + displacement;
       }
 
       // Apply periodic boundary conditions.
@@ -316,12 +317,12 @@ int main(int argc, char **argv)
       auto aabb = fattened(aabb2d::of_sphere(position, radius), maxDisp);
 
       if (!treeLarge.any_overlap(aabb,
-                                [&](unsigned id, const aabb2d &overlap) {
+                                [&](tree2d::node_id id, const aabb2d &overlap) {
                                   // Cut-off distance.
                                   double cutOff = radius + radiusLarge;
                                   cutOff *= cutOff;
 
-                                  if (id == particle) {
+                                  if (id == particle_id) {
                                     // Self overlap, ignore.
                                     return false;
                                   }
@@ -332,12 +333,12 @@ int main(int argc, char **argv)
               },
               true, boxSize) &&
           !treeSmall.any_overlap(aabb,
-                                [&](unsigned id, const aabb2d &overlap) {
+                                [&](tree2d::node_id id, const aabb2d &overlap) {
                                   // Cut-off distance.
                                   double cutOff = radius + radiusSmall;
                                   cutOff *= cutOff;
 
-                                  if (id == particle) {
+                                  if (id == particle_id) {
                                     // Self overlap, ignore.
                                     return false;
                                   }
@@ -352,11 +353,11 @@ int main(int argc, char **argv)
         // Accept the move.
         if (particleType == 0) {
           positionsSmall[particle] = position;
-          treeSmall.update(particle, aabb);
+          treeSmall.update(particle_id, aabb);
         }
         else {
           positionsLarge[particle] = position;
-          treeLarge.update(particle, aabb);
+          treeLarge.update(particle_id, aabb);
         }
       }
     }
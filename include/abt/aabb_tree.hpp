@@ -29,18 +29,44 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <limits>
 
 #include <unordered_map>
 #include <numeric>
+#include <queue>
 
 //#define vector moo
 
 namespace abt {
+namespace detail {
+//! The type surface areas and insertion costs are computed in.
+/*! Floating point values keep their own precision; integers widen so that
+    the products of side lengths cannot overflow.
+ */
+template <typename ValTy>
+using cost_type =
+    std::conditional_t<std::is_floating_point_v<ValTy>, ValTy, std::int64_t>;
+}  // namespace detail
+
 template <unsigned Dim, typename ValTy = double>
 struct point {
   using value_type = ValTy;
@@ -59,18 +85,6 @@ struct point {
   
   point() = default;
 
-  point(const point &other) : values(other.values){}
-  point(point &&other) : values(std::move(other).values) {}
-
-  point& operator=(const point& other) {
-    values = other.values;
-    return *this;
-  }
-  point& operator=(point&& other) {
-    values = std::move(other).values;
-    return *this;
-  }
-
   bool operator==(const point &other) const { return values == other.values; }
 
   const value_type &x() const { return values[0]; }
@@ -85,7 +99,7 @@ struct point {
                                      const std::array<ValTy, Dim> &b)
   {
     point<Dim, ValTy> res;
-    for (auto d = 0; d < Dim; ++d) {
+    for (unsigned int d = 0; d < Dim; ++d) {
       res[d] = a[d] + b[d];
     }
     return res;
@@ -95,7 +109,7 @@ struct point {
                                      const std::array<ValTy, Dim> &b)
   {
     point<Dim, ValTy> res;
-    for (auto d = 0; d < Dim; ++d) {
+    for (unsigned int d = 0; d < Dim; ++d) {
       res[d] = a[d] - b[d];
     }
     return res;
@@ -119,24 +133,21 @@ struct point {
 
   std::array<value_type, Dim> values = {};
 };
-/*! \brief The axis-aligned bounding box object.
-
-    Axis-aligned bounding boxes (AABBs) store information for the minimum
-    orthorhombic bounding-box for an object. Support is provided for
-    dimensions >= 2. (In 2D the bounding box is either a rectangle,
-    in 3D it is a rectangular prism.)
+/*! \brief The bounds of an axis-aligned box and its surface area.
 
-    Class member functions provide functionality for merging AABB objects
-    and testing overlap with other AABBs.
+    An aabb without its centre, which is what a tree keeps for each node:
+    the centre is only ever needed of the boxes a caller is handed, and is
+    computed when a box is turned into an aabb.
  */
 template <unsigned Dim, typename ValTy = double>
-class aabb {
+class box {
  public:
   using point = abt::point<Dim, ValTy>;
   using value_type = ValTy;
+  using cost_type = detail::cost_type<ValTy>;
 
   /// Constructor.
-  aabb() = default;
+  box() = default;
 
   //! Constructor.
   /*! \param lowerBound_
@@ -145,123 +156,113 @@ class aabb {
       \param upperBound_
           The upper bound in each dimension.
    */
-  aabb(const point &lower_bound, const point &upper_bound)
+  box(const point &lower_bound, const point &upper_bound)
       : lowerBound(lower_bound), upperBound(upper_bound)
   {
     surfaceArea = compute_surface_area();
-    centre = compute_center();
   }
 
-  bool operator==(const aabb& other) const {
+  bool operator==(const box& other) const {
     return lowerBound == other.lowerBound && upperBound == other.upperBound;
   }
 
-  static aabb of_sphere(const point &center, value_type radius)
-  {
-    point lb, ub;
-    for (unsigned int i = 0; i < Dim; i++) {
-      lb[i] = center[i] - radius;
-      ub[i] = center[i] + radius;
-    }
-    return {lb, ub};
-  }
-
   /// Compute the surface area of the box.
-  value_type compute_surface_area() const
+  cost_type compute_surface_area() const
   {
-    // Sum of "area" of all the sides.
-    value_type sum = 0;
+    std::array<cost_type, Dim> dx;
+    for (unsigned int d = 0; d < Dim; d++)
+      dx[d] = cost_type(upperBound[d]) - cost_type(lowerBound[d]);
 
-    // General formula for one side: hold one dimension constant
-    // and multiply by all the other ones.
-    for (unsigned int d1 = 0; d1 < Dim; d1++) {
-      // "Area" of current side.
-      value_type product = 1;
-
-      for (unsigned int d2 = 0; d2 < Dim; d2++) {
-        if (d1 == d2)
-          continue;
-
-        value_type dx = upperBound[d2] - lowerBound[d2];
-        product *= dx;
+    if constexpr (Dim == 2) {
+      return 2 * (dx[0] + dx[1]);
+    }
+    else if constexpr (Dim == 3) {
+      return 2 * (dx[0] * dx[1] + dx[1] * dx[2] + dx[2] * dx[0]);
+    }
+    else {
+      // Sum of "area" of all the sides: hold one dimension constant
+      // and multiply by all the other ones.
+      cost_type sum = 0;
+      for (unsigned int d1 = 0; d1 < Dim; d1++) {
+        cost_type product = 1;
+        for (unsigned int d2 = 0; d2 < Dim; d2++) {
+          if (d1 != d2)
+            product *= dx[d2];
+        }
+        sum += product;
       }
-
-      // Update the sum.
-      sum += product;
+      return 2 * sum;
     }
-
-    return 2 * sum;
   }
 
   /// Get the surface area of the box.
-  value_type get_surface_area() const { return surfaceArea; }
+  cost_type get_surface_area() const { return surfaceArea; }
 
-  //! Merge two AABBs into this one.
-  /*! \param aabb1
-          A reference to the first AABB.
+  //! Merge two boxes into this one.
+  /*! \param box1
+          A reference to the first box.
 
-      \param aabb2
-          A reference to the second AABB.
+      \param box2
+          A reference to the second box.
    */
-  void merge(const aabb &aabb1, const aabb &aabb2)
+  void merge(const box &box1, const box &box2)
   {
     for (unsigned int i = 0; i < Dim; i++) {
-      lowerBound[i] = std::min(aabb1.lowerBound[i], aabb2.lowerBound[i]);
-      upperBound[i] = std::max(aabb1.upperBound[i], aabb2.upperBound[i]);
+      lowerBound[i] = std::min(box1.lowerBound[i], box2.lowerBound[i]);
+      upperBound[i] = std::max(box1.upperBound[i], box2.upperBound[i]);
     }
 
     surfaceArea = compute_surface_area();
-    centre = compute_center();
   }
 
-  //! Test whether the AABB is contained within this one.
-  /*! \param aabb
-          A reference to the AABB.
+  //! Test whether the box is contained within this one.
+  /*! \param other
+          A reference to the box.
 
       \return
-          Whether the AABB is fully contained.
+          Whether the box is fully contained.
    */
-  bool contains(const aabb &aabb) const
+  bool contains(const box &other) const
   {
     for (unsigned int i = 0; i < Dim; i++) {
-      if (aabb.lowerBound[i] < lowerBound[i])
+      if (other.lowerBound[i] < lowerBound[i])
         return false;
-      if (aabb.upperBound[i] > upperBound[i])
+      if (other.upperBound[i] > upperBound[i])
         return false;
     }
 
     return true;
   }
 
-  //! Test whether the AABB overlaps this one.
-  /*! \param aabb
-          A reference to the AABB.
+  //! Test whether the box overlaps this one.
+  /*! \param other
+          A reference to the box.
 
       \param touchIsOverlap
           Does touching constitute an overlap?
 
       \return
-          Whether the AABB overlaps.
+          Whether the box overlaps.
    */
-  bool overlaps(const aabb &aabb, bool touchIsOverlap) const
+  bool overlaps(const box &other, bool touchIsOverlap) const
   {
-    if (touchIsOverlap) {
-      for (unsigned int i = 0; i < Dim; ++i) {
-        if (aabb.upperBound[i] < lowerBound[i] ||
-            aabb.lowerBound[i] > upperBound[i]) {
+    return touchIsOverlap ? overlaps<true>(other) : overlaps<false>(other);
+  }
+
+  /// Test whether the box overlaps this one, with touching fixed at compile time.
+  template <bool TouchIsOverlap>
+  bool overlaps(const box &other) const
+  {
+    for (unsigned int i = 0; i < Dim; ++i) {
+      if constexpr (TouchIsOverlap) {
+        if (other.upperBound[i] < lowerBound[i] || other.lowerBound[i] > upperBound[i])
           return false;
-        }
       }
-    }
-    else {
-      for (unsigned int i = 0; i < Dim; ++i) {
-        if (aabb.upperBound[i] <= lowerBound[i] ||
-            aabb.lowerBound[i] >= upperBound[i]) {
+      else {
+        if (other.upperBound[i] <= lowerBound[i] || other.lowerBound[i] >= upperBound[i])
           return false;
-        }
       }
     }
-
     return true;
   }
 
@@ -273,33 +274,35 @@ class aabb {
           Does touching constitute an overlap?
 
       \return
-          Whether the AABB overlaps.
+          Whether the box overlaps.
    */
   bool overlaps(const point &pt, bool touchIsOverlap) const
   {
-    if (touchIsOverlap) {
-      for (unsigned int i = 0; i < Dim; ++i) {
-        if (pt[i] < lowerBound[i] || pt[i] > upperBound[i]) {
+    return touchIsOverlap ? overlaps<true>(pt) : overlaps<false>(pt);
+  }
+
+  /// Test whether the point overlaps this one, with touching fixed at compile time.
+  template <bool TouchIsOverlap>
+  bool overlaps(const point &pt) const
+  {
+    for (unsigned int i = 0; i < Dim; ++i) {
+      if constexpr (TouchIsOverlap) {
+        if (pt[i] < lowerBound[i] || pt[i] > upperBound[i])
           return false;
-        }
       }
-    }
-    else {
-      for (unsigned int i = 0; i < Dim; ++i) {
-        if (pt[i] <= lowerBound[i] || pt[i] >= upperBound[i]) {
+      else {
+        if (pt[i] <= lowerBound[i] || pt[i] >= upperBound[i])
           return false;
-        }
       }
     }
-
     return true;
   }
 
-  //! Compute the centre of the AABB.
+  //! Compute the centre of the box.
   /*! \returns
-          The position vector of the AABB centre.
+          The position vector of the box centre.
    */
-  point compute_center()
+  point compute_center() const
   {
     point center;
 
@@ -309,18 +312,78 @@ class aabb {
     return center;
   }
 
-  /// Lower bound of AABB in each dimension.
+  /// Lower bound of the box in each dimension.
   point lowerBound;
 
-  /// Upper bound of AABB in each dimension.
+  /// Upper bound of the box in each dimension.
   point upperBound;
 
+  /// The box's surface area.
+  cost_type surfaceArea = 0;
+};
+
+/*! \brief The axis-aligned bounding box object.
+
+    Axis-aligned bounding boxes (AABBs) store information for the minimum
+    orthorhombic bounding-box for an object. Support is provided for
+    dimensions >= 2. (In 2D the bounding box is either a rectangle,
+    in 3D it is a rectangular prism.)
+
+    Class member functions provide functionality for merging AABB objects
+    and testing overlap with other AABBs.
+ */
+template <unsigned Dim, typename ValTy = double>
+class aabb : public box<Dim, ValTy> {
+ public:
+  using box = abt::box<Dim, ValTy>;
+  using point = abt::point<Dim, ValTy>;
+  using value_type = ValTy;
+  using cost_type = detail::cost_type<ValTy>;
+
+  /// Constructor.
+  aabb() = default;
+
+  //! Constructor.
+  /*! \param lowerBound_
+          The lower bound in each dimension.
+
+      \param upperBound_
+          The upper bound in each dimension.
+   */
+  aabb(const point &lower_bound, const point &upper_bound)
+      : box(lower_bound, upper_bound), centre(this->compute_center())
+  {
+  }
+
+  /// Constructor, computing the centre of a box.
+  aabb(const box &bb) : box(bb), centre(this->compute_center()) {}
+
+  static aabb of_sphere(const point &center, value_type radius)
+  {
+    point lb, ub;
+    for (unsigned int i = 0; i < Dim; i++) {
+      lb[i] = center[i] - radius;
+      ub[i] = center[i] + radius;
+    }
+    return {lb, ub};
+  }
+
+  //! Merge two AABBs into this one.
+  /*! \param aabb1
+          A reference to the first AABB.
+
+      \param aabb2
+          A reference to the second AABB.
+   */
+  void merge(const box &aabb1, const box &aabb2)
+  {
+    box::merge(aabb1, aabb2);
+    centre = this->compute_center();
+  }
+
   /// The position of the AABB centre.
   point centre;
 
-  /// The AABB's surface area.
-  value_type surfaceArea = 0;
-
   friend aabb<Dim, ValTy> operator-(const aabb<Dim, ValTy>& lhs, const std::array<ValTy, Dim>& rhs) {
     auto res = lhs;
     res.lowerBound -= rhs;
@@ -338,6 +401,159 @@ class aabb {
   }
 };
 
+/*! \brief A ray, or a segment when limited in length, for ray casts.
+
+    Positions along the ray are origin + t * direction for t >= 0, so a
+    segment from a to b is the ray from a along b - a cut at t = 1.
+ */
+template <unsigned Dim, typename ValTy = double>
+class ray {
+ public:
+  using point = abt::point<Dim, ValTy>;
+  using vec = std::array<double, Dim>;
+
+  /// Constructor.
+  ray() = default;
+
+  //! Constructor.
+  /*! \param origin_
+          The start of the ray.
+
+      \param direction_
+          The direction, not necessarily of unit length.
+   */
+  ray(const point &origin_, const vec &direction_)
+      : direction(direction_)
+  {
+    for (unsigned int i = 0; i < Dim; i++) {
+      origin[i] = origin_[i];
+      inverse[i] = 1 / direction[i];
+    }
+  }
+
+  /// The segment from a to b, covering t in [0, 1].
+  static ray segment(const point &a, const point &b)
+  {
+    vec direction;
+    for (unsigned int i = 0; i < Dim; i++)
+      direction[i] = double(b[i]) - double(a[i]);
+    return {a, direction};
+  }
+
+  //! Intersect the ray with a box using the slab test.
+  /*! \param lowerBound
+          The lower bound in each dimension.
+
+      \param upperBound
+          The upper bound in each dimension.
+
+      \param tMax
+          The end of the part of the ray that counts.
+
+      \param tEnter
+          Set to where the ray enters the box, 0 if it starts inside.
+
+      \return
+          Whether the ray touches the box for some t in [0, tMax].
+   */
+  template <class Bound>
+  bool intersects(const Bound &lowerBound,
+                  const Bound &upperBound,
+                  double tMax,
+                  double &tEnter) const
+  {
+    double tNear = 0, tFar = tMax;
+    for (unsigned int i = 0; i < Dim; i++) {
+      if (direction[i] == 0) {
+        if (origin[i] < lowerBound[i] || origin[i] > upperBound[i])
+          return false;
+        continue;
+      }
+      double t1 = (lowerBound[i] - origin[i]) * inverse[i];
+      double t2 = (upperBound[i] - origin[i]) * inverse[i];
+      tNear = std::max(tNear, std::min(t1, t2));
+      tFar = std::min(tFar, std::max(t1, t2));
+    }
+    tEnter = tNear;
+    return tNear <= tFar;
+  }
+
+  /// The start of the ray, in double precision whatever the value type.
+  vec origin = {};
+
+  /// The direction of the ray.
+  vec direction = {};
+
+  /// The reciprocal of the direction, for the slab tests.
+  vec inverse = {};
+};
+
+namespace detail {
+//! The periodic images of a ray that can reach a box, nearest first.
+/*! \param r
+        The ray.
+
+    \param lowerBound
+        The lower bound of the box, e.g. the root of a tree.
+
+    \param upperBound
+        The upper bound of the box.
+
+    \param tMax
+        The length of the ray; it must be finite along periodic axes that
+        the ray moves along.
+
+    \param bounds
+        The periodic box, zero along non-periodic axes.
+
+    \return
+        Pairs of the entry t into the box and the image of the ray, with
+        the origin moved by whole periods.
+ */
+template <unsigned Dim, typename ValTy, class Bound, class Bounds>
+std::vector<std::pair<double, ray<Dim, ValTy>>> ray_images(
+    const ray<Dim, ValTy> &r,
+    const Bound &lowerBound,
+    const Bound &upperBound,
+    double tMax,
+    const Bounds &bounds)
+{
+  // The range of whole periods to shift by along each axis.
+  std::array<long, Dim> first = {}, last = {};
+  for (unsigned int i = 0; i < Dim; i++) {
+    if (bounds[i] == 0)
+      continue;
+    assert(r.direction[i] == 0 || std::isfinite(tMax));
+    double lo = std::min(r.origin[i], r.origin[i] + r.direction[i] * tMax);
+    double hi = std::max(r.origin[i], r.origin[i] + r.direction[i] * tMax);
+    first[i] = std::ceil((lo - upperBound[i]) / bounds[i]);
+    last[i] = std::floor((hi - lowerBound[i]) / bounds[i]);
+  }
+
+  std::vector<std::pair<double, ray<Dim, ValTy>>> images;
+  std::array<long, Dim> k = first;
+  while (true) {
+    auto image = r;
+    for (unsigned int i = 0; i < Dim; i++)
+      image.origin[i] -= k[i] * double(bounds[i]);
+    double tEnter;
+    if (image.intersects(lowerBound, upperBound, tMax, tEnter))
+      images.emplace_back(tEnter, image);
+
+    unsigned int i = 0;
+    for (; i < Dim && k[i] == last[i]; i++)
+      k[i] = first[i];
+    if (i == Dim)
+      break;
+    k[i]++;
+  }
+
+  std::sort(images.begin(), images.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  return images;
+}
+}  // namespace detail
+
 template <unsigned Dim, typename ValTy = double>
 aabb<Dim, ValTy> fattened(aabb<Dim, ValTy> bb, double skin_thickness)
 {
@@ -352,455 +568,3585 @@ aabb<Dim, ValTy> fattened(aabb<Dim, ValTy> bb, double skin_thickness)
 }
 
 
-enum visit_action : char { visit_stop, visit_continue };
+namespace detail {
+/// Resolve a requested number of threads, where 0 means one per core.
+inline unsigned int thread_count(unsigned int threads)
+{
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  return threads;
+}
 
-/*! \brief The dynamic AABB tree.
+//! Split [0, n) into one contiguous chunk per thread and process them.
+/*! \param threads
+        The number of chunks, each running on its own thread. The chunk
+        boundaries only depend on threads and n.
 
-    The dynamic AABB tree is a hierarchical data structure that can be used
-    to efficiently query overlaps between objects of arbitrary shape and
-    size that lie inside of a simulation box. Support is provided for
-    periodic and non-periodic boxes, as well as boxes with partial
-    periodicity, e.g. periodic along specific axes.
+    \param fn
+        Called as fn(begin, end, chunk).
  */
-template <unsigned Dim, typename ValTy = double>
-class tree {
-  static_assert(Dim > 0, "0-dimensional tree is not supported");
+template <class Fn>
+void parallel_chunks(unsigned int threads, std::size_t n, Fn &&fn)
+{
+  if (threads <= 1) {
+    fn(std::size_t(0), n, 0u);
+    return;
+  }
+
+  std::vector<std::thread> pool;
+  pool.reserve(threads - 1);
+  for (unsigned int t = 1; t < threads; t++) {
+    pool.emplace_back(
+        [&fn, t, threads, n] { fn(t * n / threads, (t + 1) * n / threads, t); });
+  }
+  fn(std::size_t(0), n / threads, 0u);
+  for (auto &thread : pool)
+    thread.join();
+}
+
+//! Process n independent tasks, handing them out to threads on demand.
+/*! \param fn
+        Called as fn(task) or fn(task, thread) for every task in [0, n).
+ */
+template <class Fn>
+void parallel_tasks(unsigned int threads, std::size_t n, Fn &&fn)
+{
+  std::atomic<std::size_t> next = 0;
+  parallel_chunks(std::min<std::size_t>(threads, n), n,
+                  [&](std::size_t, std::size_t, unsigned int thread) {
+                    for (std::size_t i = next++; i < n; i = next++) {
+                      if constexpr (std::is_invocable_v<Fn &, std::size_t, unsigned int>)
+                        fn(i, thread);
+                      else
+                        fn(i);
+                    }
+                  });
+}
+
+/*! \brief Threads kept alive from one parallel query to the next.
+
+    Each worker waits for a job and runs its share, keeping its thread_local
+    state, such as traversal stacks, for the next job. One job runs at a
+    time; a job started while another holds the workers, e.g. from one of
+    its callbacks, runs on threads of its own instead.
+ */
+class worker_pool {
  public:
-  using value_type = ValTy;
-  using aabb = abt::aabb<Dim, value_type>;
-  using point = abt::point<Dim, value_type>;
-  template <typename Ty>
-  using vec = std::array<Ty, Dim>;
+  /// The pool shared by every tree.
+  static worker_pool &instance()
+  {
+    static worker_pool pool;
+    return pool;
+  }
 
-  enum class node_id : uint32_t {};
-  
-  float skin_width = 0.01f;
+  ~worker_pool()
+  {
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_stop = true;
+    }
+    m_start.notify_all();
+    for (auto &worker : m_workers)
+      worker.join();
+  }
 
- private:
-  static vec<ValTy> minimum_image_shift(const vec<ValTy> &bounds,
-                                 const vec<ValTy> &delta)
+  //! Run fn(thread) for every thread in [0, threads), thread 0 on the caller.
+  template <class Fn>
+  void run(unsigned int threads, Fn &&fn)
   {
-    vec<ValTy> shift = {};
+    if (threads <= 1) {
+      fn(0u);
+      return;
+    }
+    if (m_busy.exchange(true)) {
+      parallel_chunks(threads, threads,
+                      [&](std::size_t, std::size_t, unsigned int thread) { fn(thread); });
+      return;
+    }
 
-    for (unsigned int i = 0; i < Dim; i++) {
-      if (delta[i] < -(bounds[i] / 2)) {
-        shift[i] = -bounds[i];
-      }
-      else if (delta[i] >= bounds[i] / 2) {
-        shift[i] = bounds[i];
+    std::function<void(unsigned int)> job = [&fn](unsigned int thread) { fn(thread); };
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      while (m_workers.size() < threads - 1) {
+        unsigned int index = m_workers.size();
+        m_workers.emplace_back([this, index] { work(index); });
       }
+      m_job = &job;
+      m_active = threads - 1;
+      m_running = threads - 1;
+      m_generation++;
     }
-    return shift;
+    m_start.notify_all();
+    fn(0u);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_done.wait(lock, [this] { return m_running == 0; });
+    m_job = nullptr;
+    lock.unlock();
+    m_busy = false;
   }
-  /*! \brief A node of the AABB tree.
 
-   Each node of the tree contains an AABB object which corresponds to a
-   entry, or a group of entrys, in the simulation box. The AABB
-   objects of individual entrys are "fattened" before they are stored
-   to avoid having to continually update and rebalance the tree when
-   displacements are small.
-
-   Nodes are aware of their position within in the tree. The isLeaf member
-   function allows the tree to query whether the node is a leaf, i.e. to
-   determine whether it holds a single entry.
-  */
+ private:
+  void work(unsigned int index)
+  {
+    std::uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true) {
+      m_start.wait(lock, [&] { return m_stop || (m_generation != seen && index < m_active); });
+      if (m_stop)
+        return;
+      seen = m_generation;
+      auto *job = m_job;
+      lock.unlock();
+      (*job)(index + 1);
+      lock.lock();
+      if (--m_running == 0)
+        m_done.notify_one();
+    }
+  }
 
-  static constexpr unsigned int NULL_NODE = 0xffffffff;
+  std::vector<std::thread> m_workers;
+  std::mutex m_lock;
+  std::condition_variable m_start, m_done;
 
-  struct node {
-    /// Constructor.
-    node() = default;
+  /// The job being run, and how many workers take part and are not done.
+  std::function<void(unsigned int)> *m_job = nullptr;
+  unsigned int m_active = 0, m_running = 0;
 
-    /// The fattened axis-aligned bounding box.
-    aabb bb;
+  /// Bumped for every job, so that a worker runs each one once.
+  std::uint64_t m_generation = 0;
 
-    /// Index of the parent node.
-    unsigned int parent = NULL_NODE;
+  bool m_stop = false;
+  std::atomic<bool> m_busy = false;
+};
 
-    /// Index of the next node.
-    unsigned int next = 0;
+/*! \brief The per-thread task queues of work_stealing.
 
-    /// Index of the left-hand child.
-    unsigned int left = NULL_NODE;
+    Each thread pushes and pops at the back of its own queue and steals
+    from the front of the others', where the oldest and so largest tasks
+    are. Every queue has its own lock, so threads only contend when one
+    of them steals.
+ */
+template <class Task>
+class task_pool {
+ public:
+  task_pool(unsigned int threads, std::vector<Task> tasks)
+      : m_queues(threads), m_pending(tasks.size()), m_queued(tasks.size())
+  {
+    for (std::size_t i = 0; i < tasks.size(); i++)
+      m_queues[i % threads].tasks.push_back(std::move(tasks[i]));
+  }
 
-    /// Index of the right-hand child.
-    unsigned int right = NULL_NODE;
+  /// Whether some thread is waiting for work.
+  bool hungry() const { return m_idle.load(std::memory_order_relaxed) > 0; }
 
-    /// Height of the node. This is 0 for a leaf and -1 for a free node.
-    int height = 0;
-    
-    void* user_data = nullptr;
-
-    //! Test whether the node is a leaf.
-    /*! \return
-            Whether the node is a leaf node.
-     */
-    bool isLeaf() const { return (height == 0); }
-  };
-
- public:
-  //! Constructor (non-periodic).
-  /*! \param skin_thickness
-          The skin thickness for fattened AABBs, as a fraction
-          of the AABB base length.
-
-      \param initial_size
-          The number of entries (for fixed entry number systems).
+  /// Offer a new task, to be run by this thread or stolen by another.
+  void spawn(unsigned int thread, Task task)
+  {
+    m_pending++;
+    {
+      auto &q = m_queues[thread];
+      std::lock_guard<std::mutex> guard(q.lock);
+      q.tasks.push_back(std::move(task));
+    }
+    m_queued++;
+    wake(false);
+  }
 
+  //! Run tasks on a thread until there are none left anywhere.
+  /*! A thread finding no task sleeps until one is spawned or the last
+      running task finishes.
    */
-  tree(unsigned int initial_size = 16)
+  template <class Fn>
+  void run(unsigned int thread, Fn &fn)
   {
-    // Initialise the tree.
-    m_root = NULL_NODE;
-    m_node_count = 0;
-    m_node_capacity = initial_size;
-    m_nodes.resize(m_node_capacity);
+    while (m_pending.load() > 0) {
+      Task task;
+      if (!take(thread, task)) {
+        std::unique_lock<std::mutex> lock(m_wait_lock);
+        m_idle++;
+        m_wake.wait(lock, [this] { return m_pending.load() == 0 || m_queued.load() > 0; });
+        m_idle--;
+        continue;
+      }
 
-    // Build a linked list for the list of free nodes.
-    for (unsigned int i = 0; i < m_node_capacity - 1; i++) {
-      m_nodes[i].next = i + 1;
-      m_nodes[i].height = -1;
+      fn(thread, std::move(task), *this);
+      if (--m_pending == 0)
+        wake(true);
     }
-    m_nodes[m_node_capacity - 1].next = NULL_NODE;
-    m_nodes[m_node_capacity - 1].height = -1;
-
-    // Assign the index of the first free node.
-    m_free_list = 0;
   }
 
-  /// Build an optimal tree.
-  tree(std::vector<aabb> bbs)
-  {
-    auto count = bbs.size();
-
-    m_root = NULL_NODE;
-    m_node_count = count;
-    m_leaf_count = count;
-    m_node_capacity = count * 2;
-    m_nodes.resize(m_node_capacity);
+ private:
+  struct queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
 
-    // Build a linked list for the list of free nodes.
-    for (unsigned int i = count; i < m_node_capacity - 1; i++) {
-      m_nodes[i].next = i + 1;
-      m_nodes[i].height = -1;
+  bool take(unsigned int thread, Task &task)
+  {
+    {
+      auto &q = m_queues[thread];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        m_queued--;
+        return true;
+      }
     }
-    m_nodes[m_node_capacity - 1].next = NULL_NODE;
-    m_nodes[m_node_capacity - 1].height = -1;
 
-    // Assign the index of the first free node.
-    m_free_list = count;
+    for (std::size_t i = 1; i < m_queues.size(); i++) {
+      auto &q = m_queues[(thread + i) % m_queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        m_queued--;
+        return true;
+      }
+    }
+    return false;
+  }
 
-    std::vector<unsigned int> node_indices(count);
-    std::iota(node_indices.begin(), node_indices.end(), 0);
+  /// Wake one sleeping thread for a new task, or all of them to finish.
+  void wake(bool all)
+  {
+    if (m_idle.load() == 0 && !all)
+      return;
+    { std::lock_guard<std::mutex> guard(m_wait_lock); }
+    if (all)
+      m_wake.notify_all();
+    else
+      m_wake.notify_one();
+  }
 
-    for (unsigned i = 0; i < count; ++i) {
-      m_nodes[i].bb = bbs[i];
-    }
+  std::vector<queue> m_queues;
 
-    while (count > 1) {
-      double minCost = std::numeric_limits<double>::max();
-      int iMin = -1, jMin = -1;
+  /// Tasks queued or running.
+  std::atomic<std::size_t> m_pending;
 
-      for (unsigned int i = 0; i < count; i++) {
-        aabb aabbi = m_nodes[node_indices[i]].bb;
-
-        for (unsigned int j = i + 1; j < count; j++) {
-          aabb aabbj = m_nodes[node_indices[j]].bb;
-          aabb aabb;
-          aabb.merge(aabbi, aabbj);
-          double cost = aabb.get_surface_area();
-
-          if (cost < minCost) {
-            iMin = i;
-            jMin = j;
-            minCost = cost;
-          }
-        }
-      }
+  /// Tasks queued and not yet taken.
+  std::atomic<std::size_t> m_queued;
 
-      unsigned int index1 = node_indices[iMin];
-      unsigned int index2 = node_indices[jMin];
+  /// Threads currently without work, sleeping on m_wake.
+  std::atomic<unsigned int> m_idle = 0;
+  std::mutex m_wait_lock;
+  std::condition_variable m_wake;
+};
 
-      unsigned int parent = allocate_node();
-      m_nodes[parent].left = index1;
-      m_nodes[parent].right = index2;
-      m_nodes[parent].height =
-          1 + std::max(m_nodes[index1].height, m_nodes[index2].height);
-      m_nodes[parent].bb.merge(m_nodes[index1].bb, m_nodes[index2].bb);
-      m_nodes[parent].parent = NULL_NODE;
+//! Run tasks on several threads that steal from each other.
+/*! \param tasks
+        The initial tasks, dealt out round robin.
 
-      m_nodes[index1].parent = parent;
-      m_nodes[index2].parent = parent;
+    \param fn
+        Called as fn(thread, task, pool) and may call pool.spawn(thread, t)
+        to split off more work, typically when pool.hungry().
+ */
+template <class Task, class Fn>
+void work_stealing(unsigned int threads, std::vector<Task> tasks, Fn &&fn)
+{
+  task_pool<Task> pool(threads, std::move(tasks));
+  worker_pool::instance().run(threads, [&](unsigned int thread) { pool.run(thread, fn); });
+}
 
-      node_indices[jMin] = node_indices[count - 1];
-      node_indices[iMin] = parent;
-      count--;
-    }
+/// Move the contents of per-thread buffers to the end of out.
+template <class T>
+void concatenate(std::vector<std::vector<T>> &buffers, std::vector<T> &out)
+{
+  std::size_t total = out.size();
+  for (const auto &buffer : buffers)
+    total += buffer.size();
+  out.reserve(total);
+  for (auto &buffer : buffers)
+    out.insert(out.end(), buffer.begin(), buffer.end());
+}
 
-    m_root = node_indices[0];
+//! Invoke a query callback with whichever of (id, bb) it accepts.
+template <class Fn, class Id, class Box>
+decltype(auto) call_with_args(Fn &&fn, Id id, const Box &bb)
+{
+  constexpr bool call_id_bb = std::is_invocable_v<Fn, Id, Box>;
+  constexpr bool call_id = std::is_invocable_v<Fn, Id>;
+  constexpr bool call_bb = std::is_invocable_v<Fn, Box>;
+  constexpr bool call_none = std::is_invocable_v<Fn>;
+
+  static_assert(call_id_bb || call_id || call_bb || call_none,
+                "Callback has unsupported signature");
+  if constexpr (call_id_bb) {
+    return std::forward<Fn>(fn)(id, bb);
+  }
+  else if constexpr (call_id) {
+    return std::forward<Fn>(fn)(id);
+  }
+  else if constexpr (call_bb) {
+    return std::forward<Fn>(fn)(bb);
+  }
+  else {
+    return std::forward<Fn>(fn)();
+  }
+}
 
-    validate();
+//! Invoke a query callback with (id, bb, payload) if it takes the payload.
+template <class Fn, class Id, class Box, class Payload>
+decltype(auto) call_with_args(Fn &&fn, Id id, const Box &bb,
+                              const Payload &payload)
+{
+  if constexpr (std::is_invocable_v<Fn, Id, Box, Payload>) {
+    return std::forward<Fn>(fn)(id, bb, payload);
+  }
+  else {
+    return call_with_args(std::forward<Fn>(fn), id, bb);
   }
+}
 
-  //! Insert a entry into the tree (arbitrary shape with bounding box).
-  /*! \param index
-          The index of the entry.
+/*! \brief Indexed storage for the nodes of a tree.
 
-      \param lowerBound
-          The lower bound in each dimension.
+    Elements live either in one contiguous block, which is reallocated and
+    moved as it grows, or in fixed-size pages that are never moved, so
+    growing costs one page allocation and no copies. Memory comes from a
+    std::pmr memory resource either way.
+ */
+template <class T>
+class node_pool {
+ public:
+  //! Constructor.
+  /*! \param page_size
+          The number of elements per page, rounded up to a power of two, or
+          0 for a single contiguous block.
 
-      \param upperBound
-          The upper bound in each dimension.
+      \param resource
+          Where the memory comes from.
    */
-  node_id insert(const aabb &bb, void* user_data = nullptr)
+  explicit node_pool(unsigned int page_size = 0,
+                     std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : m_resource(resource)
   {
-    // Allocate a new node for the entry.
-    unsigned int node_idx = allocate_node();
-    auto &node = m_nodes[node_idx];
-    node.bb = fattened(bb, skin_width);
-    node.user_data = user_data;
+    if (page_size != 0) {
+      m_shift = std::bit_width(std::bit_ceil(page_size)) - 1;
+      m_mask = (1u << m_shift) - 1;
+    }
+  }
 
-    // Zero the height.
-    node.height = 0;
+  /// Copies use the default resource, as std::pmr containers do.
+  node_pool(const node_pool &other)
+      : m_shift(other.m_shift), m_mask(other.m_mask)
+  {
+    resize(other.m_size);
+    for (std::size_t i = 0; i < m_size; i++)
+      (*this)[i] = other[i];
+  }
 
-    // Insert a new leaf into the tree.
-    insert_leaf(node_idx);
-    return to_id(node_idx);
+  node_pool(node_pool &&other) noexcept { swap(other); }
+
+  node_pool &operator=(node_pool other) noexcept
+  {
+    swap(other);
+    return *this;
   }
-  
-  void* data(node_id id) const {
-    auto node = to_unsigned(id);
-    auto &n = m_nodes[node];
-    
-    assert(node < m_node_capacity);
-    assert(n.isLeaf());
-    
-    return n.user_data;
+
+  ~node_pool() { resize(0); }
+
+  void swap(node_pool &other) noexcept
+  {
+    std::swap(m_pages, other.m_pages);
+    std::swap(m_size, other.m_size);
+    std::swap(m_shift, other.m_shift);
+    std::swap(m_mask, other.m_mask);
+    std::swap(m_resource, other.m_resource);
   }
 
-  /// Return the number of entrys in the tree.
-  unsigned int size() const { return m_leaf_count; }
+  T &operator[](std::size_t i) { return m_pages[i >> m_shift][i & m_mask]; }
+  const T &operator[](std::size_t i) const { return m_pages[i >> m_shift][i & m_mask]; }
 
-  //! Remove a entry from the tree.
-  /*! \param entry
-          The entry index (entryMap will be used to map the node).
-   */
+  std::size_t size() const { return m_size; }
 
-  static constexpr unsigned to_unsigned(node_id id) { return static_cast<unsigned>(id); }
-  static constexpr node_id to_id(unsigned node) { return static_cast<node_id>(node); }
+  /// The number of elements per page, 0 when contiguous.
+  std::size_t page_size() const { return is_paged() ? m_mask + 1 : 0; }
 
-  void remove(node_id node_id)
+  std::pmr::memory_resource *resource() const { return m_resource; }
+
+  /// The number of contiguous runs the elements are stored in.
+  std::size_t blocks() const { return m_pages.size(); }
+
+  //! The elements of run i, for copying them in bulk.
+  std::span<T> block(std::size_t i)
   {
-    auto node = to_unsigned(node_id);
-    remove_leaf(node);
-    free_node(node);
+    std::size_t first = is_paged() ? i << m_shift : 0;
+    return {m_pages[i], std::min(m_size - first, is_paged() ? m_mask + 1 : m_size)};
   }
 
-  /// Remove all entrys from the tree.
-  void clear()
+  std::span<const T> block(std::size_t i) const
   {
-    for_each([this](node_id id, const auto &) { remove(id); });
+    return const_cast<node_pool *>(this)->block(i);
   }
 
-  //! Update the tree if a entry moves outside its fattened AABB.
-  /*! \param entry
-          The entry index (entryMap will be used to map the node).
+  //! Grow or shrink to n elements.
+  /*! New elements are default constructed. When paged, the existing
+      elements keep their addresses.
+   */
+  void resize(std::size_t n)
+  {
+    if (!is_paged()) {
+      T *block = nullptr;
+      if (n != 0) {
+        block = allocate(n);
+        std::size_t kept = std::min(n, m_size);
+        std::uninitialized_move_n(m_pages.empty() ? nullptr : m_pages[0], kept, block);
+        std::uninitialized_default_construct_n(block + kept, n - kept);
+      }
+      if (!m_pages.empty()) {
+        std::destroy_n(m_pages[0], m_size);
+        deallocate(m_pages[0], m_size);
+        m_pages.clear();
+      }
+      if (block)
+        m_pages.push_back(block);
+      m_size = n;
+      return;
+    }
 
-      \param lowerBound
-          The lower bound in each dimension.
+    const std::size_t pageSize = m_mask + 1;
+    const std::size_t pages = (n + pageSize - 1) >> m_shift;
+    while (m_pages.size() > pages) {
+      std::destroy_n(m_pages.back(), pageSize);
+      deallocate(m_pages.back(), pageSize);
+      m_pages.pop_back();
+    }
+    while (m_pages.size() < pages) {
+      T *page = allocate(pageSize);
+      std::uninitialized_default_construct_n(page, pageSize);
+      m_pages.push_back(page);
+    }
+    m_size = n;
+  }
 
-      \param upperBound
-          The upper bound in each dimension.
+ private:
+  bool is_paged() const { return m_shift != block_shift; }
 
-      \param alwaysReinsert
-          Always reinsert the entry, even if it's within its old AABB
-     (default: false)
-   */
-  bool update(node_id id, aabb bb, bool always_reinsert = false)
+  T *allocate(std::size_t n)
   {
-    auto node = to_unsigned(id);
-    auto &n = m_nodes[node];
+    return static_cast<T *>(m_resource->allocate(n * sizeof(T), alignof(T)));
+  }
 
-    assert(node < m_node_capacity);
-    assert(n.isLeaf());
+  void deallocate(T *p, std::size_t n) { m_resource->deallocate(p, n * sizeof(T), alignof(T)); }
 
-    // No need to update if the entry is still within its fattened AABB.
-    if (!always_reinsert && n.bb.contains(bb))
-      return false;
+  /// Indices never reach this shift, so a contiguous block is page 0.
+  static constexpr unsigned int block_shift = 32;
 
-    // Remove the current leaf.
-    remove_leaf(node);
+  /// The pages, or the single block.
+  std::vector<T *> m_pages;
 
-    // Assign the new AABB.
-    n.bb = fattened(bb, skin_width);
+  /// The number of elements.
+  std::size_t m_size = 0;
 
-    // Insert a new leaf node.
-    insert_leaf(node);
+  /// Index bits within a page, and the mask selecting them.
+  unsigned int m_shift = block_shift;
+  std::size_t m_mask = ~std::size_t(0);
 
-    return true;
-  }
+  std::pmr::memory_resource *m_resource = std::pmr::get_default_resource();
+};
 
-  //! Query the tree to find candidate interactions for an AABB.
-  /*! \param aabb
-          The AABB.
-      \param out
-          An output iterator
+/*! \brief The head of a saved tree.
 
-      \return entrys
-          A vector of entry indices.
+    A saved tree is this header followed by the periodic bounds, the nodes,
+    the branches and the handle table, each at the offset recorded here and
+    aligned to a cache line. Everything is stored in the byte order and
+    layout of the machine that saved it, so the layout fields are checked
+    to turn away a file written by a different build rather than misread it.
+ */
+struct file_header {
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t dim;
+  std::uint32_t value_code;
+  std::uint32_t payload_size;
+  std::uint32_t node_size;
+  std::uint32_t branch_size;
+  std::uint32_t root;
+  std::uint32_t node_count;
+  std::uint32_t leaf_count;
+  std::uint32_t node_capacity;
+  std::uint32_t free_list;
+  std::uint32_t handle_count;
+  std::uint32_t free_handle;
+  float skin_width;
+  std::uint32_t skin;
+  std::uint32_t adaptive_skin;
+  std::uint32_t insertion;
+  std::uint64_t bounds_offset;
+  std::uint64_t nodes_offset;
+  std::uint64_t branches_offset;
+  std::uint64_t handles_offset;
+  std::uint64_t file_size;
+};
+
+inline constexpr std::array<char, 8> file_magic = {'A', 'B', 'T', 'T', 'R', 'E', 'E', '\0'};
+inline constexpr std::uint32_t file_version = 3;
+
+/// Sections of a saved tree start on multiples of this many bytes.
+inline constexpr std::uint64_t file_alignment = 64;
+
+inline std::uint64_t file_align(std::uint64_t offset)
+{
+  return (offset + file_alignment - 1) / file_alignment * file_alignment;
+}
+
+/// Tells apart value types of the same size, e.g. int and float.
+template <class T>
+constexpr std::uint32_t value_code()
+{
+  return sizeof(T) | std::is_floating_point_v<T> << 8 | std::is_signed_v<T> << 9;
+}
+}  // namespace detail
+
+enum visit_action : char { visit_stop, visit_continue };
+
+/// How the skin added around each entry's AABB is sized.
+enum class skin_mode : char {
+  /// skin_width is a length.
+  absolute,
+  /// skin_width is a fraction of the entry's extent along each axis.
+  relative
+};
+
+/// How an inserted entry picks the node it becomes the sibling of.
+enum class insert_strategy : char {
+  /// Descend one path from the root, stepping to the cheaper child.
+  greedy,
+  /// Search the whole tree best first for the sibling of least total cost.
+  branch_and_bound
+};
+
+/// Algorithms available for building a tree from a complete set of AABBs.
+enum class build_strategy : char {
+  /// Top-down partitioning driven by a binned surface area heuristic.
+  binned_sah,
+  /// Linear BVH: recursive splits on the Morton codes of the AABB centres.
+  lbvh,
+  /// Locally-ordered agglomerative clustering of Morton-sorted AABBs.
+  ploc
+};
+
+/// Options for building a tree from a complete set of AABBs.
+struct build_options {
+  /// The construction algorithm.
+  build_strategy strategy = build_strategy::binned_sah;
+
+  /// The number of threads to build with, 0 uses one per core.
+  unsigned int threads = 1;
+};
+
+/// Where and how a tree stores its nodes.
+struct pool_options {
+  /// The memory resource the nodes are allocated from.
+  std::pmr::memory_resource *resource = std::pmr::get_default_resource();
+
+  //! Nodes per page, 0 to keep the nodes in one contiguous block.
+  /*! Paged pools grow a page at a time without moving any node, rather
+      than doubling and copying.
    */
-  template <class Query, class OutputIterator>
-  void get_overlaps(const Query &query,
-                    OutputIterator out,
-                    bool include_touch = true,
-                    const vec<ValTy> &bounds = {}) const
+  unsigned int page_size = 0;
+};
+
+/*! \brief Work counted over one or more queries by visit_overlaps.
+
+    Pass one to the counting overload of visit_overlaps; counts add up
+    over every query it is passed to. Queries not given one count nothing
+    and pay nothing for it.
+ */
+struct query_counters {
+  /// Internal nodes whose children were tested.
+  std::size_t nodes_visited = 0;
+
+  /// Leaves tested against the query.
+  std::size_t leaves_tested = 0;
+
+  /// Internal nodes visited with neither child overlapping the query.
+  std::size_t false_positives = 0;
+
+  /// The deepest the traversal stack grew.
+  std::size_t stack_high_water = 0;
+
+  void visit_node() { nodes_visited++; }
+  void test_leaf() { leaves_tested++; }
+  void miss() { false_positives++; }
+  void stack_size(std::size_t size) { stack_high_water = std::max(stack_high_water, size); }
+};
+
+namespace detail {
+/// The counters of an uncounted query, which compile away.
+struct no_counters {
+  void visit_node() {}
+  void test_leaf() {}
+  void miss() {}
+  void stack_size(std::size_t) {}
+};
+
+//! A traversal stack held in place, for trees no taller than its capacity.
+/*! A depth-first walk keeps at most one pending node per level, so a tree
+    of height h needs a stack of h entries. Should a walk need more, as
+    over a tree whose heights are wrong, the bottom of the stack moves to
+    the heap rather than the top running past the end; the top stays in
+    place, so data() and operator[] see one block only until then.
+ */
+template <class T, unsigned int N>
+class inline_stack {
+ public:
+  static constexpr unsigned int capacity = N;
+
+  void clear()
   {
-    visit_overlaps(
-        query, [&](node_id id) { *out++ = id; }, include_touch, bounds);
+    m_size = 0;
+    m_spill.clear();
   }
 
-  //! Query the tree to find candidate interactions for an AABB.
-  /*! \param aabb
-          The AABB.
+  bool empty() const { return m_size == 0; }
+  std::size_t size() const { return m_spill.size() + m_size; }
 
-      \return entrys
-          A vector of entry indices.
-   */
-  template <class Query>
-  std::vector<node_id> get_overlaps(const Query &query,
-                                         bool include_touch = true,
-                                         const vec<ValTy> &bounds = {}) const
+  void push_back(const T &value)
   {
-    std::vector<node_id> overlaps;
-    visit_overlaps(
-        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
-    return overlaps;
+    if (m_size == N) [[unlikely]]
+      spill();
+    m_values[m_size++] = value;
   }
 
-  template <class Query>
-  bool any_overlap(const Query &query,
-                   bool include_touch = true,
-                   const vec<ValTy> &bounds = {}) const
+  void pop_back()
   {
-    return any_overlap(
-        query, [] { return true; }, include_touch, bounds);
+    if (--m_size == 0 && !m_spill.empty()) [[unlikely]]
+      refill();
   }
 
-  template <class Query, class Fn>
-  bool any_overlap(const Query &query, Fn &&fn, bool include_touch = true,
-                   const vec<ValTy> &bounds = {}) const
+  const T &back() const { return m_values[m_size - 1]; }
+
+  const T *data() const { return m_values.data(); }
+  const T &operator[](std::size_t i) const
   {
-    bool overlap = false;
-    auto wrap_fn = [&overlap, &fn](node_id id, const aabb &bb) {
-      bool success = call_with_args(std::forward<Fn>(fn), id, bb);
-      overlap |= success;
-      return success ? visit_stop : visit_continue;
-    };
-    visit_overlaps(query, wrap_fn, include_touch, bounds);
-    return overlap;
+    return i < m_spill.size() ? m_spill[i] : m_values[i - m_spill.size()];
   }
 
-  template <class Fn>
-  void for_each(Fn &&fn) const
+ private:
+  static constexpr unsigned int half = (N + 1) / 2;
+
+  /// Move the bottom half of the entries in place to the heap.
+  void spill()
   {
-    for (auto idx = 0ull; idx < m_nodes.size(); ++idx) {
-      const auto &node = m_nodes[idx];
-      if (node.isLeaf()) {
-        call_with_args(std::forward<Fn>(fn), to_id(idx), node.bb);
-      }
-    }
+    m_spill.insert(m_spill.end(), m_values.begin(), m_values.begin() + half);
+    std::copy(m_values.begin() + half, m_values.end(), m_values.begin());
+    m_size = N - half;
   }
 
-  template <class Query, class Fn>
-  void visit_overlaps(const Query &query,
-                      Fn &&fn,
+  /// Move entries back in place from the heap once those in place are gone.
+  void refill()
+  {
+    m_size = std::min<std::size_t>(half, m_spill.size());
+    std::copy(m_spill.end() - m_size, m_spill.end(), m_values.begin());
+    m_spill.resize(m_spill.size() - m_size);
+  }
+
+  std::array<T, N> m_values;
+  unsigned int m_size = 0;
+
+  /// The entries below those in place, bottom first.
+  std::vector<T> m_spill;
+};
+}  // namespace detail
+
+/// A summary of the shape and storage of a tree, made by tree::stats().
+struct tree_stats {
+  /// The number of entries.
+  unsigned int leaves = 0;
+
+  /// The height of the tree.
+  unsigned int height = 0;
+
+  /// The surface area heuristic cost, as get_sah_cost().
+  double sah_cost = 0;
+
+  /// The number of leaves at each depth, the root at depth 0.
+  std::vector<unsigned int> leaf_depths;
+
+  //! The mean shared volume of sibling boxes, relative to their parent's.
+  /*! Queries in the shared part have to search both siblings, so this
+      grows as the tree degrades.
+   */
+  double sibling_overlap = 0;
+
+  /// The number of free nodes in the pool.
+  unsigned int free_nodes = 0;
+
+  /// The fraction of the pool that is free slots below the last node in use.
+  double fragmentation = 0;
+
+  /// The bytes held by the nodes, branches and handle table.
+  std::size_t memory_bytes = 0;
+};
+
+/*! \brief Bulk construction of bounding volume hierarchies.
+
+    Builds a binary hierarchy over a fixed set of AABBs in O(n log n) time.
+    The result holds the n - 1 internal nodes of the hierarchy, ordered such
+    that every child precedes its parent, so the root is the last entry.
+
+    A child reference r < n refers to the input AABB at index r, any other
+    reference refers to the internal node at index r - n.
+ */
+template <unsigned Dim, typename ValTy = double>
+class bulk_builder {
+ public:
+  using value_type = ValTy;
+  using aabb = abt::aabb<Dim, value_type>;
+  using point = abt::point<Dim, value_type>;
+
+  /// An internal node of the hierarchy.
+  struct node {
+    /// The AABB enclosing both children.
+    aabb bb;
+
+    /// Reference to the left-hand child.
+    unsigned int left = 0;
+
+    /// Reference to the right-hand child.
+    unsigned int right = 0;
+
+    /// Height of the node above its deepest leaf.
+    int height = 1;
+  };
+
+  /// The number of centre bins per axis used by the SAH builder.
+  static constexpr unsigned int sah_bins = 16;
+
+  /// The neighbourhood searched on each side of a cluster by PLOC.
+  static constexpr unsigned int ploc_radius = 8;
+
+  /// Ranges at least this large are split with all threads cooperating.
+  static constexpr unsigned int parallel_split_size = 1 << 15;
+
+  //! Build a hierarchy over a set of AABBs.
+  /*! \param leaves
+          The AABBs of the entries.
+
+      \param options
+          The construction algorithm and the number of threads.
+
+      \return
+          The internal nodes, children before parents.
+   */
+  static std::vector<node> build(std::span<const aabb> leaves,
+                                 const build_options &options = {})
+  {
+    std::vector<node> nodes;
+    if (leaves.size() < 2)
+      return nodes;
+
+    unsigned int threads = detail::thread_count(options.threads);
+    nodes.resize(leaves.size() - 1);
+    switch (options.strategy) {
+      case build_strategy::binned_sah:
+        build_binned_sah(leaves, nodes, threads);
+        break;
+      case build_strategy::lbvh:
+        build_lbvh(leaves, nodes, threads);
+        break;
+      case build_strategy::ploc:
+        build_ploc(leaves, nodes, threads);
+        break;
+    }
+    return nodes;
+  }
+
+  //! Compute the Morton order of a set of AABBs.
+  /*! \param leaves
+          The AABBs of the entries.
+
+      \param threads
+          The number of threads to use.
+
+      \return
+          Pairs of Morton code and input index, sorted by code and then
+          by index.
+   */
+  static std::vector<std::pair<std::uint64_t, unsigned int>> morton_order(
+      std::span<const aabb> leaves,
+      unsigned int threads = 1)
+  {
+    std::size_t count = leaves.size();
+    std::vector<std::pair<std::uint64_t, unsigned int>> codes(count);
+    threads = std::max<std::size_t>(
+        1, std::min<std::size_t>(threads, count / parallel_grain));
+
+    // Reduce the centre bounds over all chunks.
+    std::vector<vec> los(threads), his(threads);
+    detail::parallel_chunks(threads, count, [&](auto begin, auto end, auto t) {
+      centre_bounds(leaves.subspan(begin, end - begin), los[t], his[t]);
+    });
+    vec lo = los[0], hi = his[0];
+    for (unsigned int t = 1; t < threads; t++) {
+      for (unsigned int i = 0; i < Dim; i++) {
+        lo[i] = std::min(lo[i], los[t][i]);
+        hi[i] = std::max(hi[i], his[t][i]);
+      }
+    }
+
+    detail::parallel_chunks(threads, count, [&](auto begin, auto end, auto) {
+      for (auto i = begin; i < end; i++)
+        codes[i] = {morton_code(centre(leaves[i]), lo, hi), unsigned(i)};
+    });
+
+    radix_sort(codes, threads);
+    return codes;
+  }
+
+ private:
+  using vec = std::array<double, Dim>;
+
+  /// The smallest amount of work worth handing to a thread.
+  static constexpr std::size_t parallel_grain = 4096;
+
+  /// The corners of a box, without the derived quantities of an aabb.
+  struct bounds {
+    point lowerBound;
+    point upperBound;
+
+    static bounds empty()
+    {
+      bounds b;
+      b.lowerBound.values.fill(std::numeric_limits<ValTy>::max());
+      b.upperBound.values.fill(std::numeric_limits<ValTy>::lowest());
+      return b;
+    }
+
+    static bounds of(const aabb &bb) { return {bb.lowerBound, bb.upperBound}; }
+
+    void grow(const bounds &b)
+    {
+      for (unsigned int i = 0; i < Dim; i++) {
+        lowerBound[i] = std::min(lowerBound[i], b.lowerBound[i]);
+        upperBound[i] = std::max(upperBound[i], b.upperBound[i]);
+      }
+    }
+
+    /// Surface area, matching aabb::compute_surface_area.
+    double area() const
+    {
+      vec d;
+      for (unsigned int i = 0; i < Dim; i++)
+        d[i] = double(upperBound[i]) - double(lowerBound[i]);
+
+      if constexpr (Dim == 1) {
+        return 2;
+      }
+      else if constexpr (Dim == 2) {
+        return 2 * (d[0] + d[1]);
+      }
+      else if constexpr (Dim == 3) {
+        return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+      }
+      else {
+        double sum = 0;
+        for (unsigned int d1 = 0; d1 < Dim; d1++) {
+          double product = 1;
+          for (unsigned int d2 = 0; d2 < Dim; d2++) {
+            if (d1 != d2)
+              product *= d[d2];
+          }
+          sum += product;
+        }
+        return 2 * sum;
+      }
+    }
+  };
+
+  /// A leaf as seen by the SAH builder.
+  struct item {
+    bounds box;
+    unsigned int index;
+
+    /// Twice the centre along an axis, which is all the binning needs.
+    double centre2(unsigned int d) const
+    {
+      return double(box.lowerBound[d]) + double(box.upperBound[d]);
+    }
+  };
+
+  /// The SAH bins of every axis for a range of items.
+  struct binning {
+    std::array<std::array<bounds, sah_bins>, Dim> boxes;
+    std::array<std::array<unsigned int, sah_bins>, Dim> counts;
+
+    void clear(unsigned int bins)
+    {
+      for (unsigned int d = 0; d < Dim; d++) {
+        std::fill_n(boxes[d].begin(), bins, bounds::empty());
+        std::fill_n(counts[d].begin(), bins, 0);
+      }
+    }
+  };
+
+  /// A contiguous range of entries and the first node slot of its subtree.
+  struct task {
+    unsigned int begin;
+    unsigned int end;
+    unsigned int first;
+
+    unsigned int size() const { return end - begin; }
+
+    /// The node slot holding the root of the subtree.
+    unsigned int root() const { return first + size() - 2; }
+  };
+
+  /// The number of bits used to quantise each axis of a Morton code.
+  static constexpr unsigned int morton_bits = 64 / Dim;
+
+  static vec centre(const aabb &bb)
+  {
+    vec c;
+    for (unsigned int i = 0; i < Dim; i++)
+      c[i] = 0.5 * (double(bb.lowerBound[i]) + double(bb.upperBound[i]));
+    return c;
+  }
+
+  static void centre_bounds(std::span<const aabb> leaves, vec &lo, vec &hi)
+  {
+    lo.fill(std::numeric_limits<double>::max());
+    hi.fill(std::numeric_limits<double>::lowest());
+    for (const auto &bb : leaves) {
+      auto c = centre(bb);
+      for (unsigned int i = 0; i < Dim; i++) {
+        lo[i] = std::min(lo[i], c[i]);
+        hi[i] = std::max(hi[i], c[i]);
+      }
+    }
+  }
+
+  static std::uint64_t morton_code(const vec &c, const vec &lo, const vec &hi)
+  {
+    if constexpr (morton_bits == 0) {
+      return 0;
+    }
+    else {
+      constexpr double cells = double((std::uint64_t(1) << morton_bits) - 1);
+
+      std::array<std::uint64_t, Dim> q;
+      for (unsigned int i = 0; i < Dim; i++) {
+        double extent = hi[i] - lo[i];
+        q[i] = extent > 0 ? std::uint64_t((c[i] - lo[i]) / extent * cells) : 0;
+      }
+
+      // Interleave the quantised coordinates, most significant bits first.
+      std::uint64_t code = 0;
+      for (int b = morton_bits - 1; b >= 0; b--)
+        for (unsigned int i = 0; i < Dim; i++)
+          code = (code << 1) | ((q[i] >> b) & 1);
+      return code;
+    }
+  }
+
+  //! Stable least-significant-digit radix sort on the Morton codes.
+  /*! Every pass builds one digit histogram per chunk, so the scatter can
+      be done by all threads at once without synchronisation.
+   */
+  static void radix_sort(std::vector<std::pair<std::uint64_t, unsigned int>> &keys,
+                         unsigned int threads)
+  {
+    std::size_t count = keys.size();
+    std::vector<std::pair<std::uint64_t, unsigned int>> buffer(count);
+    std::vector<std::array<std::size_t, 256>> offsets(threads);
+
+    for (unsigned int shift = 0; shift < 64; shift += 8) {
+      detail::parallel_chunks(threads, count, [&](auto begin, auto end, auto t) {
+        offsets[t].fill(0);
+        for (auto i = begin; i < end; i++)
+          offsets[t][(keys[i].first >> shift) & 0xff]++;
+      });
+
+      // Turn the histograms into scatter offsets, digit-major.
+      std::size_t sum = 0;
+      bool sorted = false;
+      for (unsigned int digit = 0; digit < 256; digit++) {
+        std::size_t total = 0;
+        for (unsigned int t = 0; t < threads; t++) {
+          std::size_t c = offsets[t][digit];
+          offsets[t][digit] = sum + total;
+          total += c;
+        }
+        sorted |= total == count;
+        sum += total;
+      }
+
+      // Every key shares this digit, the pass would be a plain copy.
+      if (sorted)
+        continue;
+
+      detail::parallel_chunks(threads, count, [&](auto begin, auto end, auto t) {
+        auto &offset = offsets[t];
+        for (auto i = begin; i < end; i++)
+          buffer[offset[(keys[i].first >> shift) & 0xff]++] = keys[i];
+      });
+      keys.swap(buffer);
+    }
+  }
+
+  //! Emit the node for a range split at mid, and queue its children.
+  /*! Subtrees are laid out in post-order: the range [begin, end) owns the
+      node slots [first, first + end - begin - 1) and its root sits in the
+      last of them. A range holding a single entry is referenced directly
+      through leaf_at(begin).
+   */
+  template <class LeafAt>
+  static void emit(const task &t,
+                   unsigned int mid,
+                   LeafAt &&leaf_at,
+                   std::vector<node> &nodes,
+                   std::vector<task> &tasks)
+  {
+    unsigned int count = nodes.size() + 1;
+    auto ref = [&](const task &r) {
+      if (r.size() == 1)
+        return leaf_at(r.begin);
+      return count + r.root();
+    };
+
+    task left = {t.begin, mid, t.first};
+    task right = {mid, t.end, t.first + (mid - t.begin) - 1};
+
+    auto &n = nodes[t.root()];
+    n.left = ref(left);
+    n.right = ref(right);
+
+    if (left.size() > 1)
+      tasks.push_back(left);
+    if (right.size() > 1)
+      tasks.push_back(right);
+  }
+
+  //! Build a hierarchy top-down.
+  /*! Ranges of at least parallel_split_size entries are split one at a
+      time by split(t, threads), with all threads cooperating. The smaller
+      ranges left over are then built as independent subtrees, one thread
+      each, using split(t, 1).
+   */
+  template <class Split, class LeafAt>
+  static void build_top_down(std::span<const aabb> leaves,
+                             std::vector<node> &nodes,
+                             unsigned int threads,
+                             Split &&split,
+                             LeafAt &&leaf_at)
+  {
+    unsigned int count = leaves.size();
+
+    std::vector<task> top = {{0, count, 0}};
+    std::vector<task> subtrees;
+    std::vector<unsigned int> splits;
+
+    unsigned int subtree_size =
+        threads > 1 ? std::max(parallel_split_size, count / (8 * threads))
+                    : count;
+    while (!top.empty()) {
+      task t = top.back();
+      top.pop_back();
+      if (t.size() <= subtree_size) {
+        subtrees.push_back(t);
+        continue;
+      }
+      emit(t, split(t, threads), leaf_at, nodes, top);
+      splits.push_back(t.root());
+    }
+
+    // Largest subtrees first so that the threads finish together.
+    std::sort(subtrees.begin(), subtrees.end(),
+              [](const task &a, const task &b) { return a.size() > b.size(); });
+
+    detail::parallel_tasks(threads, subtrees.size(), [&](std::size_t i) {
+      std::vector<task> tasks = {subtrees[i]};
+      while (!tasks.empty()) {
+        task t = tasks.back();
+        tasks.pop_back();
+        emit(t, split(t, 1), leaf_at, nodes, tasks);
+      }
+
+      // A subtree owns a contiguous run of slots, children first.
+      for (unsigned int s = subtrees[i].first; s <= subtrees[i].root(); s++)
+        refit(leaves, nodes, s);
+    });
+
+    // The cooperative splits were made parents first.
+    for (auto it = splits.rbegin(); it != splits.rend(); ++it)
+      refit(leaves, nodes, *it);
+  }
+
+  static void build_binned_sah(std::span<const aabb> leaves,
+                               std::vector<node> &nodes,
+                               unsigned int threads)
+  {
+    unsigned int count = leaves.size();
+
+    // Partitioning moves the items themselves so that every pass over a
+    // range streams through contiguous memory.
+    std::vector<item> items(count);
+    detail::parallel_chunks(threads, count, [&](auto begin, auto end, auto) {
+      for (auto i = begin; i < end; i++)
+        items[i] = {bounds::of(leaves[i]), unsigned(i)};
+    });
+
+    std::vector<item> buffer(threads > 1 ? count : 0);
+    auto split = [&](const task &t, unsigned int threads) {
+      return split_sah(items, buffer, t.begin, t.end, threads);
+    };
+    auto leaf_at = [&](unsigned int i) { return items[i].index; };
+    build_top_down(leaves, nodes, threads, split, leaf_at);
+  }
+
+  //! Partition a range of items at the cheapest binned SAH split.
+  /*! \param buffer
+          Scratch space for the parallel partition.
+
+      \return
+          The index of the first item of the right-hand partition.
+   */
+  static unsigned int split_sah(std::vector<item> &items,
+                                std::vector<item> &buffer,
+                                unsigned int begin,
+                                unsigned int end,
+                                unsigned int threads)
+  {
+    if (end - begin == 2)
+      return begin + 1;
+
+    std::span<item> range(items.data() + begin, end - begin);
+    threads = std::max<std::size_t>(
+        1, std::min<std::size_t>(threads, range.size() / parallel_grain));
+
+    // Bounds of the (doubled) centres.
+    std::vector<vec> los(threads), his(threads);
+    detail::parallel_chunks(threads, range.size(), [&](auto b, auto e, auto t) {
+      los[t].fill(std::numeric_limits<double>::max());
+      his[t].fill(std::numeric_limits<double>::lowest());
+      for (auto i = b; i < e; i++) {
+        for (unsigned int d = 0; d < Dim; d++) {
+          los[t][d] = std::min(los[t][d], range[i].centre2(d));
+          his[t][d] = std::max(his[t][d], range[i].centre2(d));
+        }
+      }
+    });
+    vec lo = los[0], hi = his[0];
+    for (unsigned int t = 1; t < threads; t++) {
+      for (unsigned int d = 0; d < Dim; d++) {
+        lo[d] = std::min(lo[d], los[t][d]);
+        hi[d] = std::max(hi[d], his[t][d]);
+      }
+    }
+
+    // Small ranges do not need the full set of bins.
+    unsigned int bins = std::min<std::size_t>(sah_bins, range.size());
+
+    vec scale;
+    for (unsigned int d = 0; d < Dim; d++) {
+      double extent = hi[d] - lo[d];
+      scale[d] = extent > 0 ? bins / extent : 0;
+    }
+    auto bin_of = [&](const item &it, unsigned int d) {
+      return std::min(bins - 1, unsigned((it.centre2(d) - lo[d]) * scale[d]));
+    };
+
+    // Bin every axis in a single pass over the items.
+    std::vector<binning> binnings(threads);
+    detail::parallel_chunks(threads, range.size(), [&](auto b, auto e, auto t) {
+      auto &binned = binnings[t];
+      binned.clear(bins);
+      for (auto i = b; i < e; i++) {
+        for (unsigned int d = 0; d < Dim; d++) {
+          unsigned int bin = bin_of(range[i], d);
+          binned.boxes[d][bin].grow(range[i].box);
+          binned.counts[d][bin]++;
+        }
+      }
+    });
+    auto &binned = binnings[0];
+    for (unsigned int t = 1; t < threads; t++) {
+      for (unsigned int d = 0; d < Dim; d++) {
+        for (unsigned int bin = 0; bin < bins; bin++) {
+          binned.boxes[d][bin].grow(binnings[t].boxes[d][bin]);
+          binned.counts[d][bin] += binnings[t].counts[d][bin];
+        }
+      }
+    }
+
+    double minCost = std::numeric_limits<double>::max();
+    unsigned int bestAxis = Dim;
+    unsigned int bestBin = 0;
+
+    for (unsigned int d = 0; d < Dim; d++) {
+      if (scale[d] == 0)
+        continue;
+
+      // Sweep from the right to accumulate the cost of each right-hand side.
+      std::array<double, sah_bins> rightCost = {};
+      bounds acc = bounds::empty();
+      unsigned int accCount = 0;
+      for (unsigned int b = bins - 1; b > 0; b--) {
+        acc.grow(binned.boxes[d][b]);
+        accCount += binned.counts[d][b];
+        rightCost[b] = accCount ? accCount * acc.area() : 0;
+      }
+
+      // Sweep from the left, splitting after bin b.
+      acc = bounds::empty();
+      accCount = 0;
+      for (unsigned int b = 0; b + 1 < bins; b++) {
+        acc.grow(binned.boxes[d][b]);
+        accCount += binned.counts[d][b];
+        if (accCount == 0 || accCount == range.size())
+          continue;
+
+        double cost = accCount * acc.area() + rightCost[b + 1];
+        if (cost < minCost) {
+          minCost = cost;
+          bestAxis = d;
+          bestBin = b;
+        }
+      }
+    }
+
+    // All centres coincide, any split is as good as another.
+    if (bestAxis == Dim)
+      return begin + (end - begin) / 2;
+
+    auto is_left = [&](const item &it) { return bin_of(it, bestAxis) <= bestBin; };
+    if (threads == 1) {
+      return begin + (std::partition(range.begin(), range.end(), is_left) -
+                      range.begin());
+    }
+
+    // Stable parallel partition: count each chunk, then scatter through
+    // the buffer and copy back.
+    std::vector<std::size_t> lefts(threads + 1, 0);
+    detail::parallel_chunks(threads, range.size(), [&](auto b, auto e, auto t) {
+      lefts[t + 1] = std::count_if(range.begin() + b, range.begin() + e, is_left);
+    });
+    std::partial_sum(lefts.begin(), lefts.end(), lefts.begin());
+
+    std::size_t leftCount = lefts[threads];
+    detail::parallel_chunks(threads, range.size(), [&](auto b, auto e, auto t) {
+      std::size_t l = lefts[t];
+      std::size_t r = leftCount + (b - lefts[t]);
+      for (auto i = b; i < e; i++)
+        buffer[begin + (is_left(range[i]) ? l++ : r++)] = range[i];
+    });
+    detail::parallel_chunks(threads, range.size(), [&](auto b, auto e, auto) {
+      std::copy(buffer.begin() + begin + b, buffer.begin() + begin + e,
+                range.begin() + b);
+    });
+    return begin + leftCount;
+  }
+
+  static void build_lbvh(std::span<const aabb> leaves,
+                         std::vector<node> &nodes,
+                         unsigned int threads)
+  {
+    auto codes = morton_order(leaves, threads);
+
+    auto split = [&](const task &t, unsigned int) {
+      std::uint64_t first = codes[t.begin].first;
+      std::uint64_t last = codes[t.end - 1].first;
+
+      // Identical codes, split the range in half.
+      if (first == last)
+        return t.begin + t.size() / 2;
+
+      // Split where the highest differing bit of the range flips.
+      std::uint64_t bit = std::uint64_t(1)
+                          << (63 - std::countl_zero(first ^ last));
+      return unsigned(std::partition_point(
+                          codes.begin() + t.begin, codes.begin() + t.end,
+                          [bit](const auto &c) { return (c.first & bit) == 0; }) -
+                      codes.begin());
+    };
+    auto leaf_at = [&](unsigned int i) { return codes[i].second; };
+    build_top_down(leaves, nodes, threads, split, leaf_at);
+  }
+
+  static void build_ploc(std::span<const aabb> leaves,
+                         std::vector<node> &nodes,
+                         unsigned int threads)
+  {
+    unsigned int count = leaves.size();
+    auto codes = morton_order(leaves, threads);
+
+    std::vector<unsigned int> clusters(count), nextClusters(count);
+    std::vector<bounds> boxes(count), nextBoxes(count);
+    std::vector<int> heights(count, 0), nextHeights(count);
+    for (unsigned int i = 0; i < count; i++) {
+      clusters[i] = codes[i].second;
+      boxes[i] = bounds::of(leaves[codes[i].second]);
+    }
+
+    std::vector<unsigned int> nearest(count);
+    std::vector<double> minCost(count);
+    std::vector<std::size_t> outputs(threads + 1), merges(threads + 1);
+    unsigned int slot = 0;
+
+    while (clusters.size() > 1) {
+      unsigned int size = clusters.size();
+      unsigned int chunks = std::max<std::size_t>(
+          1, std::min<std::size_t>(threads, size / parallel_grain));
+
+      // Find the nearest neighbour of every cluster within the search
+      // window. Ties are broken on the pair indices so that the globally
+      // cheapest pair is always mutual and every pass makes progress.
+      if (chunks == 1) {
+        // The distance is symmetric, so each pair is evaluated once and
+        // offered to both clusters.
+        minCost.assign(size, std::numeric_limits<double>::max());
+        for (unsigned int i = 0; i < size; i++) {
+          unsigned int hi = std::min(size, i + ploc_radius + 1);
+          for (unsigned int j = i + 1; j < hi; j++) {
+            bounds merged = boxes[i];
+            merged.grow(boxes[j]);
+            double cost = merged.area();
+
+            // For cluster i the candidate is (i, j) against (i, nearest[i]),
+            // for cluster j it is (i, j) against (j, nearest[j]).
+            if (cost < minCost[i] || (cost == minCost[i] && j < nearest[i])) {
+              minCost[i] = cost;
+              nearest[i] = j;
+            }
+            if (cost < minCost[j] ||
+                (cost == minCost[j] && i < std::min(j, nearest[j]))) {
+              minCost[j] = cost;
+              nearest[j] = i;
+            }
+          }
+        }
+      }
+      else {
+        detail::parallel_chunks(chunks, size, [&](auto b, auto e, auto) {
+          for (unsigned int i = b; i < e; i++) {
+            unsigned int lo = i > ploc_radius ? i - ploc_radius : 0;
+            unsigned int hi = std::min(size, i + ploc_radius + 1);
+
+            double best = std::numeric_limits<double>::max();
+            for (unsigned int j = lo; j < hi; j++) {
+              if (j == i)
+                continue;
+
+              bounds merged = boxes[i];
+              merged.grow(boxes[j]);
+              double cost = merged.area();
+
+              // The same order on (cost, min, max) as the serial search.
+              if (cost < best ||
+                  (cost == best && std::pair(std::min(i, j), std::max(i, j)) <
+                                       std::pair(std::min(i, nearest[i]),
+                                                 std::max(i, nearest[i])))) {
+                best = cost;
+                nearest[i] = j;
+              }
+            }
+          }
+        });
+      }
+
+      // Merge mutual nearest neighbours, keeping the Morton order. Each
+      // chunk first counts its outputs and merges so that all of them can
+      // write their clusters and nodes independently.
+      auto merges_at = [&](unsigned int i) {
+        return nearest[nearest[i]] == i && i < nearest[i];
+      };
+      auto kept_at = [&](unsigned int i) { return nearest[nearest[i]] != i; };
+
+      outputs[0] = merges[0] = 0;
+      detail::parallel_chunks(chunks, size, [&](auto b, auto e, auto t) {
+        std::size_t out = 0, merged = 0;
+        for (unsigned int i = b; i < e; i++) {
+          merged += merges_at(i);
+          out += merges_at(i) || kept_at(i);
+        }
+        outputs[t + 1] = out;
+        merges[t + 1] = merged;
+      });
+      std::partial_sum(outputs.begin(), outputs.begin() + chunks + 1,
+                       outputs.begin());
+      std::partial_sum(merges.begin(), merges.begin() + chunks + 1,
+                       merges.begin());
+
+      detail::parallel_chunks(chunks, size, [&](auto b, auto e, auto t) {
+        std::size_t out = outputs[t];
+        std::size_t s = slot + merges[t];
+        for (unsigned int i = b; i < e; i++) {
+          if (merges_at(i)) {
+            unsigned int j = nearest[i];
+            auto &n = nodes[s];
+            n.left = clusters[i];
+            n.right = clusters[j];
+            n.height = 1 + std::max(heights[i], heights[j]);
+            nextBoxes[out] = boxes[i];
+            nextBoxes[out].grow(boxes[j]);
+            n.bb = aabb(nextBoxes[out].lowerBound, nextBoxes[out].upperBound);
+            nextHeights[out] = n.height;
+            nextClusters[out++] = count + s++;
+          }
+          else if (kept_at(i)) {
+            nextBoxes[out] = boxes[i];
+            nextHeights[out] = heights[i];
+            nextClusters[out++] = clusters[i];
+          }
+        }
+      });
+      slot += merges[chunks];
+
+      unsigned int out = outputs[chunks];
+      clusters.swap(nextClusters);
+      boxes.swap(nextBoxes);
+      heights.swap(nextHeights);
+      clusters.resize(out);
+      boxes.resize(out);
+      heights.resize(out);
+      nextClusters.resize(out);
+      nextBoxes.resize(out);
+      nextHeights.resize(out);
+    }
+  }
+
+  /// Compute the bounds and height of an internal node from its children.
+  static void refit(std::span<const aabb> leaves,
+                    std::vector<node> &nodes,
+                    unsigned int slot)
+  {
+    unsigned int count = leaves.size();
+    auto &n = nodes[slot];
+    const aabb &left = n.left < count ? leaves[n.left] : nodes[n.left - count].bb;
+    const aabb &right =
+        n.right < count ? leaves[n.right] : nodes[n.right - count].bb;
+    int leftHeight = n.left < count ? 0 : nodes[n.left - count].height;
+    int rightHeight = n.right < count ? 0 : nodes[n.right - count].height;
+
+    n.bb.merge(left, right);
+    n.height = 1 + std::max(leftHeight, rightHeight);
+  }
+};
+
+template <unsigned Dim, typename ValTy, unsigned Width>
+class wide_tree;
+template <unsigned Dim, typename ValTy, unsigned Bits>
+class quantized_tree;
+template <unsigned Dim, typename ValTy, typename Payload>
+class tree_view;
+
+/*! \brief The dynamic AABB tree.
+
+    The dynamic AABB tree is a hierarchical data structure that can be used
+    to efficiently query overlaps between objects of arbitrary shape and
+    size that lie inside of a simulation box. Support is provided for
+    periodic and non-periodic boxes, as well as boxes with partial
+    periodicity, e.g. periodic along specific axes.
+
+    Each entry carries a Payload, stored inline in its leaf and handed to
+    query callbacks that take a third argument, so that a callback can
+    filter on it without chasing a pointer out of the tree.
+ */
+template <unsigned Dim, typename ValTy = double, typename Payload = void *>
+class tree {
+  static_assert(Dim > 0, "0-dimensional tree is not supported");
+  static_assert(std::is_trivially_copyable_v<Payload>,
+                "Payload must be trivially copyable");
+  template <unsigned, typename, unsigned>
+  friend class wide_tree;
+  template <unsigned, typename, unsigned>
+  friend class quantized_tree;
+  template <unsigned, typename>
+  friend class static_tree;
+  friend class tree_view<Dim, ValTy, Payload>;
+
+ public:
+  using value_type = ValTy;
+  using payload_type = Payload;
+  using aabb = abt::aabb<Dim, value_type>;
+  using box = abt::box<Dim, value_type>;
+  using point = abt::point<Dim, value_type>;
+  using ray = abt::ray<Dim, value_type>;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  //! A stable handle to an entry.
+  /*! The low 32 bits pick a slot in the handle table, which points at the
+      entry's leaf wherever the tree moves it. The high 32 bits are the
+      slot's generation, bumped when the entry is removed, so that a stale
+      handle is told apart from the entry that reuses its slot.
+   */
+  enum class node_id : std::uint64_t {};
+  
+  float skin_width = 0.01f;
+
+  /// Whether skin_width is a length or a fraction of each entry's size.
+  skin_mode skin = skin_mode::absolute;
+
+  /// Grow the skin of entries that keep escaping, shrink it for static ones.
+  bool adaptive_skin = false;
+
+  //! How inserted and reinserted entries find their place in the tree.
+  /*! Branch and bound costs more per insertion than the greedy descent
+      but builds trees with less total surface area, which answer queries
+      faster; switch to it ahead of read-heavy phases.
+   */
+  insert_strategy insertion = insert_strategy::greedy;
+
+ private:
+  //! The header save() writes, with the sections laid out after it.
+  detail::file_header make_header() const
+  {
+    detail::file_header h = {};
+    h.magic = detail::file_magic;
+    h.version = detail::file_version;
+    h.dim = Dim;
+    h.value_code = detail::value_code<ValTy>();
+    h.payload_size = sizeof(Payload);
+    h.node_size = sizeof(node);
+    h.branch_size = sizeof(branch);
+    h.root = m_root;
+    h.node_count = m_node_count;
+    h.leaf_count = m_leaf_count;
+    h.node_capacity = m_node_capacity;
+    h.free_list = m_free_list;
+    h.handle_count = m_handles.size();
+    h.free_handle = m_free_handle;
+    h.skin_width = skin_width;
+    h.skin = std::uint32_t(skin);
+    h.adaptive_skin = adaptive_skin;
+    h.insertion = std::uint32_t(insertion);
+
+    h.bounds_offset = detail::file_align(sizeof(h));
+    h.nodes_offset = detail::file_align(h.bounds_offset + sizeof(m_bounds));
+    h.branches_offset =
+        detail::file_align(h.nodes_offset + std::uint64_t(m_node_capacity) * sizeof(node));
+    h.handles_offset =
+        detail::file_align(h.branches_offset + std::uint64_t(m_node_capacity) * sizeof(branch));
+    h.file_size = detail::file_align(h.handles_offset + m_handles.size() * sizeof(handle));
+    return h;
+  }
+
+  //! Test whether a saved tree has the layout of this one.
+  static bool matches_layout(const detail::file_header &h)
+  {
+    return h.magic == detail::file_magic && h.version == detail::file_version &&
+           h.dim == Dim && h.value_code == detail::value_code<ValTy>() &&
+           h.payload_size == sizeof(Payload) && h.node_size == sizeof(node) &&
+           h.branch_size == sizeof(branch);
+  }
+
+  //! Test whether the sections a header describes lie within a saved tree.
+  /*! The sections must be aligned, in order and not overlap, within both
+      the file_size recorded and the bytes actually available, and hold
+      counts consistent with each other, so that nothing past the end is
+      read. The nodes themselves are not walked here: load() checks them
+      with valid_links(), and tree_view checks each index as it is followed.
+   */
+  static bool valid_sections(const detail::file_header &h, std::uint64_t available)
+  {
+    auto fits = [&](std::uint64_t offset, std::uint64_t bytes, std::uint64_t end) {
+      return offset % detail::file_alignment == 0 && offset <= end && bytes <= end - offset;
+    };
+    auto index_ok = [&](std::uint32_t index, std::uint32_t count) {
+      return index == NULL_NODE || index < count;
+    };
+    std::uint64_t capacity = h.node_capacity;
+    return h.file_size <= available && h.node_capacity > 0 &&
+           h.node_count <= h.node_capacity && h.leaf_count <= h.node_count &&
+           h.leaf_count <= h.handle_count && index_ok(h.root, h.node_capacity) &&
+           (h.root == NULL_NODE) == (h.leaf_count == 0) &&
+           index_ok(h.free_list, h.node_capacity) && index_ok(h.free_handle, h.handle_count) &&
+           h.bounds_offset >= sizeof(detail::file_header) &&
+           fits(h.bounds_offset, sizeof(vec<ValTy>), h.nodes_offset) &&
+           fits(h.nodes_offset, capacity * sizeof(node), h.branches_offset) &&
+           fits(h.branches_offset, capacity * sizeof(branch), h.handles_offset) &&
+           fits(h.handles_offset, std::uint64_t(h.handle_count) * sizeof(handle), h.file_size);
+  }
+
+  //! Test whether the links between the nodes of a loaded tree are sound.
+  /*! Walks the tree from the root and both free lists, so that a corrupt
+      file is turned away before its indices are followed unchecked: every
+      child, parent and handle index must be in range and agree with the
+      others, heights must fall towards the leaves, the traversal records
+      must mirror the nodes, and the counts must match the header.
+   */
+  bool valid_links() const
+  {
+    std::vector<char> freeNode(m_node_capacity), freeSlot(m_handles.size());
+    std::size_t freeNodes = 0, freeSlots = 0;
+    for (unsigned int n = m_free_list; n != NULL_NODE; n = m_nodes[n].next) {
+      if (n >= m_node_capacity || freeNode[n] || m_nodes[n].height != -1)
+        return false;
+      freeNode[n] = 1;
+      freeNodes++;
+    }
+    for (unsigned int s = m_free_handle; s != NULL_NODE; s = m_handles[s].node) {
+      if (s >= m_handles.size() || freeSlot[s])
+        return false;
+      freeSlot[s] = 1;
+      freeSlots++;
+    }
+    if (freeNodes + m_node_count != m_node_capacity ||
+        freeSlots + m_leaf_count != m_handles.size())
+      return false;
+    if (m_root == NULL_NODE)
+      return m_node_count == 0;
+    if (m_nodes[m_root].parent != NULL_NODE)
+      return false;
+
+    // Heights fall strictly from parent to child, so the walk ends.
+    std::size_t nodes = 0, leaves = 0;
+    std::vector<unsigned int> stack = {m_root};
+    while (!stack.empty()) {
+      unsigned int n = stack.back();
+      stack.pop_back();
+      const node &nd = m_nodes[n];
+      if (freeNode[n] || ++nodes > m_node_count)
+        return false;
+      if (nd.isLeaf()) {
+        unsigned int slot = handle_slot(nd.id);
+        if (nd.left != NULL_NODE || nd.right != NULL_NODE || slot >= m_handles.size() ||
+            freeSlot[slot] || m_handles[slot].node != n ||
+            m_handles[slot].generation != handle_generation(nd.id))
+          return false;
+        leaves++;
+        continue;
+      }
+      if (nd.height < 1 || nd.left >= m_node_capacity || nd.right >= m_node_capacity)
+        return false;
+      const node &l = m_nodes[nd.left], &r = m_nodes[nd.right];
+      if (l.parent != n || r.parent != n || l.height < 0 || r.height < 0 ||
+          nd.height != 1 + std::max(l.height, r.height) ||
+          m_branches[n].child[0] != child_ref(nd.left) ||
+          m_branches[n].child[1] != child_ref(nd.right))
+        return false;
+      stack.push_back(nd.left);
+      stack.push_back(nd.right);
+    }
+    return nodes == m_node_count && leaves == m_leaf_count;
+  }
+
+  //! The periodic box for a query: its own if given, else the tree's.
+  const vec<ValTy> &effective_bounds(const vec<ValTy> &bounds) const
+  {
+    return bounds == vec<ValTy>{} ? m_bounds : bounds;
+  }
+
+  //! Test a query against the bounds of a branch child.
+  template <bool TouchIsOverlap, class Bound>
+  static bool overlaps(const vec<Bound> &lowerBound,
+                       const vec<Bound> &upperBound,
+                       const point &pt)
+  {
+    for (unsigned int i = 0; i < Dim; ++i) {
+      if (TouchIsOverlap ? (pt[i] < lowerBound[i] || pt[i] > upperBound[i])
+                         : (pt[i] <= lowerBound[i] || pt[i] >= upperBound[i]))
+        return false;
+    }
+    return true;
+  }
+
+  template <bool TouchIsOverlap, class Bound>
+  static bool overlaps(const vec<Bound> &lowerBound,
+                       const vec<Bound> &upperBound,
+                       const aabb &bb)
+  {
+    for (unsigned int i = 0; i < Dim; ++i) {
+      if (TouchIsOverlap ? (bb.upperBound[i] < lowerBound[i] ||
+                            bb.lowerBound[i] > upperBound[i])
+                         : (bb.upperBound[i] <= lowerBound[i] ||
+                            bb.lowerBound[i] >= upperBound[i]))
+        return false;
+    }
+    return true;
+  }
+
+  //! Test bounds held as vectors, e.g. a query rounded to bound_type.
+  template <bool TouchIsOverlap, class Bound>
+  static bool overlaps(const vec<Bound> &lowerBound,
+                       const vec<Bound> &upperBound,
+                       const vec<Bound> &queryLower,
+                       const vec<Bound> &queryUpper)
+  {
+    for (unsigned int i = 0; i < Dim; ++i) {
+      if (TouchIsOverlap ? (queryUpper[i] < lowerBound[i] || queryLower[i] > upperBound[i])
+                         : (queryUpper[i] <= lowerBound[i] || queryLower[i] >= upperBound[i]))
+        return false;
+    }
+    return true;
+  }
+
+  //! Test a query box against bounds in any of its periodic images.
+  /*! Overlap is decided axis by axis, so finding an overlapping image along
+      each axis on its own covers every combination of shifts. Along a
+      periodic axis the query is moved by whole periods to the lowest image
+      whose upper bound reaches the bounds, which overlaps them unless
+      touching is excluded and it only touches, when the next one may.
+   */
+  static bool overlaps_image(const vec<ValTy> &lowerBound,
+                             const vec<ValTy> &upperBound,
+                             const vec<ValTy> &queryLower,
+                             const vec<ValTy> &queryUpper,
+                             const vec<ValTy> &bounds,
+                             bool touchIsOverlap)
+  {
+    auto overlaps_axis = [touchIsOverlap](double lower1, double upper1,
+                                          double lower2, double upper2) {
+      return touchIsOverlap ? !(upper2 < lower1 || lower2 > upper1)
+                            : !(upper2 <= lower1 || lower2 >= upper1);
+    };
+
+    for (unsigned int i = 0; i < Dim; ++i) {
+      const double lo = lowerBound[i], hi = upperBound[i];
+      double lower = queryLower[i], upper = queryUpper[i];
+      if (overlaps_axis(lo, hi, lower, upper))
+        continue;
+      if (bounds[i] != 0) {
+        double shift = std::floor((upper - lo) / bounds[i]) * bounds[i];
+        lower -= shift;
+        upper -= shift;
+        if (overlaps_axis(lo, hi, lower, upper) ||
+            overlaps_axis(lo, hi, lower + bounds[i], upper + bounds[i]))
+          continue;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  //! Find the periodic shifts of a query that reach a box.
+  /*! \param query
+          The AABB or point.
+
+      \param bb
+          The box, e.g. the root of the tree.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+
+      \param first, last
+          Set to the range of shifts, in periods, along each axis.
+
+      \return
+          The number of images, at most 2^Dim unless the query is wider than
+          the periodic box, or 0 if none reaches the box.
+   */
+  template <class Query>
+  static std::size_t image_range(const Query &query,
+                                 const aabb &bb,
+                                 const vec<ValTy> &bounds,
+                                 std::array<long, Dim> &first,
+                                 std::array<long, Dim> &last)
+  {
+    std::size_t count = 1;
+    first = {};
+    last = {};
+    for (unsigned int i = 0; i < Dim; i++) {
+      if (bounds[i] == 0)
+        continue;
+      double lower, upper;
+      if constexpr (std::is_same_v<Query, point>)
+        lower = upper = query[i];
+      else
+        lower = query.lowerBound[i], upper = query.upperBound[i];
+      first[i] = std::ceil((double(bb.lowerBound[i]) - upper) / bounds[i]);
+      last[i] = std::floor((double(bb.upperBound[i]) - lower) / bounds[i]);
+      if (first[i] > last[i])
+        return 0;
+      count *= last[i] - first[i] + 1;
+    }
+    return count;
+  }
+
+  //! Split a query into its periodic images over a range of shifts.
+  /*! \param images
+          Set to the images, in any container with clear() and push_back().
+   */
+  template <class Query, class Images>
+  static void query_images(const Query &query,
+                           const vec<ValTy> &bounds,
+                           const std::array<long, Dim> &first,
+                           const std::array<long, Dim> &last,
+                           Images &images)
+  {
+    images.clear();
+    std::array<long, Dim> k = first;
+    while (true) {
+      vec<ValTy> shift;
+      for (unsigned int i = 0; i < Dim; i++)
+        shift[i] = k[i] * bounds[i];
+      images.push_back(query + shift);
+
+      unsigned int i = 0;
+      for (; i < Dim && k[i] == last[i]; i++)
+        k[i] = first[i];
+      if (i == Dim)
+        break;
+      k[i]++;
+    }
+  }
+
+  //! Visit the periodic images of a query that reach a box.
+  /*! Splitting a query into its images once lets a traversal test nodes
+      without minimum-image shifts, however many periods away the query
+      lies. Without periodic axes the query is its only image.
+
+      \param fn
+          Called as fn(image, earlier), where earlier holds the images
+          visited before, so that an entry an earlier image already reached
+          can be skipped. Returning true ends the visit.
+   */
+  template <class Query, class Fn>
+  static void visit_images(const Query &query,
+                           const aabb &bb,
+                           const vec<ValTy> &bounds,
+                           Fn &&fn)
+  {
+    if (bounds == vec<ValTy>{}) {
+      fn(query, std::span<const Query>{});
+      return;
+    }
+
+    // A query narrower than the box has at most 2^Dim images, held in place.
+    std::array<long, Dim> first, last;
+    std::size_t count = image_range(query, bb, bounds, first, last);
+    if (count == 0)
+      return;
+    auto visit = [&](auto &images) {
+      query_images(query, bounds, first, last, images);
+      for (std::size_t i = 0; i < count; i++) {
+        if (fn(images[i], std::span<const Query>(images.data(), i)))
+          return;
+      }
+    };
+    if (count <= (1u << Dim)) {
+      detail::inline_stack<Query, (1u << Dim)> images;
+      visit(images);
+    }
+    else {
+      static thread_local std::vector<Query> images;
+      visit(images);
+    }
+  }
+
+  //! Whether an earlier image of a query already reached a box.
+  template <class Query>
+  static bool reached_before(const vec<ValTy> &lowerBound,
+                             const vec<ValTy> &upperBound,
+                             std::span<const Query> earlier,
+                             bool touchIsOverlap)
+  {
+    for (const auto &image : earlier) {
+      if (touchIsOverlap ? overlaps<true>(lowerBound, upperBound, image)
+                         : overlaps<false>(lowerBound, upperBound, image))
+        return true;
+    }
+    return false;
+  }
+
+  //! Test two boxes for overlap in any periodic image.
+  static bool overlaps_any_image(const aabb &a,
+                                 const aabb &b,
+                                 const vec<ValTy> &bounds,
+                                 bool touchIsOverlap)
+  {
+    return overlaps_image(a.lowerBound.values, a.upperBound.values, b.lowerBound.values,
+                          b.upperBound.values, bounds, touchIsOverlap);
+  }
+
+  //! The squared distance from a point to the nearest image of a box.
+  /*! Along periodic axes the point is moved by whole periods to the image
+      just above the lower bound and the one below it, the nearest two, so
+      the result never exceeds the distance to any entry below an internal
+      node.
+   */
+  template <class Bound>
+  static double distance_squared(const vec<Bound> &lowerBound,
+                                 const vec<Bound> &upperBound,
+                                 const point &pt,
+                                 const vec<ValTy> &bounds)
+  {
+    auto gap = [](double lower, double upper, double x) {
+      return std::max({lower - x, x - upper, 0.0});
+    };
+
+    double sum = 0;
+    for (unsigned int i = 0; i < Dim; ++i) {
+      double g = gap(lowerBound[i], upperBound[i], pt[i]);
+      if (bounds[i] != 0 && g > 0) {
+        double x = pt[i] - std::floor((pt[i] - double(lowerBound[i])) / bounds[i]) *
+                               bounds[i];
+        g = std::min({g, gap(lowerBound[i], upperBound[i], x),
+                      gap(lowerBound[i], upperBound[i], x - bounds[i])});
+      }
+      sum += g * g;
+    }
+    return sum;
+  }
+
+  /*! \brief A node of the AABB tree.
+
+   Each node of the tree contains an AABB object which corresponds to a
+   entry, or a group of entrys, in the simulation box. The AABB
+   objects of individual entrys are "fattened" before they are stored
+   to avoid having to continually update and rebalance the tree when
+   displacements are small.
+
+   Nodes are aware of their position within in the tree. The isLeaf member
+   function allows the tree to query whether the node is a leaf, i.e. to
+   determine whether it holds a single entry.
+  */
+
+  static constexpr unsigned int NULL_NODE = 0xffffffff;
+
+  struct alignas(64) node {
+    /// Constructor.
+    node() = default;
+
+    //! The fattened axis-aligned bounding box, without its centre.
+    /*! The bounds and the handle come first, so that a leaf is tested and
+        reported from its first cache line.
+     */
+    box bb;
+
+    /// The handle of a leaf.
+    node_id id = {};
+
+    /// The payload of a leaf.
+    Payload user_data = {};
+
+    /// Index of the parent node.
+    unsigned int parent = NULL_NODE;
+
+    /// Index of the next node.
+    unsigned int next = 0;
+
+    /// Index of the left-hand child.
+    unsigned int left = NULL_NODE;
+
+    /// Index of the right-hand child.
+    unsigned int right = NULL_NODE;
+
+    /// Height of the node. This is 0 for a leaf and -1 for a free node.
+    int height = 0;
+
+    /// The adaptive skin multiplier of a leaf.
+    float skin_scale = 1;
+
+    /// Updates since a leaf was last reinserted, for the adaptive skin.
+    std::uint16_t stays = 0;
+
+    //! Test whether the node is a leaf.
+    /*! \return
+            Whether the node is a leaf node.
+     */
+    bool isLeaf() const { return (height == 0); }
+  };
+
+  // Saved trees are raw node bytes, and pool growth is a plain copy.
+  static_assert(std::is_trivially_copyable_v<node>);
+
+  /// Set in a child reference of a branch when the child is a leaf.
+  static constexpr unsigned int LEAF_FLAG = 0x80000000;
+
+  //! The type the traversal records keep the bounds of children in.
+  /*! Doubles are rounded outwards to float, which keeps a record of a 3D
+      tree within a cache line. The bounds then hold the exact ones, so a
+      walk may open a little more than it has to, and every leaf is tested
+      against its exact AABB before it is reported.
+   */
+  using bound_type = std::conditional_t<std::is_same_v<ValTy, double>, float, ValTy>;
+
+  /// Whether the traversal records hold the bounds of children exactly.
+  static constexpr bool exact_branches = std::is_same_v<bound_type, ValTy>;
+
+  /// Size of the traversal record of an internal node.
+  static constexpr std::size_t branch_size =
+      4 * Dim * sizeof(bound_type) + 2 * sizeof(unsigned int);
+
+  /*! \brief The traversal record of an internal node.
+
+   Queries only ever need the bounds of a node's children and where to go
+   next, so these are kept together, away from the rest of the node. The
+   parent, free list and user data stay cold in the node itself, and the
+   centre and surface area are never stored. A query visiting an internal
+   node tests both children from this one record, which is aligned to a
+   cache line whenever it fits in one.
+  */
+  struct alignas(branch_size <= 64 ? 64 : alignof(bound_type) > alignof(unsigned int)
+                                               ? alignof(bound_type)
+                                               : alignof(unsigned int)) branch {
+    /// Lower bounds of the left- and right-hand children, rounded down.
+    std::array<vec<bound_type>, 2> lowerBound;
+
+    /// Upper bounds of the left- and right-hand children, rounded up.
+    std::array<vec<bound_type>, 2> upperBound;
+
+    /// Indices of the children, LEAF_FLAG marks leaves.
+    std::array<unsigned int, 2> child;
+  };
+
+  //! The largest bound_type no greater than a value.
+  static bound_type round_down(ValTy value)
+  {
+    if constexpr (exact_branches) {
+      return value;
+    }
+    else {
+      constexpr auto top = std::numeric_limits<bound_type>::max();
+      if (value >= top)
+        return top;
+      if (value < -top)
+        return -std::numeric_limits<bound_type>::infinity();
+      bound_type rounded = bound_type(value);
+      if (!(rounded > value))
+        return rounded;
+
+      // Step down to the next float, in its bits rather than by a call.
+      if (rounded == 0)
+        return -std::numeric_limits<bound_type>::denorm_min();
+      auto bits = std::bit_cast<std::uint32_t>(rounded);
+      return std::bit_cast<bound_type>(rounded > 0 ? bits - 1 : bits + 1);
+    }
+  }
+
+  //! The smallest bound_type no less than a value.
+  static bound_type round_up(ValTy value)
+  {
+    if constexpr (exact_branches)
+      return value;
+    else
+      return -round_down(-value);
+  }
+
+  //! Round a query outwards to bound_type, to test it against branch records.
+  /*! Comparing the rounded query with the rounded records keeps every
+      overlap, and saves converting each bound during the walk.
+   */
+  template <class Query>
+  static void round_outwards(const Query &query, vec<bound_type> &lower, vec<bound_type> &upper)
+  {
+    for (unsigned int i = 0; i < Dim; i++) {
+      if constexpr (std::is_same_v<Query, point>) {
+        lower[i] = round_down(query[i]);
+        upper[i] = round_up(query[i]);
+      }
+      else {
+        lower[i] = round_down(query.lowerBound[i]);
+        upper[i] = round_up(query.upperBound[i]);
+      }
+    }
+  }
+
+ public:
+  //! Constructor (non-periodic).
+  /*! \param skin_thickness
+          The skin thickness for fattened AABBs, as a fraction
+          of the AABB base length.
+
+      \param initial_size
+          The number of entries (for fixed entry number systems).
+
+   */
+  tree(unsigned int initial_size = 16) : tree(pool_options{}, initial_size) {}
+
+  //! Constructor (non-periodic), with the node storage given.
+  /*! \param pool
+          The memory resource and page size of the node pool.
+
+      \param initial_size
+          The number of entries (for fixed entry number systems).
+   */
+  explicit tree(const pool_options &pool, unsigned int initial_size = 16)
+      : m_nodes(pool.page_size, pool.resource),
+        m_branches(pool.page_size, pool.resource)
+  {
+    // Initialise the tree.
+    m_root = NULL_NODE;
+    m_node_count = 0;
+    m_node_capacity = 0;
+    m_free_list = NULL_NODE;
+    grow(initial_size);
+  }
+
+  //! Constructor (periodic).
+  /*! \param periodic_bounds
+          The periodic box, zero along non-periodic axes. Queries that are
+          not given bounds of their own wrap around it.
+
+      \param initial_size
+          The number of entries (for fixed entry number systems).
+
+      \param pool
+          The memory resource and page size of the node pool.
+   */
+  explicit tree(const vec<ValTy> &periodic_bounds,
+                unsigned int initial_size = 16,
+                const pool_options &pool = {})
+      : tree(pool, initial_size)
+  {
+    m_bounds = periodic_bounds;
+  }
+
+  //! Build a periodic tree from a complete set of AABBs.
+  /*! \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+
+      \param bbs
+          The AABBs of the entries. Entry i is given node_id i.
+
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  tree(const vec<ValTy> &periodic_bounds,
+       std::span<const aabb> bbs,
+       const build_options &options = {})
+      : tree(bbs, options)
+  {
+    m_bounds = periodic_bounds;
+  }
+
+  //! Build a tree from a complete set of AABBs.
+  /*! \param bbs
+          The AABBs of the entries. Entry i is given node_id i.
+
+      \param strategy
+          The bulk construction algorithm.
+   */
+  tree(std::span<const aabb> bbs, build_strategy strategy)
+      : tree(bbs, build_options{strategy})
+  {
+  }
+
+  //! Build a tree from a complete set of AABBs.
+  /*! \param bbs
+          The AABBs of the entries. Entry i is given node_id i.
+
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  tree(std::span<const aabb> bbs, const build_options &options = {})
+  {
+    unsigned int count = bbs.size();
+
+    m_root = NULL_NODE;
+    m_node_count = count;
+    m_leaf_count = count;
+    m_node_capacity = count > 0 ? count * 2 : 16;
+    m_nodes.resize(m_node_capacity);
+    m_branches.resize(m_node_capacity);
+
+    // Build a linked list for the list of free nodes.
+    for (unsigned int i = count; i < m_node_capacity - 1; i++) {
+      m_nodes[i].next = i + 1;
+      m_nodes[i].height = -1;
+    }
+    m_nodes[m_node_capacity - 1].next = NULL_NODE;
+    m_nodes[m_node_capacity - 1].height = -1;
+
+    // Assign the index of the first free node.
+    m_free_list = count;
+
+    std::vector<unsigned int> leaves(count);
+    std::iota(leaves.begin(), leaves.end(), 0);
+
+    // Entry i is at leaf i with handle i.
+    m_handles.resize(count);
+    detail::parallel_chunks(
+        detail::thread_count(options.threads), count,
+        [&](std::size_t begin, std::size_t end, unsigned int) {
+          for (auto i = begin; i < end; ++i) {
+            m_nodes[i].bb = bbs[i];
+            m_nodes[i].id = node_id(i);
+            m_handles[i].node = i;
+          }
+        });
+
+    build(leaves, bbs, options);
+
+    validate();
+  }
+
+  //! Insert a entry into the tree (arbitrary shape with bounding box).
+  /*! \param index
+          The index of the entry.
+
+      \param lowerBound
+          The lower bound in each dimension.
+
+      \param upperBound
+          The upper bound in each dimension.
+   */
+  node_id insert(const aabb &bb, const Payload &user_data = {})
+  {
+    return insert_fattened(bb, nullptr, user_data);
+  }
+
+  //! Insert an entry expected to move by a given displacement.
+  /*! The fattened AABB is stretched along the displacement, as well as
+      getting its skin, so that the entry can follow it before an update
+      needs to reinsert it.
+   */
+  node_id insert(const aabb &bb, const vec<ValTy> &displacement,
+                 const Payload &user_data = {})
+  {
+    return insert_fattened(bb, &displacement, user_data);
+  }
+
+ private:
+  node_id insert_fattened(const aabb &bb, const vec<ValTy> *displacement,
+                          const Payload &user_data)
+  {
+    // Allocate a new node for the entry.
+    unsigned int node_idx = allocate_node();
+    auto &node = m_nodes[node_idx];
+    node.skin_scale = 1;
+    node.stays = 0;
+    node.bb = fatten(bb, node.skin_scale, displacement);
+    node.user_data = user_data;
+
+    // Zero the height.
+    node.height = 0;
+
+    // Insert a new leaf into the tree.
+    insert_leaf(node_idx);
+    return acquire_handle(node_idx);
+  }
+
+  static unsigned int handle_slot(node_id id) { return std::uint32_t(std::uint64_t(id)); }
+  static std::uint32_t handle_generation(node_id id) { return std::uint64_t(id) >> 32; }
+
+  //! Give a leaf a handle, reusing a released slot if there is one.
+  node_id acquire_handle(unsigned int leaf)
+  {
+    unsigned int slot;
+    if (m_free_handle != NULL_NODE) {
+      slot = m_free_handle;
+      m_free_handle = m_handles[slot].node;
+    }
+    else {
+      slot = m_handles.size();
+      m_handles.push_back({});
+    }
+    m_handles[slot].node = leaf;
+    auto id = node_id((std::uint64_t(m_handles[slot].generation) << 32) | slot);
+    m_nodes[leaf].id = id;
+    return id;
+  }
+
+  //! Retire a handle, so that it no longer passes contains().
+  void release_handle(node_id id)
+  {
+    auto &h = m_handles[handle_slot(id)];
+    h.generation++;
+    h.node = m_free_handle;
+    m_free_handle = handle_slot(id);
+  }
+
+ public:
+  
+  /// Return the payload of an entry.
+  Payload data(node_id id) const {
+    auto node = to_unsigned(id);
+    auto &n = m_nodes[node];
+    
+    assert(node < m_node_capacity);
+    assert(n.isLeaf());
+    
+    return n.user_data;
+  }
+
+  /// Return the number of entrys in the tree.
+  unsigned int size() const { return m_leaf_count; }
+
+  /// Whether a handle refers to an entry still in the tree.
+  bool contains(node_id id) const
+  {
+    auto slot = handle_slot(id);
+    return slot < m_handles.size() && m_handles[slot].generation == handle_generation(id);
+  }
+
+  /// The leaf an entry is stored at.
+  unsigned to_unsigned(node_id id) const
+  {
+    assert(contains(id) && "stale or invalid node_id");
+    return m_handles[handle_slot(id)].node;
+  }
+
+  /// The handle of the entry stored at a leaf.
+  node_id to_id(unsigned node) const { return m_nodes[node].id; }
+
+  //! Remove a entry from the tree.
+  /*! \param entry
+          The entry index (entryMap will be used to map the node).
+   */
+  void remove(node_id node_id)
+  {
+    auto node = to_unsigned(node_id);
+    remove_leaf(node);
+    release_handle(node_id);
+    free_node(node);
+  }
+
+  /// Remove all entrys from the tree.
+  void clear()
+  {
+    for_each([this](node_id id, const auto &) { remove(id); });
+  }
+
+  //! Update the tree if a entry moves outside its fattened AABB.
+  /*! \param entry
+          The entry index (entryMap will be used to map the node).
+
+      \param lowerBound
+          The lower bound in each dimension.
+
+      \param upperBound
+          The upper bound in each dimension.
+
+      \param alwaysReinsert
+          Always reinsert the entry, even if it's within its old AABB
+     (default: false)
+   */
+  bool update(node_id id, const aabb &bb, bool always_reinsert = false)
+  {
+    return update_leaf(to_unsigned(id), bb, nullptr, always_reinsert);
+  }
+
+  //! Update an entry, stretching a new fattened AABB along a displacement.
+  /*! \param displacement
+          The expected motion of the entry until its next update, e.g. its
+          velocity times the time step.
+   */
+  bool update(node_id id, const aabb &bb, const vec<ValTy> &displacement,
+              bool always_reinsert = false)
+  {
+    return update_leaf(to_unsigned(id), bb, &displacement, always_reinsert);
+  }
+
+  //! Update many moved entries at once.
+  /*! Entries still inside their fattened AABB are left alone. The others
+      are all unlinked first, the ancestors that changed are refitted and
+      rebalanced in one bottom-up pass, and the entries are reinserted in
+      Morton order of their new AABBs so that consecutive insertions walk
+      the same part of the tree. When too many entries escape, the whole
+      tree is rebuilt instead.
+
+      \param moves
+          The entries and their new AABBs, each entry at most once.
+
+      \param rebuild_ratio
+          The fraction of escaped entries above which the tree is rebuilt.
+
+      \param options
+          The algorithm and threads to rebuild with.
+
+      \return
+          The number of entries that left their fattened AABB.
+   */
+  unsigned int update_batch(std::span<const std::pair<node_id, aabb>> moves,
+                            double rebuild_ratio = 0.5,
+                            const build_options &options = {})
+  {
+    std::vector<unsigned int> escaped;
+    std::vector<aabb> bbs;
+    for (const auto &[id, bb] : moves) {
+      auto node = to_unsigned(id);
+      assert(node < m_node_capacity);
+      assert(m_nodes[node].isLeaf());
+
+      if (reskin(m_nodes[node], bb, false)) {
+        escaped.push_back(node);
+        bbs.push_back(fatten(bb, m_nodes[node].skin_scale));
+      }
+    }
+    if (escaped.empty())
+      return 0;
+
+    if (escaped.size() > rebuild_ratio * m_leaf_count) {
+      for (std::size_t i = 0; i < escaped.size(); i++)
+        m_nodes[escaped[i]].bb = bbs[i];
+      rebuild(options);
+      return escaped.size();
+    }
+
+    std::vector<unsigned int> dirty;
+    dirty.reserve(escaped.size());
+    for (auto leaf : escaped)
+      detach_leaf(leaf, dirty);
+    refit(dirty);
+
+    for (auto [code, i] : bulk_builder<Dim, ValTy>::morton_order(bbs, options.threads)) {
+      m_nodes[escaped[i]].bb = bbs[i];
+      insert_leaf(escaped[i]);
+    }
+    return escaped.size();
+  }
+
+  //! Query the tree to find candidate interactions for an AABB.
+  /*! \param aabb
+          The AABB.
+      \param out
+          An output iterator
+
+      \return entrys
+          A vector of entry indices.
+   */
+  template <class Query, class OutputIterator>
+  void get_overlaps(const Query &query,
+                    OutputIterator out,
+                    bool include_touch = true,
+                    const vec<ValTy> &bounds = {}) const
+  {
+    visit_overlaps(
+        query, [&](node_id id) { *out++ = id; }, include_touch, bounds);
+  }
+
+  //! Write the overlaps of a query into a buffer, allocating nothing.
+  /*! \param out
+          The buffer. Overlaps past its end are counted but not written.
+
+      \return
+          The number of overlaps, more than out.size() if the buffer
+          overflowed, in which case a buffer that large can be retried.
+   */
+  template <class Query>
+  std::size_t get_overlaps(const Query &query,
+                           std::span<node_id> out,
+                           bool include_touch = true,
+                           const vec<ValTy> &bounds = {}) const
+  {
+    std::size_t count = 0;
+    visit_overlaps(
+        query,
+        [&](node_id id) {
+          if (count < out.size())
+            out[count] = id;
+          count++;
+        },
+        include_touch, bounds);
+    return count;
+  }
+
+  //! Query the tree to find candidate interactions for an AABB.
+  /*! \param aabb
+          The AABB.
+
+      \return entrys
+          A vector of entry indices.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query,
+                                         bool include_touch = true,
+                                         const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
+    return overlaps;
+  }
+
+  template <class Query>
+  bool any_overlap(const Query &query,
+                   bool include_touch = true,
+                   const vec<ValTy> &bounds = {}) const
+  {
+    return any_overlap(
+        query, [] { return true; }, include_touch, bounds);
+  }
+
+  template <class Query, class Fn>
+  bool any_overlap(const Query &query, Fn &&fn, bool include_touch = true,
+                   const vec<ValTy> &bounds = {}) const
+  {
+    bool overlap = false;
+    auto wrap_fn = [&overlap, &fn](node_id id, const aabb &bb) {
+      bool success = detail::call_with_args(std::forward<Fn>(fn), id, bb);
+      overlap |= success;
+      return success ? visit_stop : visit_continue;
+    };
+    visit_overlaps(query, wrap_fn, include_touch, bounds);
+    return overlap;
+  }
+
+  template <class Fn>
+  void for_each(Fn &&fn) const
+  {
+    for (auto idx = 0ull; idx < m_node_capacity; ++idx) {
+      const auto &node = m_nodes[idx];
+      if (node.isLeaf()) {
+        detail::call_with_args(std::forward<Fn>(fn), to_id(idx), node.bb,
+                               node.user_data);
+      }
+    }
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
                       bool include_touch = true,
                       const vec<ValTy> &bounds = {}) const
   {
-    static thread_local std::vector<unsigned int> stack(64);
-    return visit_overlaps(query, std::forward<Fn>(fn), include_touch, bounds, stack);
+    static_assert(std::is_same_v<Query, point> || std::is_same_v<Query, aabb>,
+                  "Only point or aabb queries are supported");
+    if (size() == 0)
+      return;
+
+    detail::no_counters counters;
+    traverse_overlaps(m_nodes, m_branches, m_root, query, std::forward<Fn>(fn),
+                      include_touch, effective_bounds(bounds), counters);
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch,
+                      const vec<ValTy> &bounds, 
+                      std::vector<unsigned> &stack) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
+    static_assert(query_is_point || query_is_aabb,
+                  "Only point or aabb queries are supported");
+
+
+    // Make sure the tree isn't empty.
+    if (size() == 0) {
+      return;
+    }
+
+    detail::no_counters counters;
+    traverse_overlaps(m_nodes, m_branches, m_root, query, std::forward<Fn>(fn),
+                      include_touch, effective_bounds(bounds), stack, counters);
+  }
+
+  //! Visit the overlaps of a query, counting the work done.
+  /*! \param counters
+          Incremented with the nodes visited, leaves tested, false
+          positives and stack depth of this query.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      query_counters &counters,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    static_assert(std::is_same_v<Query, point> || std::is_same_v<Query, aabb>,
+                  "Only point or aabb queries are supported");
+    if (size() == 0)
+      return;
+
+    traverse_overlaps(m_nodes, m_branches, m_root, query, std::forward<Fn>(fn),
+                      include_touch, effective_bounds(bounds), counters);
+  }
+
+ private:
+  /// The deepest tree whose queries run on an inline_stack.
+  static constexpr unsigned int inline_stack_depth = 64;
+
+  //! Run traverse_overlaps on a stack sized from the height of the tree.
+  /*! Trees no taller than inline_stack_depth, which is every balanced tree
+      that fits in memory, walk on a stack in place. Taller ones fall back
+      to a stack kept per thread, which allocates as it first grows.
+   */
+  template <class Nodes, class Branches, class Query, class Fn, class Counters>
+  static void traverse_overlaps(const Nodes &nodes,
+                                const Branches &branches,
+                                unsigned int rootIndex,
+                                const Query &query,
+                                Fn &&fn,
+                                bool include_touch,
+                                const vec<ValTy> &period,
+                                Counters &counters)
+  {
+    if (nodes[rootIndex].height <= int(inline_stack_depth)) {
+      detail::inline_stack<unsigned int, inline_stack_depth> stack;
+      traverse_overlaps(nodes, branches, rootIndex, query, std::forward<Fn>(fn),
+                        include_touch, period, stack, counters);
+    }
+    else {
+      static thread_local std::vector<unsigned int> stack;
+      traverse_overlaps(nodes, branches, rootIndex, query, std::forward<Fn>(fn),
+                        include_touch, period, stack, counters);
+    }
+  }
+
+  //! The traversal behind visit_overlaps, over any node storage.
+  /*! Shared with tree_view, which runs it over the nodes of a mapped file.
+      The tree must not be empty.
+   */
+  template <class Nodes, class Branches, class Query, class Fn, class Stack, class Counters>
+  static void traverse_overlaps(const Nodes &nodes,
+                                const Branches &branches,
+                                unsigned int rootIndex,
+                                const Query &query,
+                                Fn &&fn,
+                                bool include_touch,
+                                const vec<ValTy> &period,
+                                Stack &stack,
+                                Counters &counters)
+  {
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), node_id{},
+                                               aabb{}, Payload{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    const auto &root = nodes[rootIndex];
+
+    // Walk the tree for one image of the query, reporting whether to stop.
+    // A leaf is reported for the first image reaching it only, so that one
+    // overlapping an earlier image is skipped. Touching is a template
+    // argument so that it stays out of the loop.
+    auto walk = [&](const Query &image, std::span<const Query> earlier, auto touch) {
+      constexpr bool Touch = decltype(touch)::value;
+      auto visit = [&](unsigned int child) {
+        auto leaf = child & ~LEAF_FLAG;
+        if constexpr (!exact_branches) {
+          if (!overlaps<Touch>(nodes[leaf].bb.lowerBound.values,
+                               nodes[leaf].bb.upperBound.values, image))
+            return false;
+        }
+        for (const auto &other : earlier) {
+          if (overlaps<Touch>(nodes[leaf].bb.lowerBound.values,
+                              nodes[leaf].bb.upperBound.values, other))
+            return false;
+        }
+        if constexpr (fn_returns_action) {
+          return detail::call_with_args(std::forward<Fn>(fn), nodes[leaf].id,
+                                        nodes[leaf].bb,
+                                        nodes[leaf].user_data) == visit_stop;
+        }
+        else {
+          detail::call_with_args(std::forward<Fn>(fn), nodes[leaf].id, nodes[leaf].bb,
+                                 nodes[leaf].user_data);
+          return false;
+        }
+      };
+
+      if (!overlaps<Touch>(root.bb.lowerBound.values, root.bb.upperBound.values, image))
+        return false;
+      if (root.isLeaf())
+        return visit(rootIndex);
+
+      vec<bound_type> lower, upper;
+      if constexpr (!exact_branches)
+        round_outwards(image, lower, upper);
+      auto reaches = [&](const vec<bound_type> &lo, const vec<bound_type> &hi) {
+        if constexpr (exact_branches)
+          return overlaps<Touch>(lo, hi, image);
+        else
+          return overlaps<Touch>(lo, hi, lower, upper);
+      };
+
+      stack.clear();
+      stack.push_back(rootIndex);
+      while (!stack.empty()) {
+        const auto &b = branches[stack.back()];
+        stack.pop_back();
+        counters.visit_node();
+
+        bool hit = false;
+        for (unsigned int c = 0; c < 2; c++) {
+          if (b.child[c] & LEAF_FLAG)
+            counters.test_leaf();
+          if (!reaches(b.lowerBound[c], b.upperBound[c]))
+            continue;
+          hit = true;
+          if (!(b.child[c] & LEAF_FLAG)) {
+            stack.push_back(b.child[c]);
+            counters.stack_size(stack.size());
+          }
+          else if (visit(b.child[c])) {
+            return true;
+          }
+        }
+        if (!hit)
+          counters.miss();
+      }
+      return false;
+    };
+    auto traverse = [&](const Query &image, std::span<const Query> earlier) {
+      return include_touch ? walk(image, earlier, std::true_type{})
+                           : walk(image, earlier, std::false_type{});
+    };
+
+    visit_images(query, root.bb, period, traverse);
+  }
+
+ public:
+  /// The number of queries traversed together by the batched queries.
+  static constexpr unsigned int batch_size = 32;
+
+  //! Visit the overlaps of many queries in one pass.
+  /*! Queries are ordered along a Morton curve and walked down the tree in
+      packets of up to batch_size neighbours, so every node a packet needs
+      is loaded once for all of them rather than once per query.
+
+      \param queries
+          The AABBs or points.
+
+      \param fn
+          Called as fn(query, id) or fn(query, id, bb), where query is the
+          index into queries. Returning visit_stop ends that query only.
+
+      \param threads
+          The number of threads sharing out the packets, 0 for one per
+          core. With several threads fn is called concurrently, but all
+          calls for one query come from the same thread.
+
+      Queries and their periodic images are indexed in 32 bits; a batch
+      with more throws std::length_error.
+   */
+  template <class Fn>
+  void visit_overlaps_batch(std::span<const aabb> queries,
+                            Fn &&fn,
+                            bool include_touch = true,
+                            const vec<ValTy> &bounds = {},
+                            unsigned int threads = 1) const
+  {
+    visit_batch(queries, batch_callback(fn), include_touch, bounds, threads);
+  }
+
+  template <class Fn>
+  void visit_overlaps_batch(std::span<const point> queries,
+                            Fn &&fn,
+                            bool include_touch = true,
+                            const vec<ValTy> &bounds = {},
+                            unsigned int threads = 1) const
+  {
+    visit_batch(queries, batch_callback(fn), include_touch, bounds, threads);
+  }
+
+  //! Collect the overlaps of many queries as (query, id) pairs.
+  /*! \param out
+          Cleared, then filled in traversal order; its capacity is reused.
+          Threads fill buffers of their own, appended to out at the end.
+   */
+  void get_overlaps_batch(std::span<const aabb> queries,
+                          std::vector<std::pair<std::size_t, node_id>> &out,
+                          bool include_touch = true,
+                          const vec<ValTy> &bounds = {},
+                          unsigned int threads = 1) const
+  {
+    collect_batch(queries, out, include_touch, bounds, threads);
+  }
+
+  void get_overlaps_batch(std::span<const point> queries,
+                          std::vector<std::pair<std::size_t, node_id>> &out,
+                          bool include_touch = true,
+                          const vec<ValTy> &bounds = {},
+                          unsigned int threads = 1) const
+  {
+    collect_batch(queries, out, include_touch, bounds, threads);
+  }
+
+  //! Visit the overlaps of one query on several threads.
+  /*! The top of the tree is split into subtrees that are shared out among
+      the threads. A thread that runs dry steals a pending subtree from
+      another, and a busy thread hands over the top of its own stack as
+      soon as someone is waiting. Meant for queries large enough to visit
+      very many nodes; small ones are better served by visit_overlaps.
+
+      \param fn
+          Called concurrently as fn(thread, id) or fn(thread, id, bb), where
+          thread is in [0, threads). Returning visit_stop ends the search.
+
+      \param threads
+          The number of threads, 0 for one per core.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps_parallel(const Query &query,
+                               Fn &&fn,
+                               bool include_touch = true,
+                               const vec<ValTy> &bounds = {},
+                               unsigned int threads = 0) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
+    static_assert(query_is_point || query_is_aabb,
+                  "Only point or aabb queries are supported");
+    constexpr bool call_with_bb =
+        std::is_invocable_v<Fn, unsigned int, node_id, const aabb &>;
+    using rt = typename std::conditional_t<
+        call_with_bb, std::invoke_result<Fn, unsigned int, node_id, const aabb &>,
+        std::invoke_result<Fn, unsigned int, node_id>>::type;
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    if (size() == 0)
+      return;
+    threads = detail::thread_count(threads);
+
+    std::atomic<bool> stop = false;
+    auto report = [&](unsigned int thread, unsigned int leaf) {
+      if constexpr (fn_returns_action) {
+        visit_action action;
+        if constexpr (call_with_bb)
+          action = fn(thread, to_id(leaf), m_nodes[leaf].bb);
+        else
+          action = fn(thread, to_id(leaf));
+        if (action == visit_stop)
+          stop = true;
+      }
+      else {
+        if constexpr (call_with_bb)
+          fn(thread, to_id(leaf), m_nodes[leaf].bb);
+        else
+          fn(thread, to_id(leaf));
+      }
+    };
+
+    // Search each image of the query that reaches the root in turn, with
+    // all threads on one image at a time.
+    const auto &root = m_nodes[m_root];
+    auto search = [&](const Query &image, std::span<const Query> earlier) {
+      auto hit = [&](const auto &lo, const auto &hi) {
+        return include_touch ? overlaps<true>(lo, hi, image)
+                             : overlaps<false>(lo, hi, image);
+      };
+      auto visit = [&](unsigned int thread, unsigned int leaf) {
+        const auto &bb = m_nodes[leaf].bb;
+        if constexpr (!exact_branches) {
+          if (!hit(bb.lowerBound.values, bb.upperBound.values))
+            return;
+        }
+        if (!reached_before(bb.lowerBound.values, bb.upperBound.values, earlier,
+                            include_touch))
+          report(thread, leaf);
+      };
+
+      if (!hit(root.bb.lowerBound.values, root.bb.upperBound.values))
+        return false;
+      if (root.isLeaf()) {
+        visit(0, m_root);
+        return bool(stop);
+      }
+
+      // Open the top levels breadth first until every thread has some work.
+      std::vector<unsigned int> tasks = {m_root};
+      while (tasks.size() < threads * parallel_tasks_per_thread) {
+        std::vector<unsigned int> next;
+        for (auto node : tasks) {
+          const auto &b = m_branches[node];
+          for (unsigned int c = 0; c < 2; c++) {
+            if (!hit(b.lowerBound[c], b.upperBound[c]))
+              continue;
+            if (b.child[c] & LEAF_FLAG) {
+              visit(0, b.child[c] & ~LEAF_FLAG);
+              if (stop)
+                return true;
+            }
+            else
+              next.push_back(b.child[c]);
+          }
+        }
+        tasks = std::move(next);
+        if (tasks.empty())
+          return false;
+      }
+
+      detail::work_stealing(threads, std::move(tasks), [&](unsigned int thread,
+                                                           unsigned int task,
+                                                           auto &pool) {
+        // The workers persist, so each keeps its stack from query to query.
+        static thread_local std::vector<unsigned int> stack(64);
+        stack.assign(1, task);
+
+        while (!stack.empty() && !stop) {
+          // Hand the largest pending subtree to an idle thread.
+          if (stack.size() > 1 && pool.hungry()) {
+            pool.spawn(thread, stack.front());
+            stack.erase(stack.begin());
+          }
+
+          const auto &b = m_branches[stack.back()];
+          stack.pop_back();
+          for (unsigned int c = 0; c < 2 && !stop; c++) {
+            if (!hit(b.lowerBound[c], b.upperBound[c]))
+              continue;
+            if (b.child[c] & LEAF_FLAG)
+              visit(thread, b.child[c] & ~LEAF_FLAG);
+            else
+              stack.push_back(b.child[c]);
+          }
+        }
+      });
+      return bool(stop);
+    };
+
+    visit_images(query, root.bb, effective_bounds(bounds), search);
+  }
+
+  //! Collect the overlaps of one query using several threads.
+  /*! \return
+          The ids of the overlapping entries, in no particular order.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps_parallel(const Query &query,
+                                             bool include_touch = true,
+                                             const vec<ValTy> &bounds = {},
+                                             unsigned int threads = 0) const
+  {
+    threads = detail::thread_count(threads);
+    std::vector<std::vector<node_id>> buffers(threads);
+    visit_overlaps_parallel(
+        query, [&](unsigned int thread, node_id id) { buffers[thread].push_back(id); },
+        include_touch, bounds, threads);
+
+    std::vector<node_id> overlaps;
+    detail::concatenate(buffers, overlaps);
+    return overlaps;
+  }
+
+  //! Visit the entries whose AABBs a ray passes through, front to back.
+  /*! Children are entered nearest first and anything starting beyond the
+      current end of the ray is skipped, so a callback that shortens the
+      ray prunes everything behind its closest hit so far. Along periodic
+      axes every image of the box the ray passes through is searched, so
+      a long ray can report an entry more than once.
+
+      \param r
+          The ray or segment.
+
+      \param fn
+          Called as fn(id, t) or fn(id, bb, t), where t is the entry point
+          along the ray. It may return nothing, a visit_action, or a new,
+          shorter tMax, e.g. the exact distance to the entry's shape.
+
+      \param tMax
+          The end of the ray, 1 for a segment made by ray::segment.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  template <class Fn>
+  void visit_ray(const ray &r,
+                 Fn &&fn,
+                 double tMax = std::numeric_limits<double>::infinity(),
+                 const vec<ValTy> &bounds = {}) const
+  {
+    const vec<ValTy> &period = effective_bounds(bounds);
+    constexpr bool call_with_bb = std::is_invocable_v<Fn, node_id, const aabb &, double>;
+    using rt = typename std::conditional_t<
+        call_with_bb, std::invoke_result<Fn, node_id, const aabb &, double>,
+        std::invoke_result<Fn, node_id, double>>::type;
+    static_assert(std::is_same_v<rt, void> || std::is_same_v<rt, visit_action> ||
+                      std::is_floating_point_v<rt>,
+                  "Only void, visit_action or new tMax return types are allowed");
+
+    if (size() == 0)
+      return;
+
+    const auto &root = m_nodes[m_root];
+    static thread_local std::vector<std::pair<unsigned int, double>> stack(64);
+
+    auto images = detail::ray_images(r, root.bb.lowerBound, root.bb.upperBound,
+                                     tMax, period);
+    for (const auto &[tRoot, image] : images) {
+      if (tRoot > tMax)
+        break;
+
+      stack.clear();
+      stack.emplace_back(root.isLeaf() ? m_root | LEAF_FLAG : m_root, tRoot);
+      while (!stack.empty()) {
+        auto [child, tEnter] = stack.back();
+        stack.pop_back();
+        if (tEnter > tMax)
+          continue;
+
+        if (child & LEAF_FLAG) {
+          unsigned int leaf = child & ~LEAF_FLAG;
+          if constexpr (std::is_same_v<rt, void>) {
+            if constexpr (call_with_bb)
+              fn(to_id(leaf), m_nodes[leaf].bb, tEnter);
+            else
+              fn(to_id(leaf), tEnter);
+          }
+          else {
+            rt result;
+            if constexpr (call_with_bb)
+              result = fn(to_id(leaf), m_nodes[leaf].bb, tEnter);
+            else
+              result = fn(to_id(leaf), tEnter);
+
+            if constexpr (std::is_same_v<rt, visit_action>) {
+              if (result == visit_stop)
+                return;
+            }
+            else {
+              tMax = std::min<double>(tMax, result);
+            }
+          }
+          continue;
+        }
+
+        // Leaves are entered where the ray meets their exact AABB.
+        const auto &b = m_branches[child];
+        double t[2];
+        bool hit[2];
+        for (unsigned int c = 0; c < 2; c++) {
+          if (!exact_branches && (b.child[c] & LEAF_FLAG)) {
+            const auto &bb = m_nodes[b.child[c] & ~LEAF_FLAG].bb;
+            hit[c] = image.intersects(bb.lowerBound, bb.upperBound, tMax, t[c]);
+          }
+          else {
+            hit[c] = image.intersects(b.lowerBound[c], b.upperBound[c], tMax, t[c]);
+          }
+        }
+
+        // Push the far child first so that the near one is visited first.
+        unsigned int nearChild = hit[1] && (!hit[0] || t[1] < t[0]);
+        if (hit[1 - nearChild])
+          stack.emplace_back(b.child[1 - nearChild], t[1 - nearChild]);
+        if (hit[nearChild])
+          stack.emplace_back(b.child[nearChild], t[nearChild]);
+      }
+    }
+  }
+
+  //! Find the first entry whose AABB a ray hits.
+  /*! \return
+          The entry and where the ray enters its AABB, if any is hit up to
+          tMax.
+   */
+  std::optional<std::pair<node_id, double>> cast_ray(
+      const ray &r,
+      double tMax = std::numeric_limits<double>::infinity(),
+      const vec<ValTy> &bounds = {}) const
+  {
+    std::optional<std::pair<node_id, double>> closest;
+    visit_ray(
+        r,
+        [&](node_id id, double t) {
+          if (!closest || t < closest->second)
+            closest.emplace(id, t);
+          return t;
+        },
+        tMax, bounds);
+    return closest;
+  }
+
+  //! Visit the entries a moving box sweeps through, in order of contact.
+  /*! The box moves by displacement for t in [0, 1]. Each node is tested by
+      tracing the box's centre through the node grown by the box's half
+      extents, the slab test for the swept box, so a fast diagonal move
+      only opens the nodes along its path rather than everything inside
+      one box around its start and end. Nodes are opened best first, so
+      entries are visited in order of their time of first contact. As with
+      visit_ray, an entry can be visited once per periodic image swept.
+
+      \param bb
+          The box at t = 0.
+
+      \param displacement
+          How far the box moves over the step.
+
+      \param fn
+          Called as fn(id, t) or fn(id, bb, t), where t is the time of first
+          contact, 0 if the box starts overlapping the entry. It may return
+          visit_stop to end the query.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  template <class Fn>
+  void visit_swept_overlaps(const aabb &bb,
+                            const vec<ValTy> &displacement,
+                            Fn &&fn,
+                            const vec<ValTy> &bounds = {}) const
+  {
+    const vec<ValTy> &period = effective_bounds(bounds);
+    constexpr bool call_with_bb = std::is_invocable_v<Fn, node_id, const aabb &, double>;
+    using rt = typename std::conditional_t<
+        call_with_bb, std::invoke_result<Fn, node_id, const aabb &, double>,
+        std::invoke_result<Fn, node_id, double>>::type;
+    static_assert(std::is_same_v<rt, void> || std::is_same_v<rt, visit_action>,
+                  "Only void or visit_action return types are allowed");
+
+    if (size() == 0)
+      return;
+
+    using dvec = typename ray::vec;
+    ray r;
+    dvec half;
+    for (unsigned int i = 0; i < Dim; i++) {
+      half[i] = 0.5 * (double(bb.upperBound[i]) - double(bb.lowerBound[i]));
+      r.origin[i] = double(bb.lowerBound[i]) + half[i];
+      r.direction[i] = displacement[i];
+      r.inverse[i] = 1 / r.direction[i];
+    }
+    auto grow = [&half](const auto &lowerBound, const auto &upperBound, dvec &lower,
+                        dvec &upper) {
+      for (unsigned int i = 0; i < Dim; i++) {
+        lower[i] = lowerBound[i] - half[i];
+        upper[i] = upperBound[i] + half[i];
+      }
+    };
+
+    struct item {
+      double t;
+      unsigned int child;
+      unsigned int image;
+      bool operator<(const item &other) const { return t > other.t; }
+    };
+    static thread_local std::vector<item> heap;
+    heap.clear();
+
+    const auto &root = m_nodes[m_root];
+    dvec lower, upper;
+    grow(root.bb.lowerBound, root.bb.upperBound, lower, upper);
+    auto images = detail::ray_images(r, lower, upper, 1.0, period);
+    for (unsigned int i = 0; i < images.size(); i++) {
+      if (images[i].first <= 1)
+        heap.push_back({images[i].first, root.isLeaf() ? m_root | LEAF_FLAG : m_root, i});
+    }
+    std::make_heap(heap.begin(), heap.end());
+
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end());
+      item top = heap.back();
+      heap.pop_back();
+
+      if (top.child & LEAF_FLAG) {
+        unsigned int leaf = top.child & ~LEAF_FLAG;
+        if constexpr (std::is_same_v<rt, void>) {
+          if constexpr (call_with_bb)
+            fn(to_id(leaf), m_nodes[leaf].bb, top.t);
+          else
+            fn(to_id(leaf), top.t);
+        }
+        else {
+          visit_action result;
+          if constexpr (call_with_bb)
+            result = fn(to_id(leaf), m_nodes[leaf].bb, top.t);
+          else
+            result = fn(to_id(leaf), top.t);
+          if (result == visit_stop)
+            return;
+        }
+        continue;
+      }
+
+      const auto &b = m_branches[top.child];
+      const auto &image = images[top.image].second;
+      for (unsigned int c = 0; c < 2; c++) {
+        double t;
+        if (!exact_branches && (b.child[c] & LEAF_FLAG)) {
+          const auto &bb = m_nodes[b.child[c] & ~LEAF_FLAG].bb;
+          grow(bb.lowerBound, bb.upperBound, lower, upper);
+        }
+        else {
+          grow(b.lowerBound[c], b.upperBound[c], lower, upper);
+        }
+        if (image.intersects(lower, upper, 1.0, t)) {
+          heap.push_back({t, b.child[c], top.image});
+          std::push_heap(heap.begin(), heap.end());
+        }
+      }
+    }
+  }
+
+  //! Collect the entries a moving box sweeps through.
+  /*! \return
+          Pairs of entry and time of first contact, earliest first.
+   */
+  std::vector<std::pair<node_id, double>> get_swept_overlaps(
+      const aabb &bb, const vec<ValTy> &displacement, const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<std::pair<node_id, double>> overlaps;
+    visit_swept_overlaps(
+        bb, displacement, [&](node_id id, double t) { overlaps.emplace_back(id, t); },
+        bounds);
+    return overlaps;
+  }
+
+  //! Find the k entries nearest to a point.
+  /*! Nodes are opened best first by the distance to their bounds, so only
+      the part of the tree closer than the k-th answer is visited.
+
+      \param pt
+          The point.
+
+      \param k
+          The number of entries to find.
+
+      \param distance
+          Called as distance(id) or distance(id, bb) to get the exact
+          distance to an entry, e.g. to the particle at its centre. It must
+          not be less than the distance to the bounds of the entry.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+
+      \return
+          Up to k entries and their distances, nearest first.
+   */
+  template <class Fn>
+    requires(!std::is_convertible_v<Fn, vec<ValTy>>)
+  std::vector<std::pair<node_id, double>> nearest(const point &pt,
+                                                  unsigned int k,
+                                                  Fn &&distance,
+                                                  const vec<ValTy> &bounds = {}) const
+  {
+    const vec<ValTy> &period = effective_bounds(bounds);
+    std::vector<std::pair<node_id, double>> result;
+    if (size() == 0 || k == 0)
+      return result;
+    result.reserve(std::min(k, size()));
+
+    // The queue holds branch child references, with the lower bound on
+    // their distance. Leaves are pushed back with their exact distance
+    // marked by EXACT_FLAG, and reported when they reach the front.
+    constexpr unsigned int EXACT_FLAG = NULL_NODE;
+    struct entry {
+      double distance;
+      unsigned int child;
+      unsigned int leaf;
+      bool operator<(const entry &other) const { return distance > other.distance; }
+    };
+    static thread_local std::vector<entry> queue;
+    queue.clear();
+
+    auto push = [&](unsigned int child, const auto &lo, const auto &hi) {
+      queue.push_back({std::sqrt(distance_squared(lo, hi, pt, period)), child, 0});
+      std::push_heap(queue.begin(), queue.end());
+    };
+    const auto &root = m_nodes[m_root];
+    push(root.isLeaf() ? m_root | LEAF_FLAG : m_root, root.bb.lowerBound.values,
+         root.bb.upperBound.values);
+
+    while (!queue.empty() && result.size() < k) {
+      std::pop_heap(queue.begin(), queue.end());
+      entry e = queue.back();
+      queue.pop_back();
+
+      if (e.child == EXACT_FLAG) {
+        result.emplace_back(to_id(e.leaf), e.distance);
+      }
+      else if (e.child & LEAF_FLAG) {
+        unsigned int leaf = e.child & ~LEAF_FLAG;
+        double exact = detail::call_with_args(std::forward<Fn>(distance), to_id(leaf),
+                                              m_nodes[leaf].bb);
+        assert(exact >= e.distance * (1 - 1e-9));
+        queue.push_back({exact, EXACT_FLAG, leaf});
+        std::push_heap(queue.begin(), queue.end());
+      }
+      else {
+        const auto &b = m_branches[e.child];
+        for (unsigned int c = 0; c < 2; c++)
+          push(b.child[c], b.lowerBound[c], b.upperBound[c]);
+      }
+    }
+    return result;
   }
 
-  template <class Query, class Fn>
-  void visit_overlaps(const Query &query,
-                      Fn &&fn,
-                      bool include_touch,
-                      const vec<ValTy> &bounds, 
-                      std::vector<unsigned> &stack) const
+  //! Find the k entries whose AABBs are nearest to a point.
+  std::vector<std::pair<node_id, double>> nearest(const point &pt,
+                                                  unsigned int k,
+                                                  const vec<ValTy> &bounds = {}) const
   {
-    constexpr bool query_is_point = std::is_same_v<Query, point>;
-    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
-    static_assert(query_is_point || query_is_aabb,
-                  "Only point or aabb queries are supported");
+    const vec<ValTy> &period = effective_bounds(bounds);
+    return nearest(
+        pt, k,
+        [&](node_id, const aabb &bb) {
+          return std::sqrt(distance_squared(bb.lowerBound.values,
+                                            bb.upperBound.values, pt, period));
+        },
+        bounds);
+  }
+
+  //! Visit the entries whose AABBs lie within a distance of a point.
+  /*! Nodes are pruned by their exact distance to the sphere rather than by
+      the bounding box of the sphere, so the corners of the box are never
+      visited.
+
+      \param pt
+          The centre of the sphere.
+
+      \param radius
+          The radius; AABBs at exactly this distance are included.
 
+      \param fn
+          Called as fn(id) or fn(id, bb), returning nothing or a
+          visit_action.
 
-    using rt = decltype(call_with_args(std::forward<Fn>(fn), to_id(0), aabb{}));
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  template <class Fn>
+  void visit_within_radius(const point &pt,
+                           double radius,
+                           Fn &&fn,
+                           const vec<ValTy> &bounds = {}) const
+  {
+    const vec<ValTy> &period = effective_bounds(bounds);
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), to_id(0),
+                                               aabb{}, Payload{}));
     constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
     static_assert(fn_returns_action || std::is_same_v<rt, void>,
                   "Only void or visit_action return types are allowed");
 
-    // Make sure the tree isn't empty.
-    if (size() == 0) {
+    if (size() == 0)
       return;
-    }
 
-    stack.clear();
+    const double radiusSquared = radius * radius;
+    const auto &root = m_nodes[m_root];
+    if (distance_squared(root.bb.lowerBound.values, root.bb.upperBound.values, pt,
+                         period) > radiusSquared)
+      return;
 
-    stack.push_back(m_root);
+    static thread_local std::vector<unsigned int> stack(64);
+    stack.clear();
+    stack.push_back(root.isLeaf() ? m_root | LEAF_FLAG : m_root);
 
     while (!stack.empty()) {
-      unsigned int node = stack.back();
+      unsigned int child = stack.back();
       stack.pop_back();
 
-      // Copy the AABB.
-      const auto &nodeAABB = m_nodes[node].bb;
-
-      auto shifted_query = query;
-      if (node == NULL_NODE)
+      if (child & LEAF_FLAG) {
+        unsigned int leaf = child & ~LEAF_FLAG;
+        if constexpr (fn_returns_action) {
+          if (detail::call_with_args(std::forward<Fn>(fn), to_id(leaf),
+                                     m_nodes[leaf].bb,
+                                     m_nodes[leaf].user_data) == visit_stop)
+            return;
+        }
+        else {
+          detail::call_with_args(std::forward<Fn>(fn), to_id(leaf), m_nodes[leaf].bb,
+                                 m_nodes[leaf].user_data);
+        }
         continue;
-
-      vec<ValTy> separation = {};
-      point center;
-      if constexpr (query_is_point) {
-        center = query;
-      }
-      else {
-        center = query.centre;
-      }
-      for (unsigned int i = 0; i < Dim; i++) {
-        separation[i] = nodeAABB.centre[i] - center[i];
       }
 
-      shifted_query = shifted_query + minimum_image_shift(bounds, separation);
-      
-
-      // Test for overlap between the AABBs.
-      if (nodeAABB.overlaps(shifted_query, include_touch)) {
-        // Check that we're at a leaf node.
-        if (m_nodes[node].isLeaf()) {
-          const auto &n = m_nodes[node];
-          if constexpr (fn_returns_action) {
-            if (call_with_args(std::forward<Fn>(fn), to_id(node), n.bb) == visit_stop) {
-              return;
-            }
-          }
-          else {
-            call_with_args(std::forward<Fn>(fn), to_id(node), n.bb);
-          }
+      const auto &b = m_branches[child];
+      for (unsigned int c = 0; c < 2; c++) {
+        bool reached;
+        if (!exact_branches && (b.child[c] & LEAF_FLAG)) {
+          const auto &bb = m_nodes[b.child[c] & ~LEAF_FLAG].bb;
+          reached = distance_squared(bb.lowerBound.values, bb.upperBound.values, pt,
+                                     period) <= radiusSquared;
         }
         else {
-          stack.push_back(m_nodes[node].left);
-          stack.push_back(m_nodes[node].right);
+          reached = distance_squared(b.lowerBound[c], b.upperBound[c], pt, period) <=
+                    radiusSquared;
         }
+        if (reached)
+          stack.push_back(b.child[c]);
+      }
+    }
+  }
+
+  //! Visit every pair of overlapping entries in this tree.
+  /*! The tree is descended against itself, so whole subtrees that cannot
+      overlap are discarded together. Each pair is reported exactly once.
+
+      \param fn
+          Called as fn(id1, id2). Returning visit_stop ends the search.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  template <class Fn>
+  void visit_self_overlaps(Fn &&fn,
+                           bool include_touch = true,
+                           const vec<ValTy> &bounds = {}) const
+  {
+    visit_pairs(*this, std::forward<Fn>(fn), include_touch, bounds, true);
+  }
+
+  //! Visit every pair of overlapping entries between this tree and another.
+  /*! Both trees are descended together. Passing this tree as other reports
+      each pair in both orders and every entry with itself; use
+      visit_self_overlaps for distinct pairs.
+
+      \param other
+          The other tree.
+
+      \param fn
+          Called as fn(id, other_id), where id is an entry of this tree.
+          Returning visit_stop ends the search.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  template <class Fn>
+  void visit_overlaps(const tree &other,
+                      Fn &&fn,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    visit_pairs(other, std::forward<Fn>(fn), include_touch, bounds, false);
+  }
+
+  //! Take an immutable copy of the tree for other threads to query.
+  /*! The copy is a deep one, O(n) in time and memory for every version
+      of the tree snapshotted: after any change, the next call copies all
+      nodes, branches and handles again. It is shared, though: further
+      calls return the same one until the tree changes, so taking a
+      snapshot every step costs nothing while nothing moves. Readers can
+      query a snapshot without locks while this tree keeps being updated,
+      and it stays alive for as long as any of them holds it.
+
+      snapshot() keeps the copy in the tree, so it modifies it and must
+      not race with updates or other calls. The usual pattern is for the
+      updating thread to take it and publish it, e.g. through a
+      std::atomic<std::shared_ptr>.
+   */
+  std::shared_ptr<const tree> snapshot()
+  {
+    if (!m_snapshot || m_snapshot_version != m_version) {
+      auto copy = std::make_shared<tree>(*this);
+      copy->m_snapshot.reset();
+      m_snapshot = std::move(copy);
+      m_snapshot_version = m_version;
+    }
+    return m_snapshot;
+  }
+
+  //! Make room for a number of entries without growing the node pool.
+  /*! \param entries
+          The number of entries the tree should hold.
+   */
+  void reserve(unsigned int entries)
+  {
+    unsigned int needed = entries > 0 ? 2 * entries - 1 : 0;
+    if (needed > m_node_capacity)
+      grow(needed);
+  }
+
+  /// The number of nodes the pool holds, in use or free.
+  unsigned int capacity() const { return m_node_capacity; }
+
+  /// A counter that changes whenever entries are added, moved or removed.
+  std::uint64_t version() const { return m_version; }
+
+  /// The periodic box given at construction, zero along non-periodic axes.
+  const vec<ValTy> &periodic_bounds() const { return m_bounds; }
+
+  //! Save the tree in the flat binary format read by load() and tree_view.
+  /*! Nodes are written as they are held, free ones included, so loading
+      needs no parsing or rebuilding. Payloads are copied byte for byte, so
+      pointers in them only mean something to the process that saved them.
+      Throws std::runtime_error if the stream fails.
+   */
+  void save(std::ostream &os) const
+  {
+    detail::file_header header = make_header();
+    std::uint64_t pos = 0;
+    auto write = [&](const void *data, std::uint64_t bytes) {
+      os.write(static_cast<const char *>(data), bytes);
+      pos += bytes;
+    };
+    auto pad_to = [&](std::uint64_t offset) {
+      static constexpr char zeros[detail::file_alignment] = {};
+      write(zeros, offset - pos);
+    };
+    auto write_pool = [&](const auto &pool) {
+      std::uint64_t left = m_node_capacity;
+      for (std::size_t i = 0; left != 0; i++) {
+        auto run = pool.block(i);
+        std::uint64_t n = std::min<std::uint64_t>(run.size(), left);
+        write(run.data(), n * sizeof(run[0]));
+        left -= n;
       }
+    };
+
+    write(&header, sizeof(header));
+    pad_to(header.bounds_offset);
+    write(m_bounds.data(), sizeof(m_bounds));
+    pad_to(header.nodes_offset);
+    write_pool(m_nodes);
+    pad_to(header.branches_offset);
+    write_pool(m_branches);
+    pad_to(header.handles_offset);
+    write(m_handles.data(), m_handles.size() * sizeof(handle));
+    pad_to(header.file_size);
+    if (!os)
+      throw std::runtime_error("abt: failed to write tree");
+  }
+
+  //! Load a tree written by save(), ready to be queried and updated.
+  /*! Throws std::runtime_error if the stream fails, was saved by a tree of
+      a different layout, or holds a header whose sections do not fit in
+      the stream, as checked before anything is allocated for them when
+      the stream can tell its length. The nodes are then walked once, and
+      a tree whose links are unsound is turned away too.
+   */
+  static tree load(std::istream &is)
+  {
+    detail::file_header header;
+    is.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!is || !matches_layout(header))
+      throw std::runtime_error("abt: not a tree saved with this layout");
+
+    std::uint64_t available = header.file_size;
+    auto start = is.tellg();
+    if (start != std::istream::pos_type(-1) && is.seekg(0, std::ios::end)) {
+      available = sizeof(header) + std::uint64_t(is.tellg() - start);
+      is.seekg(start);
     }
+    is.clear();
+    if (!valid_sections(header, available))
+      throw std::runtime_error("abt: corrupt or truncated tree");
+
+    tree t(header.node_capacity);
+    std::uint64_t pos = sizeof(header);
+    auto read = [&](void *data, std::uint64_t bytes) {
+      is.read(static_cast<char *>(data), bytes);
+      pos += bytes;
+    };
+    auto skip_to = [&](std::uint64_t offset) {
+      is.ignore(offset - pos);
+      pos = offset;
+    };
+    auto read_pool = [&](auto &pool) {
+      for (std::size_t i = 0; i < pool.blocks(); i++) {
+        auto run = pool.block(i);
+        read(run.data(), run.size() * sizeof(run[0]));
+      }
+    };
+
+    skip_to(header.bounds_offset);
+    read(t.m_bounds.data(), sizeof(t.m_bounds));
+    skip_to(header.nodes_offset);
+    read_pool(t.m_nodes);
+    skip_to(header.branches_offset);
+    read_pool(t.m_branches);
+    skip_to(header.handles_offset);
+    t.m_handles.resize(header.handle_count);
+    read(t.m_handles.data(), t.m_handles.size() * sizeof(handle));
+    if (!is)
+      throw std::runtime_error("abt: truncated tree");
+
+    t.m_root = header.root;
+    t.m_node_count = header.node_count;
+    t.m_leaf_count = header.leaf_count;
+    t.m_free_list = header.free_list;
+    t.m_free_handle = header.free_handle;
+    t.skin_width = header.skin_width;
+    t.skin = skin_mode(header.skin);
+    t.adaptive_skin = header.adaptive_skin;
+    t.insertion = insert_strategy(header.insertion);
+    if (!t.valid_links())
+      throw std::runtime_error("abt: corrupt tree");
+    return t;
   }
 
   //! Get a entry AABB.
   /*! \param entry
           The entry index.
    */
-  const aabb &get_aabb(node_id node) const { return m_nodes[to_unsigned(node)].bb; }
+  aabb get_aabb(node_id node) const { return m_nodes[to_unsigned(node)].bb; }
+
+  //! Get the AABB enclosing every entry, skins included.
+  /*! The tree must not be empty.
+   */
+  aabb get_root_aabb() const
+  {
+    assert(m_root != NULL_NODE);
+    return m_nodes[m_root].bb;
+  }
 
   //! Get the height of the tree.
   /*! \return
@@ -813,6 +4159,213 @@ class tree {
     return m_nodes[m_root].height;
   }
 
+  //! Summarise the shape and storage of the tree.
+  /*! This walks every node, so it is meant for deciding now and then
+      whether to rebuild(), optimize() or compact(), not for every step.
+   */
+  tree_stats stats() const
+  {
+    tree_stats s;
+    s.leaves = m_leaf_count;
+    s.height = get_height();
+    s.sah_cost = get_sah_cost();
+    s.free_nodes = m_node_capacity - m_node_count;
+    s.memory_bytes = m_nodes.size() * sizeof(node) + m_branches.size() * sizeof(branch) +
+                     m_handles.capacity() * sizeof(handle);
+
+    unsigned int last = 0, used = 0;
+    for (unsigned int i = 0; i < m_node_capacity; i++) {
+      if (m_nodes[i].height >= 0) {
+        last = i;
+        used++;
+      }
+    }
+    if (m_node_capacity != 0 && used != 0)
+      s.fragmentation = double(last + 1 - used) / m_node_capacity;
+
+    if (m_root == NULL_NODE)
+      return s;
+
+    auto volume = [](const vec<ValTy> &lower, const vec<ValTy> &upper) {
+      double v = 1;
+      for (unsigned int d = 0; d < Dim; d++)
+        v *= std::max(0.0, double(upper[d]) - double(lower[d]));
+      return v;
+    };
+
+    double overlap = 0;
+    unsigned int internal = 0;
+    std::vector<std::pair<unsigned int, unsigned int>> stack = {{m_root, 0}};
+    while (!stack.empty()) {
+      auto [node, depth] = stack.back();
+      stack.pop_back();
+      const auto &n = m_nodes[node];
+      if (n.isLeaf()) {
+        if (s.leaf_depths.size() <= depth)
+          s.leaf_depths.resize(depth + 1);
+        s.leaf_depths[depth]++;
+        continue;
+      }
+
+      const auto &l = m_nodes[n.left].bb, &r = m_nodes[n.right].bb;
+      vec<ValTy> lower, upper;
+      for (unsigned int d = 0; d < Dim; d++) {
+        lower[d] = std::max(l.lowerBound[d], r.lowerBound[d]);
+        upper[d] = std::min(l.upperBound[d], r.upperBound[d]);
+      }
+      double parent = volume(n.bb.lowerBound.values, n.bb.upperBound.values);
+      if (parent > 0)
+        overlap += volume(lower, upper) / parent;
+      internal++;
+
+      stack.emplace_back(n.left, depth + 1);
+      stack.emplace_back(n.right, depth + 1);
+    }
+    if (internal != 0)
+      s.sibling_overlap = overlap / internal;
+    return s;
+  }
+
+  //! Get the surface area heuristic cost of the tree.
+  /*! \return
+          The summed surface area of the internal nodes relative to the
+          root's, the expected number of nodes a random query visits.
+   */
+  double get_sah_cost() const
+  {
+    if (m_root == NULL_NODE || m_nodes[m_root].isLeaf())
+      return 0;
+
+    double cost = 0;
+    for (unsigned int i = 0; i < m_node_capacity; i++) {
+      if (m_nodes[i].height > 0)
+        cost += m_nodes[i].bb.surfaceArea;
+    }
+    return cost / double(m_nodes[m_root].bb.surfaceArea);
+  }
+
+  //! Improve the tree with local restructuring, a few nodes per call.
+  /*! Each call visits up to budget internal nodes, carrying on from where
+      the last call stopped. The treelet below a visited node is opened
+      into its treelet_size largest subtrees and rearranged into the
+      topology with the least surface area, whenever that beats the
+      current one. This covers all rotations of children and
+      grandchildren. Entries and their node_ids are unchanged. Calling
+      this every step with a small budget undoes the slow drift in
+      quality from updates without the stall of a full rebuild().
+
+      \param budget
+          The number of internal nodes to visit.
+
+      \return
+          The number of treelets changed.
+   */
+  unsigned int optimize(unsigned int budget)
+  {
+    // Restructuring needs a grandchild.
+    if (m_leaf_count < 3)
+      return 0;
+
+    unsigned int changed = 0;
+    for (unsigned int visited = 0; visited < budget;) {
+      m_optimize_cursor = (m_optimize_cursor + 1) % m_node_capacity;
+      if (m_nodes[m_optimize_cursor].height < 1)
+        continue;
+      visited++;
+      changed += restructure(m_optimize_cursor);
+    }
+    if (changed > 0)
+      ++m_version;
+    return changed;
+  }
+
+  //! Renumber the nodes depth first and release the free ones.
+  /*! After heavy churn the live nodes are scattered over a pool that
+      never shrinks. This moves them into depth-first order, so that a
+      node's left child follows it in memory, and shrinks the pool to the
+      live nodes. The node_ids of all entries remain valid.
+   */
+  void compact()
+  {
+    ++m_version;
+    m_optimize_cursor = 0;
+
+    const unsigned int minimum = 16;
+    std::size_t page = m_nodes.page_size();
+    unsigned int capacity = std::max(m_node_count, minimum);
+    if (page)
+      capacity = (capacity + page - 1) / page * page;
+
+    // The new index of every live node, in depth-first preorder.
+    std::vector<unsigned int> index(m_node_capacity, NULL_NODE);
+    std::vector<unsigned int> order;
+    order.reserve(m_node_count);
+    if (m_root != NULL_NODE) {
+      std::vector<unsigned int> stack{m_root};
+      while (!stack.empty()) {
+        unsigned int n = stack.back();
+        stack.pop_back();
+        index[n] = order.size();
+        order.push_back(n);
+        if (!m_nodes[n].isLeaf()) {
+          stack.push_back(m_nodes[n].right);
+          stack.push_back(m_nodes[n].left);
+        }
+      }
+    }
+    assert(order.size() == m_node_count);
+
+    auto moved = [&](unsigned int n) { return n == NULL_NODE ? NULL_NODE : index[n]; };
+    decltype(m_nodes) nodes(page, m_nodes.resource());
+    nodes.resize(capacity);
+    for (unsigned int i = 0; i < order.size(); i++) {
+      auto &n = nodes[i];
+      n = m_nodes[order[i]];
+      n.parent = moved(n.parent);
+      if (!n.isLeaf()) {
+        n.left = index[n.left];
+        n.right = index[n.right];
+      }
+    }
+    m_nodes = std::move(nodes);
+    m_branches = decltype(m_branches)(page, m_branches.resource());
+    m_branches.resize(capacity);
+    for (unsigned int i = 0; i < order.size(); i++) {
+      if (!m_nodes[i].isLeaf())
+        refresh(i);
+    }
+    m_root = moved(m_root);
+
+    // The rest of the pool is free.
+    m_node_capacity = capacity;
+    m_free_list = NULL_NODE;
+    for (unsigned int i = capacity; i-- > m_node_count;) {
+      m_nodes[i].next = m_free_list;
+      m_nodes[i].height = -1;
+      m_free_list = i;
+    }
+
+    for (unsigned int i = 0; i < order.size(); i++) {
+      if (m_nodes[i].isLeaf())
+        m_handles[handle_slot(m_nodes[i].id)].node = i;
+    }
+  }
+
+  //! Compact the tree only if its pool is mostly free.
+  /*! \param occupancy
+          Compact when fewer than this fraction of the nodes are in use.
+
+      \return
+          Whether the tree was compacted.
+   */
+  bool compact_if(double occupancy)
+  {
+    if (m_node_count >= occupancy * m_node_capacity)
+      return false;
+    compact();
+    return true;
+  }
+
   /// Validate the tree.
   void validate() const
   {
@@ -829,142 +4382,534 @@ class tree {
       freeCount++;
     }
 
-    assert(get_height() == compute_height());
-    assert((m_node_count + freeCount) == m_node_capacity);
-#endif
+    assert(get_height() == compute_height());
+    assert((m_node_count + freeCount) == m_node_capacity);
+#endif
+  }
+
+  //! Rebuild an optimal tree.
+  /*! The node_ids of all entries remain valid.
+
+      \param strategy
+          The bulk construction algorithm.
+   */
+  void rebuild(build_strategy strategy) { rebuild(build_options{strategy}); }
+
+  //! Rebuild an optimal tree.
+  /*! The node_ids of all entries remain valid.
+
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  void rebuild(const build_options &options = {})
+  {
+    std::vector<unsigned int> leaves;
+    std::vector<aabb> bbs;
+    leaves.reserve(m_leaf_count);
+    bbs.reserve(m_leaf_count);
+
+    for (unsigned int i = 0; i < m_node_capacity; i++) {
+      // Free node.
+      if (m_nodes[i].height < 0)
+        continue;
+
+      if (m_nodes[i].isLeaf()) {
+        m_nodes[i].parent = NULL_NODE;
+        leaves.push_back(i);
+        bbs.push_back(m_nodes[i].bb);
+      }
+      else
+        free_node(i);
+    }
+
+    build(leaves, bbs, options);
+
+    validate();
+  }
+
+ private:
+  /// The index of the root node.
+  unsigned int m_root;
+
+  /// The dynamic tree.
+  detail::node_pool<node> m_nodes;
+
+  /// Traversal records, valid for the internal nodes of m_nodes.
+  detail::node_pool<branch> m_branches;
+
+  /// The current number of nodes in the tree.
+  unsigned int m_node_count;
+
+  unsigned int m_leaf_count = 0;
+
+  /// The current node capacity.
+  unsigned int m_node_capacity;
+
+  /// The position of node at the top of the free list.
+  unsigned int m_free_list;
+
+  /// Counts the changes to the tree structure.
+  std::uint64_t m_version = 0;
+
+  /// The node slot optimize() last visited.
+  unsigned int m_optimize_cursor = 0;
+
+  /// The periodic box, zero along non-periodic axes.
+  vec<ValTy> m_bounds = {};
+
+  /// A slot of the handle table: the leaf of an entry, or the next free
+  /// slot once the entry is removed.
+  struct handle {
+    unsigned int node = NULL_NODE;
+    std::uint32_t generation = 0;
+  };
+
+  /// The handle table, indexed by the low bits of a node_id.
+  std::vector<handle> m_handles;
+
+  /// The first free slot of the handle table.
+  unsigned int m_free_handle = NULL_NODE;
+
+  /// The last snapshot taken, and the version it was taken at.
+  std::shared_ptr<const tree> m_snapshot;
+  std::uint64_t m_snapshot_version = 0;
+
+ private:
+  //! Dual descent behind visit_self_overlaps and visit_overlaps(tree).
+  /*! \param self
+          Whether other is this tree and each pair is wanted once. A pair
+          (n, n) of an internal node with itself then stands for the pairs
+          within its subtree.
+   */
+  template <class Fn>
+  void visit_pairs(const tree &other,
+                   Fn &&fn,
+                   bool include_touch,
+                   const vec<ValTy> &bounds,
+                   bool self) const
+  {
+    const vec<ValTy> &period = effective_bounds(bounds);
+    using rt = std::invoke_result_t<Fn, node_id, node_id>;
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    if (size() == 0 || other.size() == 0)
+      return;
+
+    const auto &nodes1 = m_nodes;
+    const auto &nodes2 = other.m_nodes;
+
+    auto nodes_overlap = [&](unsigned int node1, unsigned int node2) {
+      return overlaps_any_image(nodes1[node1].bb, nodes2[node2].bb, period,
+                                include_touch);
+    };
+
+    static thread_local std::vector<std::pair<unsigned int, unsigned int>> stack(64);
+    stack.clear();
+
+    if (self) {
+      if (nodes1[m_root].isLeaf())
+        return;
+      stack.emplace_back(m_root, m_root);
+    }
+    else if (nodes_overlap(m_root, other.m_root)) {
+      stack.emplace_back(m_root, other.m_root);
+    }
+
+    while (!stack.empty()) {
+      auto [node1, node2] = stack.back();
+      stack.pop_back();
+      const auto &n1 = nodes1[node1];
+      const auto &n2 = nodes2[node2];
+
+      if (self && node1 == node2) {
+        if (!nodes1[n1.left].isLeaf())
+          stack.emplace_back(n1.left, n1.left);
+        if (!nodes1[n1.right].isLeaf())
+          stack.emplace_back(n1.right, n1.right);
+        if (nodes_overlap(n1.left, n1.right))
+          stack.emplace_back(n1.left, n1.right);
+        continue;
+      }
+
+      if (n1.isLeaf() && n2.isLeaf()) {
+        if constexpr (fn_returns_action) {
+          if (fn(to_id(node1), other.to_id(node2)) == visit_stop)
+            return;
+        }
+        else {
+          fn(to_id(node1), other.to_id(node2));
+        }
+        continue;
+      }
+
+      // Open the bigger of the two nodes.
+      if (n2.isLeaf() ||
+          (!n1.isLeaf() && n1.bb.surfaceArea >= n2.bb.surfaceArea)) {
+        for (auto child : {n1.left, n1.right})
+          if (nodes_overlap(child, node2))
+            stack.emplace_back(child, node2);
+      }
+      else {
+        for (auto child : {n2.left, n2.right})
+          if (nodes_overlap(node1, child))
+            stack.emplace_back(node1, child);
+      }
+    }
+  }
+
+  /// The subtrees handed to each thread before a parallel query starts.
+  static constexpr unsigned int parallel_tasks_per_thread = 4;
+
+  //! Adapt a callback of visit_overlaps_batch to the form visit_batch calls.
+  template <class Fn>
+  auto batch_callback(Fn &fn) const
+  {
+    constexpr bool call_with_bb =
+        std::is_invocable_v<Fn, std::size_t, node_id, const aabb &>;
+    using rt = typename std::conditional_t<
+        call_with_bb, std::invoke_result<Fn, std::size_t, node_id, const aabb &>,
+        std::invoke_result<Fn, std::size_t, node_id>>::type;
+    static_assert(std::is_convertible_v<rt, visit_action> || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    return [this, &fn](unsigned int, std::size_t query, unsigned int leaf) {
+      if constexpr (call_with_bb)
+        return fn(query, to_id(leaf), m_nodes[leaf].bb);
+      else
+        return fn(query, to_id(leaf));
+    };
+  }
+
+  //! Fill get_overlaps_batch's buffer from per-thread buffers.
+  template <class Query>
+  void collect_batch(std::span<const Query> queries,
+                     std::vector<std::pair<std::size_t, node_id>> &out,
+                     bool include_touch,
+                     const vec<ValTy> &bounds,
+                     unsigned int threads) const
+  {
+    out.clear();
+    threads = detail::thread_count(threads);
+    if (threads == 1) {
+      visit_batch(
+          queries,
+          [&](unsigned int, std::size_t q, unsigned int leaf) {
+            out.emplace_back(q, to_id(leaf));
+          },
+          include_touch, bounds, 1);
+      return;
+    }
+
+    std::vector<std::vector<std::pair<std::size_t, node_id>>> buffers(threads);
+    visit_batch(
+        queries,
+        [&](unsigned int thread, std::size_t q, unsigned int leaf) {
+          buffers[thread].emplace_back(q, to_id(leaf));
+        },
+        include_touch, bounds, threads);
+    detail::concatenate(buffers, out);
   }
 
-  /// Rebuild an optimal tree.
-  void rebuild()
+  //! Packet traversal behind visit_overlaps_batch.
+  /*! \param fn
+          Called as fn(thread, query, leaf). Each query belongs to a single
+          packet, so all calls for one query come from the same thread.
+   */
+  template <class Query, class Fn>
+  void visit_batch(std::span<const Query> queries,
+                   Fn &&fn,
+                   bool include_touch,
+                   const vec<ValTy> &bounds,
+                   unsigned int threads) const
   {
-    std::vector<unsigned int> nodeIndices(m_node_count);
-    unsigned int count = 0;
-
-    for (unsigned int i = 0; i < m_node_capacity; i++) {
-      // Free node.
-      if (m_nodes[i].height < 0)
-        continue;
+    const vec<ValTy> &period = effective_bounds(bounds);
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    using rt = std::invoke_result_t<Fn, unsigned int, std::size_t, unsigned int>;
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
 
-      if (m_nodes[i].isLeaf()) {
-        m_nodes[i].parent = NULL_NODE;
-        nodeIndices[count] = i;
-        count++;
+    if (size() == 0 || queries.empty())
+      return;
+    constexpr std::size_t max_lanes = std::numeric_limits<std::uint32_t>::max();
+    if (queries.size() > max_lanes)
+      throw std::length_error("abt: too many queries in one batch");
+    threads = detail::thread_count(threads);
+    const auto &root = m_nodes[m_root];
+
+    // Split periodic queries into the images that reach the root, as
+    // visit_overlaps does, so that nodes are tested without shifts. The
+    // images of query q are lanes[first_image(q)] up to lanes[end_image(q)];
+    // without periodic axes a query is its own only image.
+    std::vector<Query> images;
+    std::vector<unsigned int> start;
+    std::span<const Query> lanes = queries;
+    const bool periodic = period != vec<ValTy>{};
+    if (periodic) {
+      images.reserve(queries.size());
+      start.resize(queries.size() + 1);
+      for (std::size_t q = 0; q < queries.size(); q++) {
+        start[q] = images.size();
+        visit_images(queries[q], root.bb, period, [&](const Query &image, auto) {
+          images.push_back(image);
+          return false;
+        });
       }
-      else
-        free_node(i);
+      if (images.size() > max_lanes)
+        throw std::length_error("abt: too many query images in one batch");
+      start.back() = images.size();
+      lanes = images;
     }
+    auto first_image = [&](std::size_t q) -> unsigned int {
+      return periodic ? start[q] : q;
+    };
+    auto end_image = [&](std::size_t q) -> unsigned int {
+      return periodic ? start[q + 1] : q + 1;
+    };
 
-    while (count > 1) {
-      double minCost = std::numeric_limits<double>::max();
-      int iMin = -1, jMin = -1;
-
-      for (unsigned int i = 0; i < count; i++) {
-        aabb aabbi = m_nodes[nodeIndices[i]].bb;
-
-        for (unsigned int j = i + 1; j < count; j++) {
-          aabb aabbj = m_nodes[nodeIndices[j]].bb;
-          aabb aabb;
-          aabb.merge(aabbi, aabbj);
-          double cost = aabb.get_surface_area();
-
-          if (cost < minCost) {
-            iMin = i;
-            jMin = j;
-            minCost = cost;
-          }
+    // Order the queries by their first images so that each packet covers a
+    // compact region, dropping those with none.
+    std::vector<unsigned int> order;
+    order.reserve(queries.size());
+    if (queries.size() > batch_size) {
+      // Boxes without periodic images are ordered in place, anything else
+      // by the box of its first image.
+      std::vector<aabb> boxes;
+      std::vector<unsigned int> owners;
+      std::span<const aabb> keys;
+      if constexpr (!query_is_point) {
+        if (!periodic)
+          keys = queries;
+      }
+      if (keys.empty()) {
+        boxes.reserve(queries.size());
+        owners.reserve(queries.size());
+        for (std::size_t q = 0; q < queries.size(); q++) {
+          if (first_image(q) == end_image(q))
+            continue;
+          if constexpr (query_is_point)
+            boxes.emplace_back(lanes[first_image(q)], lanes[first_image(q)]);
+          else
+            boxes.push_back(lanes[first_image(q)]);
+          owners.push_back(q);
         }
+        keys = boxes;
       }
+      for (const auto &code : bulk_builder<Dim, ValTy>::morton_order(keys, threads))
+        order.push_back(owners.empty() ? code.second : owners[code.second]);
+    }
+    else {
+      for (std::size_t q = 0; q < queries.size(); q++) {
+        if (first_image(q) != end_image(q))
+          order.push_back(q);
+      }
+    }
+    if (order.empty())
+      return;
 
-      unsigned int index1 = nodeIndices[iMin];
-      unsigned int index2 = nodeIndices[jMin];
-
-      unsigned int parent = allocate_node();
-      m_nodes[parent].left = index1;
-      m_nodes[parent].right = index2;
-      m_nodes[parent].height =
-          1 + std::max(m_nodes[index1].height, m_nodes[index2].height);
-      m_nodes[parent].bb.merge(m_nodes[index1].bb, m_nodes[index2].bb);
-      m_nodes[parent].parent = NULL_NODE;
-
-      m_nodes[index1].parent = parent;
-      m_nodes[index2].parent = parent;
-
-      nodeIndices[jMin] = nodeIndices[count - 1];
-      nodeIndices[iMin] = parent;
-      count--;
+    // Fill each packet with whole queries, up to batch_size images, so that
+    // all calls for a query come from one thread. A query with more images
+    // than that has a packet of its own, walked batch_size at a time.
+    std::vector<std::size_t> packetStart = {0};
+    for (std::size_t k = 0, used = 0; k < order.size(); k++) {
+      unsigned int n = end_image(order[k]) - first_image(order[k]);
+      if (used != 0 && used + n > batch_size) {
+        packetStart.push_back(k);
+        used = 0;
+      }
+      used += n;
     }
+    packetStart.push_back(order.size());
+
+    using mask_type = std::uint32_t;
+    static_assert(batch_size <= 32);
+    std::size_t packets = packetStart.size() - 1;
+
+    detail::parallel_tasks(threads, packets, [&](std::size_t packet,
+                                                 unsigned int thread) {
+      static thread_local std::vector<std::pair<unsigned int, mask_type>> stack(64);
+      std::array<vec<ValTy>, batch_size> lowerBound, upperBound;
+      std::array<unsigned int, batch_size> laneQuery, laneImage;
+      std::array<mask_type, batch_size> sameQuery;
+
+      // The queries of a packet that overlap a node's bounds. A bound_type
+      // bound widens exactly to ValTy, so the lanes stay exact, and leaves are
+      // tested against their own bounds once reached.
+      auto hits = [&](mask_type mask, const auto &lo, const auto &hi) {
+        mask_type hit = 0;
+        for (; mask != 0; mask &= mask - 1) {
+          unsigned int l = std::countr_zero(mask);
+          unsigned int i = 0;
+          for (; i < Dim; i++) {
+            if (include_touch ? (upperBound[l][i] < ValTy(lo[i]) || lowerBound[l][i] > ValTy(hi[i]))
+                              : (upperBound[l][i] <= ValTy(lo[i]) || lowerBound[l][i] >= ValTy(hi[i])))
+              break;
+          }
+          if (i == Dim)
+            hit |= mask_type(1) << l;
+        }
+        return hit;
+      };
+
+      // Load the images of the packet's queries into the lanes, in rounds of
+      // batch_size. Only a query with more images has several rounds, which
+      // end early once it stops.
+      std::size_t k = packetStart[packet], kEnd = packetStart[packet + 1];
+      unsigned int image = first_image(order[k]);
+      mask_type alive = ~mask_type(0);
+      while (k < kEnd && alive != 0) {
+        unsigned int count = 0;
+        for (; count < batch_size && k < kEnd; count++) {
+          if constexpr (query_is_point) {
+            lowerBound[count] = upperBound[count] = lanes[image].values;
+          }
+          else {
+            lowerBound[count] = lanes[image].lowerBound.values;
+            upperBound[count] = lanes[image].upperBound.values;
+          }
+          laneQuery[count] = order[k];
+          laneImage[count] = image++;
+          if (image == end_image(order[k]) && ++k < kEnd)
+            image = first_image(order[k]);
+        }
+        // The lanes holding images of the same query as each lane.
+        for (unsigned int l = 0, run = 0; l <= count; l++) {
+          if (l == count || laneQuery[l] != laneQuery[run]) {
+            mask_type same = ((mask_type(2) << (l - 1)) - 1) & ~((mask_type(1) << run) - 1);
+            for (; run < l; run++)
+              sameQuery[run] = same;
+          }
+        }
+        alive = count == 32 ? ~mask_type(0) : (mask_type(1) << count) - 1;
+
+        auto report = [&](mask_type mask, unsigned int leaf) {
+          for (; mask != 0; mask &= mask - 1) {
+            unsigned int l = std::countr_zero(mask);
+            unsigned int q = laneQuery[l];
+            if constexpr (!exact_branches) {
+              const auto &bb = m_nodes[leaf].bb;
+              if (!(include_touch ? overlaps<true>(bb.lowerBound.values, bb.upperBound.values,
+                                                   lowerBound[l], upperBound[l])
+                                  : overlaps<false>(bb.lowerBound.values, bb.upperBound.values,
+                                                    lowerBound[l], upperBound[l])))
+                continue;
+            }
+            if (periodic && laneImage[l] != start[q] &&
+                reached_before(m_nodes[leaf].bb.lowerBound.values,
+                               m_nodes[leaf].bb.upperBound.values,
+                               lanes.subspan(start[q], laneImage[l] - start[q]),
+                               include_touch))
+              continue;
+            if constexpr (fn_returns_action) {
+              if (fn(thread, q, leaf) == visit_stop)
+                alive &= ~sameQuery[l];
+            }
+            else {
+              fn(thread, q, leaf);
+            }
+          }
+        };
 
-    m_root = nodeIndices[0];
+        mask_type mask =
+            hits(alive, root.bb.lowerBound.values, root.bb.upperBound.values);
+        if (root.isLeaf()) {
+          report(mask, m_root);
+          continue;
+        }
 
-    validate();
+        stack.clear();
+        if (mask != 0)
+          stack.emplace_back(m_root, mask);
+
+        while (!stack.empty()) {
+          auto [node, active] = stack.back();
+          stack.pop_back();
+
+          const auto &b = m_branches[node];
+          for (unsigned int c = 0; c < 2; c++) {
+            mask_type hit = hits(active & alive, b.lowerBound[c], b.upperBound[c]);
+            if (hit == 0)
+              continue;
+            if (b.child[c] & LEAF_FLAG)
+              report(hit, b.child[c] & ~LEAF_FLAG);
+            else
+              stack.emplace_back(b.child[c], hit);
+          }
+        }
+      }
+    });
   }
 
- private:
-  /// The index of the root node.
-  unsigned int m_root;
+  //! Build the internal nodes above a set of leaves.
+  /*! \param leaves
+          The indices of the leaf nodes.
 
-  /// The dynamic tree.
-  std::vector<node> m_nodes;
+      \param bbs
+          The AABBs of the leaf nodes.
 
-  /// The current number of nodes in the tree.
-  unsigned int m_node_count;
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  void build(const std::vector<unsigned int> &leaves,
+             std::span<const aabb> bbs,
+             const build_options &options)
+  {
+    ++m_version;
+    if (leaves.empty()) {
+      m_root = NULL_NODE;
+      return;
+    }
 
-  unsigned int m_leaf_count = 0;
+    auto internal = bulk_builder<Dim, ValTy>::build(bbs, options);
+    unsigned int count = leaves.size();
 
-  /// The current node capacity.
-  unsigned int m_node_capacity;
+    // Allocate up front, the node pool is stable afterwards.
+    std::vector<unsigned int> slots(internal.size());
+    for (auto &slot : slots)
+      slot = allocate_node();
 
-  /// The position of node at the top of the free list.
-  unsigned int m_free_list;
-  
- private:
-  template <class Fn>
-  static decltype(auto) call_with_args(Fn &&fn, node_id id, const aabb &bb)
-  {
-    constexpr bool call_id_bb = std::is_invocable_v<Fn, node_id, aabb>;
-    constexpr bool call_id = std::is_invocable_v<Fn, node_id>;
-    constexpr bool call_bb = std::is_invocable_v<Fn, aabb>;
-    constexpr bool call_none = std::is_invocable_v<Fn>;
+    auto to_node = [&](unsigned int ref) {
+      return ref < count ? leaves[ref] : slots[ref - count];
+    };
 
-    static_assert(call_id_bb || call_id || call_bb || call_none,
-                  "Callback has unsupported signature");
-    if constexpr (call_id_bb) {
-      return std::forward<Fn>(fn)(id, bb);
-    }
-    else if constexpr (call_id) {
-      return std::forward<Fn>(fn)(id);
-    }
-    else if constexpr (call_bb) {
-      return std::forward<Fn>(fn)(bb);
-    }
-    else {
-      return std::forward<Fn>(fn)();
-    }
+    // Every internal node owns its slot and is the only parent of its
+    // children, so the nodes can be written in any order.
+    detail::parallel_chunks(
+        detail::thread_count(options.threads), internal.size(),
+        [&](std::size_t begin, std::size_t end, unsigned int) {
+          for (auto i = begin; i < end; i++) {
+            auto &n = m_nodes[slots[i]];
+            n.bb = internal[i].bb;
+            n.height = internal[i].height;
+            n.left = to_node(internal[i].left);
+            n.right = to_node(internal[i].right);
+            m_nodes[n.left].parent = slots[i];
+            m_nodes[n.right].parent = slots[i];
+          }
+        });
+    detail::parallel_chunks(
+        detail::thread_count(options.threads), internal.size(),
+        [&](std::size_t begin, std::size_t end, unsigned int) {
+          for (auto i = begin; i < end; i++)
+            refresh(slots[i]);
+        });
+
+    m_root = internal.empty() ? leaves[0] : slots.back();
+    m_nodes[m_root].parent = NULL_NODE;
   }
+
   //! Allocate a new node.
   /*! \return
           The index of the allocated node.
    */
   unsigned int allocate_node()
   {
-    // Exand the node pool as needed.
+    // Exand the node pool as needed: double a contiguous pool, or fill up
+    // to the end of the next page of a paged one.
     if (m_free_list == NULL_NODE) {
       assert(m_node_count == m_node_capacity);
-
-      // The free list is empty. Rebuild a bigger pool.
-      m_node_capacity *= 2;
-      m_nodes.resize(m_node_capacity);
-
-      // Build a linked list for the list of free nodes.
-      for (unsigned int i = m_node_count; i < m_node_capacity - 1; i++) {
-        m_nodes[i].next = i + 1;
-        m_nodes[i].height = -1;
-      }
-      m_nodes[m_node_capacity - 1].next = NULL_NODE;
-      m_nodes[m_node_capacity - 1].height = -1;
-
-      // Assign the index of the first free node.
-      m_free_list = m_node_count;
+      std::size_t page = m_nodes.page_size();
+      grow(page ? (m_node_capacity / page + 1) * page : 2 * m_node_capacity);
     }
 
     // Peel a node off the free list.
@@ -979,6 +4924,30 @@ class tree {
     return node;
   }
 
+  //! Grow the node pool, putting the new nodes on the free list.
+  /*! \param capacity
+          The new number of nodes.
+   */
+  void grow(unsigned int capacity)
+  {
+    assert(capacity > m_node_capacity);
+    unsigned int first = m_node_capacity;
+    m_node_capacity = capacity;
+    m_nodes.resize(m_node_capacity);
+    m_branches.resize(m_node_capacity);
+
+    // Build a linked list for the list of free nodes.
+    for (unsigned int i = first; i < m_node_capacity - 1; i++) {
+      m_nodes[i].next = i + 1;
+      m_nodes[i].height = -1;
+    }
+    m_nodes[m_node_capacity - 1].next = m_free_list;
+    m_nodes[m_node_capacity - 1].height = -1;
+
+    // Assign the index of the first free node.
+    m_free_list = first;
+  }
+
   //! Free an existing node.
   /*! \param node
           The index of the node to be freed.
@@ -994,22 +4963,14 @@ class tree {
     m_node_count--;
   }
 
-  //! Insert a leaf into the tree.
-  /*! \param leaf
-          The index of the leaf node.
+  //! Find a sibling for a new leaf by descending one path from the root.
+  /*! Each step compares making a new parent here against the least cost of
+      pushing the leaf into either child, and follows the cheaper child.
    */
-  void insert_leaf(unsigned int leaf)
+  unsigned int greedy_sibling(const aabb &leafAABB) const
   {
-    ++m_leaf_count;
-    if (m_root == NULL_NODE) {
-      m_root = leaf;
-      m_nodes[m_root].parent = NULL_NODE;
-      return;
-    }
-
-    // Find the best sibling for the node.
-
-    aabb leafAABB = m_nodes[leaf].bb;
+    // Costs are summed surface areas, kept in the type the areas use.
+    using cost_type = typename aabb::cost_type;
     unsigned int index = m_root;
 
     while (!m_nodes[index].isLeaf()) {
@@ -1017,20 +4978,20 @@ class tree {
       unsigned int left = m_nodes[index].left;
       unsigned int right = m_nodes[index].right;
 
-      double surfaceArea = m_nodes[index].bb.get_surface_area();
+      cost_type surfaceArea = m_nodes[index].bb.get_surface_area();
 
       aabb combinedAABB;
       combinedAABB.merge(m_nodes[index].bb, leafAABB);
-      double combinedSurfaceArea = combinedAABB.get_surface_area();
+      cost_type combinedSurfaceArea = combinedAABB.get_surface_area();
 
       // Cost of creating a new parent for this node and the new leaf.
-      double cost = 2.0 * combinedSurfaceArea;
+      cost_type cost = 2 * combinedSurfaceArea;
 
       // Minimum cost of pushing the leaf further down the tree.
-      double inheritanceCost = 2.0 * (combinedSurfaceArea - surfaceArea);
+      cost_type inheritanceCost = 2 * (combinedSurfaceArea - surfaceArea);
 
       // Cost of descending to the left.
-      double costLeft;
+      cost_type costLeft;
       if (m_nodes[left].isLeaf()) {
         aabb aabb;
         aabb.merge(leafAABB, m_nodes[left].bb);
@@ -1039,13 +5000,13 @@ class tree {
       else {
         aabb aabb;
         aabb.merge(leafAABB, m_nodes[left].bb);
-        double oldArea = m_nodes[left].bb.get_surface_area();
-        double newArea = aabb.get_surface_area();
+        cost_type oldArea = m_nodes[left].bb.get_surface_area();
+        cost_type newArea = aabb.get_surface_area();
         costLeft = (newArea - oldArea) + inheritanceCost;
       }
 
       // Cost of descending to the right.
-      double costRight;
+      cost_type costRight;
       if (m_nodes[right].isLeaf()) {
         aabb aabb;
         aabb.merge(leafAABB, m_nodes[right].bb);
@@ -1054,8 +5015,8 @@ class tree {
       else {
         aabb aabb;
         aabb.merge(leafAABB, m_nodes[right].bb);
-        double oldArea = m_nodes[right].bb.get_surface_area();
-        double newArea = aabb.get_surface_area();
+        cost_type oldArea = m_nodes[right].bb.get_surface_area();
+        cost_type newArea = aabb.get_surface_area();
         costRight = (newArea - oldArea) + inheritanceCost;
       }
 
@@ -1070,7 +5031,81 @@ class tree {
         index = right;
     }
 
-    unsigned int sibling = index;
+    return index;
+  }
+
+  //! Find the sibling for a new leaf that adds the least surface area.
+  /*! Pairing the leaf with a node costs the area of their new parent plus
+      the area every ancestor of the node grows by, its inherited cost.
+      Nodes are expanded cheapest inherited cost first, and a subtree is
+      pruned once the leaf's own area plus the inherited cost at its root,
+      a lower bound on any sibling inside it, is no better than the best
+      sibling found so far.
+   */
+  unsigned int best_sibling(const aabb &leafAABB) const
+  {
+    using cost_type = typename aabb::cost_type;
+
+    struct candidate {
+      cost_type inherited;
+      unsigned int node;
+      bool operator<(const candidate &other) const { return inherited > other.inherited; }
+    };
+    static thread_local std::vector<candidate> heap;
+    heap.clear();
+
+    const cost_type leafArea = leafAABB.get_surface_area();
+    unsigned int best = m_root;
+    cost_type bestCost = std::numeric_limits<cost_type>::max();
+    heap.push_back({0, m_root});
+
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end());
+      candidate top = heap.back();
+      heap.pop_back();
+      if (leafArea + top.inherited >= bestCost)
+        break;
+
+      const auto &n = m_nodes[top.node];
+      aabb combined;
+      combined.merge(n.bb, leafAABB);
+      cost_type directCost = combined.get_surface_area();
+      if (directCost + top.inherited < bestCost) {
+        best = top.node;
+        bestCost = directCost + top.inherited;
+      }
+
+      // Going below this node grows it to the combined box.
+      cost_type inherited = top.inherited + directCost - n.bb.get_surface_area();
+      if (!n.isLeaf() && leafArea + inherited < bestCost) {
+        heap.push_back({inherited, n.left});
+        std::push_heap(heap.begin(), heap.end());
+        heap.push_back({inherited, n.right});
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+    return best;
+  }
+
+  //! Insert a leaf into the tree.
+  /*! \param leaf
+          The index of the leaf node.
+   */
+  void insert_leaf(unsigned int leaf)
+  {
+    ++m_version;
+    ++m_leaf_count;
+    if (m_root == NULL_NODE) {
+      m_root = leaf;
+      m_nodes[m_root].parent = NULL_NODE;
+      return;
+    }
+
+    // Find the best sibling for the node.
+    aabb leafAABB = m_nodes[leaf].bb;
+    unsigned int sibling = insertion == insert_strategy::branch_and_bound
+                               ? best_sibling(leafAABB)
+                               : greedy_sibling(leafAABB);
 
     // Create a new parent.
     unsigned int oldParent = m_nodes[sibling].parent;
@@ -1101,7 +5136,7 @@ class tree {
     }
 
     // Walk back up the tree fixing heights and AABBs.
-    index = m_nodes[leaf].parent;
+    unsigned int index = m_nodes[leaf].parent;
     while (index != NULL_NODE) {
       index = balance(index);
 
@@ -1114,17 +5149,171 @@ class tree {
       m_nodes[index].height =
           1 + std::max(m_nodes[left].height, m_nodes[right].height);
       m_nodes[index].bb.merge(m_nodes[left].bb, m_nodes[right].bb);
+      refresh(index);
 
       index = m_nodes[index].parent;
     }
   }
 
+  /// An adaptive skin grows for entries escaping within this many updates.
+  static constexpr unsigned int skin_grow_before = 4;
+
+  /// An adaptive skin shrinks for entries staying put this many updates.
+  static constexpr unsigned int skin_shrink_after = 64;
+
+  /// The range of the adaptive skin multiplier.
+  static constexpr float skin_scale_min = 0.125f, skin_scale_max = 16;
+
+  //! Fatten an AABB by the skin, stretched along an expected displacement.
+  box fatten(const aabb &bb, float scale, const vec<ValTy> *displacement = nullptr) const
+  {
+    box fat = bb;
+    for (unsigned int i = 0; i < Dim; i++) {
+      double margin = skin_width * scale;
+      if (skin == skin_mode::relative)
+        margin *= double(bb.upperBound[i] - bb.lowerBound[i]);
+      fat.lowerBound[i] -= margin;
+      fat.upperBound[i] += margin;
+
+      if (displacement && (*displacement)[i] < 0)
+        fat.lowerBound[i] += (*displacement)[i];
+      else if (displacement)
+        fat.upperBound[i] += (*displacement)[i];
+    }
+    fat.surfaceArea = fat.compute_surface_area();
+    return fat;
+  }
+
+  //! Decide whether an updated leaf needs reinserting, adapting its skin.
+  bool reskin(node &n, const aabb &bb, bool always_reinsert)
+  {
+    bool escaped = !n.bb.contains(bb);
+    if (!escaped && !always_reinsert) {
+      // No need to update if the entry is still within its fattened AABB,
+      // unless an adaptive skin is due to be tightened.
+      if (!adaptive_skin || ++n.stays < skin_shrink_after ||
+          n.skin_scale <= skin_scale_min)
+        return false;
+      n.skin_scale /= 2;
+    }
+    else if (escaped && adaptive_skin && n.stays < skin_grow_before) {
+      n.skin_scale = std::min(n.skin_scale * 2, skin_scale_max);
+    }
+    n.stays = 0;
+    return true;
+  }
+
+  //! Move a leaf if its new AABB has left the fattened one.
+  bool update_leaf(unsigned int node,
+                   const aabb &bb,
+                   const vec<ValTy> *displacement,
+                   bool always_reinsert)
+  {
+    auto &n = m_nodes[node];
+
+    assert(node < m_node_capacity);
+    assert(n.isLeaf());
+
+    if (!reskin(n, bb, always_reinsert))
+      return false;
+
+    // Remove the current leaf.
+    remove_leaf(node);
+
+    // Assign the new AABB.
+    n.bb = fatten(bb, n.skin_scale, displacement);
+
+    // Insert a new leaf node.
+    insert_leaf(node);
+
+    return true;
+  }
+
+  //! Unlink a leaf, leaving its ancestors to a later refit().
+  /*! \param leaf
+          The index of the leaf node.
+
+      \param dirty
+          Receives the node whose child changed.
+   */
+  void detach_leaf(unsigned int leaf, std::vector<unsigned int> &dirty)
+  {
+    ++m_version;
+    --m_leaf_count;
+    if (leaf == m_root) {
+      m_root = NULL_NODE;
+      return;
+    }
+
+    unsigned int parent = m_nodes[leaf].parent;
+    unsigned int grandParent = m_nodes[parent].parent;
+    unsigned int sibling =
+        m_nodes[parent].left == leaf ? m_nodes[parent].right : m_nodes[parent].left;
+
+    if (grandParent != NULL_NODE) {
+      if (m_nodes[grandParent].left == parent)
+        m_nodes[grandParent].left = sibling;
+      else
+        m_nodes[grandParent].right = sibling;
+      dirty.push_back(grandParent);
+    }
+    else {
+      m_root = sibling;
+    }
+    m_nodes[sibling].parent = grandParent;
+    free_node(parent);
+  }
+
+  //! Refit and rebalance the ancestors of changed nodes, deepest first.
+  /*! \param dirty
+          Internal nodes whose children changed; freed ones are skipped.
+   */
+  void refit(const std::vector<unsigned int> &dirty)
+  {
+    std::vector<std::pair<unsigned int, unsigned int>> heap;
+    std::vector<bool> queued(m_node_capacity);
+    for (auto node : dirty) {
+      if (m_nodes[node].height < 0 || queued[node])
+        continue;
+      unsigned int depth = 0;
+      for (auto n = node; m_nodes[n].parent != NULL_NODE; n = m_nodes[n].parent)
+        depth++;
+      queued[node] = true;
+      heap.emplace_back(depth, node);
+    }
+    std::make_heap(heap.begin(), heap.end());
+
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end());
+      auto [depth, node] = heap.back();
+      heap.pop_back();
+
+      unsigned int index = balance(node);
+      auto &n = m_nodes[index];
+      auto old = n.bb;
+      int oldHeight = n.height;
+      n.bb.merge(m_nodes[n.left].bb, m_nodes[n.right].bb);
+      n.height = 1 + std::max(m_nodes[n.left].height, m_nodes[n.right].height);
+      refresh(index);
+
+      // The parent only needs a refit if something it stores changed.
+      unsigned int parent = n.parent;
+      if (parent == NULL_NODE || queued[parent] ||
+          (index == node && n.height == oldHeight && n.bb == old))
+        continue;
+      queued[parent] = true;
+      heap.emplace_back(depth - 1, parent);
+      std::push_heap(heap.begin(), heap.end());
+    }
+  }
+
   //! Remove a leaf from the tree.
   /*! \param leaf
           The index of the leaf node.
    */
   void remove_leaf(unsigned int leaf)
   {
+    ++m_version;
     --m_leaf_count;
     if (leaf == m_root) {
       m_root = NULL_NODE;
@@ -1161,6 +5350,7 @@ class tree {
         m_nodes[index].bb.merge(m_nodes[left].bb, m_nodes[right].bb);
         m_nodes[index].height =
             1 + std::max(m_nodes[left].height, m_nodes[right].height);
+        refresh(index);
 
         index = m_nodes[index].parent;
       }
@@ -1172,6 +5362,139 @@ class tree {
     }
   }
 
+  /// The reference to a node held by its parent's branch.
+  unsigned int child_ref(unsigned int node) const
+  {
+    return m_nodes[node].isLeaf() ? node | LEAF_FLAG : node;
+  }
+
+  //! Copy the children of an internal node into its traversal record.
+  /*! \param node
+          The index of the internal node.
+   */
+  void refresh(unsigned int node)
+  {
+    const auto &n = m_nodes[node];
+    auto &b = m_branches[node];
+    const unsigned int children[2] = {n.left, n.right};
+
+    for (unsigned int c = 0; c < 2; c++) {
+      const auto &bb = m_nodes[children[c]].bb;
+      for (unsigned int i = 0; i < Dim; i++) {
+        b.lowerBound[c][i] = round_down(bb.lowerBound[i]);
+        b.upperBound[c][i] = round_up(bb.upperBound[i]);
+      }
+      b.child[c] = child_ref(children[c]);
+    }
+  }
+
+  /// The number of subtrees a treelet is opened into by restructure().
+  static constexpr unsigned int treelet_size = 5;
+
+  //! Rearrange the treelet below a node into its best topology.
+  /*! The node stays the treelet root, so nothing above it changes but
+      the heights.
+
+      \return
+          Whether the treelet was changed.
+   */
+  bool restructure(unsigned int node)
+  {
+    std::array<unsigned int, treelet_size> leaves = {m_nodes[node].left,
+                                                     m_nodes[node].right};
+    std::array<unsigned int, treelet_size - 1> internal = {node};
+    unsigned int count = 2, internalCount = 1;
+
+    // Open the largest subtrees first, as they matter most.
+    while (count < treelet_size) {
+      unsigned int best = treelet_size;
+      for (unsigned int i = 0; i < count; i++) {
+        if (!m_nodes[leaves[i]].isLeaf() &&
+            (best == treelet_size ||
+             m_nodes[leaves[i]].bb.surfaceArea > m_nodes[leaves[best]].bb.surfaceArea))
+          best = i;
+      }
+      if (best == treelet_size)
+        break;
+      unsigned int opened = leaves[best];
+      internal[internalCount++] = opened;
+      leaves[best] = m_nodes[opened].left;
+      leaves[count++] = m_nodes[opened].right;
+    }
+    if (count < 3)
+      return false;
+
+    // Optimal cost of every subset of the treelet leaves.
+    constexpr unsigned int subsets = 1u << treelet_size;
+    std::array<double, subsets> area, cost;
+    std::array<unsigned int, subsets> split;
+    const unsigned int full = (1u << count) - 1;
+    for (unsigned int set = 1; set <= full; set++) {
+      aabb bb = m_nodes[leaves[std::countr_zero(set)]].bb;
+      for (unsigned int rest = set & (set - 1); rest != 0; rest &= rest - 1)
+        bb.merge(bb, m_nodes[leaves[std::countr_zero(rest)]].bb);
+      area[set] = bb.surfaceArea;
+
+      cost[set] = 0;
+      if ((set & (set - 1)) == 0)
+        continue;
+      cost[set] = std::numeric_limits<double>::max();
+      // Partitions containing the lowest leaf, so each is tried once.
+      unsigned int low = set & -set;
+      for (unsigned int part = (set - 1) & set; part != 0; part = (part - 1) & set) {
+        if (!(part & low))
+          continue;
+        double c = cost[part] + cost[set ^ part];
+        if (c < cost[set]) {
+          cost[set] = c;
+          split[set] = part;
+        }
+      }
+      cost[set] += area[set];
+    }
+
+    double oldCost = 0;
+    for (unsigned int i = 0; i < internalCount; i++)
+      oldCost += m_nodes[internal[i]].bb.surfaceArea;
+    if (!(cost[full] < oldCost * (1 - 1e-9)))
+      return false;
+
+    // Rebuild top-down, reusing the internal nodes with node as the root.
+    unsigned int nextInternal = 0;
+    auto assemble = [&](auto &self, unsigned int set) -> unsigned int {
+      if ((set & (set - 1)) == 0)
+        return leaves[std::countr_zero(set)];
+      unsigned int index = internal[nextInternal++];
+      unsigned int left = self(self, split[set]);
+      unsigned int right = self(self, set ^ split[set]);
+      auto &n = m_nodes[index];
+      n.left = left;
+      n.right = right;
+      m_nodes[left].parent = index;
+      m_nodes[right].parent = index;
+      n.bb.merge(m_nodes[left].bb, m_nodes[right].bb);
+      n.height = 1 + std::max(m_nodes[left].height, m_nodes[right].height);
+      refresh(index);
+      return index;
+    };
+    assemble(assemble, full);
+    propagate_height(node);
+    return true;
+  }
+
+  //! Refresh the heights above a node whose height may have changed.
+  void propagate_height(unsigned int node)
+  {
+    for (auto index = m_nodes[node].parent; index != NULL_NODE;
+         index = m_nodes[index].parent) {
+      auto &n = m_nodes[index];
+      int height = 1 + std::max(m_nodes[n.left].height, m_nodes[n.right].height);
+      if (height == n.height)
+        break;
+      n.height = height;
+    }
+  }
+
   //! Balance the tree.
   /*! \param leaf
           The index of the node.
@@ -1242,6 +5565,8 @@ class tree {
             1 + std::max(m_nodes[node].height, m_nodes[rightRight].height);
       }
 
+      // The caller refits the new subtree root.
+      refresh(node);
       return right;
     }
 
@@ -1296,6 +5621,7 @@ class tree {
             1 + std::max(m_nodes[node].height, m_nodes[leftRight].height);
       }
 
+      refresh(node);
       return left;
     }
 
@@ -1306,7 +5632,12 @@ class tree {
   /*! \return
           The height of the entire tree.
    */
-  unsigned int compute_height() const { return compute_height(m_root); }
+  unsigned int compute_height() const
+  {
+    if (m_root == NULL_NODE)
+      return 0;
+    return compute_height(m_root);
+  }
 
   //! Compute the height of a sub-tree.
   /*! \param node
@@ -1396,6 +5727,18 @@ class tree {
       assert(aabb.upperBound[i] == m_nodes[node].bb.upperBound[i]);
     }
 
+    // The traversal record must mirror the children.
+    const auto &b = m_branches[node];
+    (void)b;  // Unused variable in Release build
+    assert(b.child[0] == child_ref(left));
+    assert(b.child[1] == child_ref(right));
+    for (unsigned int i = 0; i < Dim; i++) {
+      assert(b.lowerBound[0][i] == round_down(m_nodes[left].bb.lowerBound[i]));
+      assert(b.upperBound[0][i] == round_up(m_nodes[left].bb.upperBound[i]));
+      assert(b.lowerBound[1][i] == round_down(m_nodes[right].bb.lowerBound[i]));
+      assert(b.upperBound[1][i] == round_up(m_nodes[right].bb.upperBound[i]));
+    }
+
     validate_metrics(left);
     validate_metrics(right);
   }
@@ -0,0 +1,161 @@
+#ifndef _ABT_DEVICE_TREE_H
+#define _ABT_DEVICE_TREE_H
+
+#include <abt/aabb_tree.hpp>
+
+namespace abt {
+
+/// Where a device_tree keeps its nodes and runs its queries.
+enum class backend : char {
+  /// Threads on the host.
+  cpu
+};
+
+/// Test whether a backend can run in this build and on this machine.
+inline bool backend_available(backend where)
+{
+  return where == backend::cpu;
+}
+
+/// The backend to use when none is asked for.
+inline backend default_backend()
+{
+  return backend::cpu;
+}
+
+/*! \brief A bulk built tree whose batched queries run on a chosen backend.
+
+    The backend is picked at runtime, and batched results come back as
+    compact (query, id) lists whichever one runs them. The cpu backend is
+    the packet traversal of tree::get_overlaps_batch, with the packets
+    shared out among host threads; it is the only backend so far.
+ */
+template <unsigned Dim, typename ValTy = double>
+class device_tree {
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using node_id = typename tree_type::node_id;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  //! Constructor.
+  /*! \param bbs
+          The AABBs of the entries. Entry i is given node_id i.
+
+      \param where
+          The backend the batched queries run on.
+
+      \param options
+          The bulk construction algorithm and the number of host threads.
+
+      Throws std::runtime_error if the backend is not available.
+   */
+  explicit device_tree(std::span<const aabb> bbs,
+                       backend where = default_backend(),
+                       const build_options &options = {build_strategy::lbvh, 0})
+      : device_tree(vec<ValTy>{}, bbs, where, options)
+  {
+  }
+
+  //! Constructor.
+  /*! \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  device_tree(const vec<ValTy> &periodic_bounds,
+              std::span<const aabb> bbs,
+              backend where = default_backend(),
+              const build_options &options = {build_strategy::lbvh, 0})
+      : m_tree(periodic_bounds, bbs, options), m_backend(where)
+  {
+    if (!backend_available(where))
+      throw std::runtime_error("abt: backend not available");
+  }
+
+  /// Return the number of entries in the tree.
+  unsigned int size() const { return m_tree.size(); }
+
+  /// The backend the batched queries run on.
+  backend where() const { return m_backend; }
+
+  /// The tree on the host, for single queries.
+  const tree_type &host() const { return m_tree; }
+
+  //! Collect the overlaps of many queries as (query, id) pairs.
+  /*! \param out
+          Cleared, then filled in no particular order; its capacity is
+          reused.
+
+      \param bounds
+          The periodic box, zero along non-periodic axes, or zero to use
+          the periodic box given at construction.
+
+      \param threads
+          The number of host threads of the cpu backend, 0 for one per core.
+
+      Throws std::length_error for a batch of 2^32 queries or more, as
+      tree::get_overlaps_batch does.
+   */
+  void get_overlaps_batch(std::span<const aabb> queries,
+                          std::vector<std::pair<std::size_t, node_id>> &out,
+                          bool include_touch = true,
+                          const vec<ValTy> &bounds = {},
+                          unsigned int threads = 0) const
+  {
+    m_tree.get_overlaps_batch(queries, out, include_touch, bounds, threads);
+  }
+
+  void get_overlaps_batch(std::span<const point> queries,
+                          std::vector<std::pair<std::size_t, node_id>> &out,
+                          bool include_touch = true,
+                          const vec<ValTy> &bounds = {},
+                          unsigned int threads = 0) const
+  {
+    m_tree.get_overlaps_batch(queries, out, include_touch, bounds, threads);
+  }
+
+  //! Collect every pair of overlapping entries, the smaller id first.
+  /*! The entries are queried against the tree as one batch.
+   */
+  void get_overlapping_pairs(std::vector<std::pair<node_id, node_id>> &out,
+                             bool include_touch = true,
+                             unsigned int threads = 0) const
+  {
+    std::vector<aabb> boxes(size());
+    m_tree.for_each(
+        [&](node_id id, const aabb &bb) { boxes[std::size_t(id)] = bb; });
+
+    std::vector<std::pair<std::size_t, node_id>> hits;
+    get_overlaps_batch(boxes, hits, include_touch, {}, threads);
+    out.clear();
+    for (const auto &[query, id] : hits) {
+      if (query < std::size_t(id))
+        out.emplace_back(node_id(query), id);
+    }
+  }
+
+ private:
+  /// The hierarchy the backends walk.
+  tree_type m_tree;
+
+  /// The backend the batched queries run on.
+  backend m_backend;
+};
+
+#define TYPEDEFS(suffix, dim, type) \
+  using device_tree##suffix = device_tree<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_DEVICE_TREE_H */
@@ -0,0 +1,487 @@
+#ifndef _ABT_FOREST_H
+#define _ABT_FOREST_H
+
+#include <abt/aabb_tree.hpp>
+
+namespace abt {
+
+/*! \brief Bounds of the entries owned by one domain of a forest.
+
+    Fixed-width and trivially copyable, so that summaries can be sent
+    between ranks as raw bytes and remote domains filtered before any
+    query is communicated.
+ */
+template <unsigned Dim, typename ValTy = double>
+struct domain_summary {
+  /// The domain index.
+  std::uint32_t domain;
+
+  /// The number of entries the domain owns, 0 leaves the bounds unset.
+  std::uint32_t count;
+
+  /// The bounds enclosing the owned entries.
+  std::array<ValTy, Dim> lowerBound;
+  std::array<ValTy, Dim> upperBound;
+
+  //! Test whether a query box may overlap an entry of the domain.
+  /*! \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  bool may_overlap(const aabb<Dim, ValTy> &bb,
+                   const std::array<ValTy, Dim> &periodic_bounds = {}) const
+  {
+    if (count == 0)
+      return false;
+    for (unsigned int d = 0; d < Dim; d++) {
+      bool hit = false;
+      int k = periodic_bounds[d] != 0 ? 1 : 0;
+      for (int s = -k; !hit && s <= k; s++) {
+        double shift = s * double(periodic_bounds[d]);
+        hit = !(bb.upperBound[d] + shift < lowerBound[d] ||
+                bb.lowerBound[d] + shift > upperBound[d]);
+      }
+      if (!hit)
+        return false;
+    }
+    return true;
+  }
+};
+
+/*! \brief A set of trees, one per domain of a regular decomposition.
+
+    The box is cut into a grid of domains. Each entry is owned by the
+    domain holding its centre, and is also kept as a ghost by every other
+    domain it comes within halo_width of, so that each domain can answer
+    queries near its faces on its own. The layer does no communication
+    itself: it keeps the per-domain trees, ghosts and migrations that a
+    rank-per-domain code exchanges, and compact domain_summary records to
+    filter remote domains with.
+
+    An update whose entry's centre leaves its domain only marks it to be
+    moved; migrate() then moves all marked entries in one batch and
+    reports the moves.
+ */
+template <unsigned Dim, typename ValTy = double>
+class forest {
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy, unsigned int>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using summary = domain_summary<Dim, ValTy>;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  /// A handle to an entry, the same in every domain.
+  enum class node_id : std::uint32_t {};
+
+  /// A change of owner made by migrate().
+  struct migration {
+    node_id id;
+    unsigned int from;
+    unsigned int to;
+  };
+
+  //! Constructor.
+  /*! \param box
+          The simulation box.
+
+      \param divisions
+          The number of domains along each axis.
+
+      \param halo_width
+          The distance from a domain within which entries are ghosted.
+
+      \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  forest(const aabb &box,
+         const vec<unsigned int> &divisions,
+         ValTy halo_width,
+         const vec<ValTy> &periodic_bounds = {})
+      : m_box(box), m_divisions(divisions), m_halo(halo_width), m_bounds(periodic_bounds)
+  {
+    unsigned int count = 1;
+    for (unsigned int d = 0; d < Dim; d++) {
+      assert(divisions[d] > 0);
+      count *= divisions[d];
+      m_width[d] = (double(box.upperBound[d]) - double(box.lowerBound[d])) / divisions[d];
+    }
+    m_domains.reserve(count);
+    for (unsigned int i = 0; i < count; i++)
+      m_domains.push_back({tree_type(periodic_bounds), tree_type(periodic_bounds)});
+  }
+
+  /// Return the number of entries, each counted once.
+  unsigned int size() const { return m_size; }
+
+  /// The number of domains.
+  unsigned int domain_count() const { return m_domains.size(); }
+
+  /// The entries a domain owns, with their forest index as payload.
+  const tree_type &owned(unsigned int domain) const { return m_domains[domain].owned; }
+
+  /// The ghosts a domain holds of its neighbours' entries.
+  const tree_type &ghosts(unsigned int domain) const { return m_domains[domain].ghosts; }
+
+  /// The domain owning an entry.
+  unsigned int owner(node_id id) const { return m_entries[to_index(id)].domain; }
+
+  //! The domain whose region holds a point, wrapped along periodic axes.
+  unsigned int domain_of(const point &pt) const
+  {
+    unsigned int domain = 0, stride = 1;
+    for (unsigned int d = 0; d < Dim; d++) {
+      double x = pt[d];
+      if (m_bounds[d] != 0)
+        x -= std::floor((x - m_box.lowerBound[d]) / m_bounds[d]) * m_bounds[d];
+      long c = std::floor((x - m_box.lowerBound[d]) / m_width[d]);
+      c = std::clamp<long>(c, 0, m_divisions[d] - 1);
+      domain += c * stride;
+      stride *= m_divisions[d];
+    }
+    return domain;
+  }
+
+  //! The region of a domain.
+  aabb domain_bounds(unsigned int domain) const
+  {
+    point lower, upper;
+    for (unsigned int d = 0; d < Dim; d++) {
+      unsigned int c = domain % m_divisions[d];
+      domain /= m_divisions[d];
+      lower[d] = m_box.lowerBound[d] + c * m_width[d];
+      upper[d] = m_box.lowerBound[d] + (c + 1) * m_width[d];
+    }
+    return {lower, upper};
+  }
+
+  //! Insert an entry into the domain holding its centre.
+  /*! \return
+          The handle of the new entry.
+   */
+  node_id insert(const aabb &bb)
+  {
+    unsigned int index;
+    if (m_freeEntry != NULL_ENTRY) {
+      index = m_freeEntry;
+      m_freeEntry = m_entries[index].domain;
+    }
+    else {
+      index = m_entries.size();
+      m_entries.emplace_back();
+    }
+    auto &e = m_entries[index];
+    e.bb = bb;
+    e.used = true;
+    e.pending = false;
+    e.domain = domain_of(bb.centre);
+    e.id = m_domains[e.domain].owned.insert(bb, index);
+    refresh_ghosts(index);
+    m_size++;
+    return node_id(index);
+  }
+
+  /// Remove an entry, and its ghosts.
+  void remove(node_id id)
+  {
+    unsigned int index = to_index(id);
+    auto &e = m_entries[index];
+    m_domains[e.domain].owned.remove(e.id);
+    for (auto [domain, ghost] : e.ghosts)
+      m_domains[domain].ghosts.remove(ghost);
+    e.ghosts.clear();
+    e.used = false;
+    e.domain = m_freeEntry;
+    m_freeEntry = index;
+    m_size--;
+  }
+
+  //! Move an entry within its domain, marking it if it leaves.
+  /*! The entry stays with its owner until migrate(), but its ghosts are
+      kept up to date straight away.
+   */
+  void update(node_id id, const aabb &bb)
+  {
+    unsigned int index = to_index(id);
+    auto &e = m_entries[index];
+    e.bb = bb;
+    m_domains[e.domain].owned.update(e.id, bb);
+    refresh_ghosts(index);
+    if (!e.pending && domain_of(bb.centre) != e.domain) {
+      e.pending = true;
+      m_pending.push_back(index);
+    }
+  }
+
+  /// The number of entries marked to move to another domain.
+  unsigned int pending() const { return m_pending.size(); }
+
+  //! Hand every marked entry to the domain now holding its centre.
+  /*! \return
+          The moves, in the order the entries were marked.
+   */
+  std::vector<migration> migrate()
+  {
+    std::vector<migration> moves;
+    for (unsigned int index : m_pending) {
+      auto &e = m_entries[index];
+      if (!e.used || !e.pending)
+        continue;
+      e.pending = false;
+      unsigned int to = domain_of(e.bb.centre);
+      if (to == e.domain)
+        continue;
+      moves.push_back({node_id(index), e.domain, to});
+      m_domains[e.domain].owned.remove(e.id);
+      e.domain = to;
+      e.id = m_domains[to].owned.insert(e.bb, index);
+      refresh_ghosts(index);
+    }
+    m_pending.clear();
+    return moves;
+  }
+
+  //! The bounds of the entries each domain owns.
+  std::vector<summary> summaries() const
+  {
+    std::vector<summary> out;
+    out.reserve(m_domains.size());
+    for (unsigned int i = 0; i < m_domains.size(); i++) {
+      const auto &t = m_domains[i].owned;
+      summary s = {i, t.size(), {}, {}};
+      if (t.size() != 0) {
+        s.lowerBound = t.get_root_aabb().lowerBound.values;
+        s.upperBound = t.get_root_aabb().upperBound.values;
+      }
+      out.push_back(s);
+    }
+    return out;
+  }
+
+  /// Get the AABB of an entry.
+  const aabb &get_aabb(node_id id) const { return m_entries[to_index(id)].bb; }
+
+  /// Test whether a handle refers to an entry of the forest.
+  bool contains(node_id id) const
+  {
+    auto index = std::uint32_t(id);
+    return index < m_entries.size() && m_entries[index].used;
+  }
+
+  //! Visit the entries overlapping a query in every domain, each once.
+  /*! Only owned entries are reported, so ghosts are never doubled up.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query, Fn &&fn, bool include_touch = true) const
+  {
+    for (unsigned int i = 0; i < m_domains.size(); i++) {
+      if (visit_tree(m_domains[i].owned, query, fn, include_touch))
+        return;
+    }
+  }
+
+  //! Visit the entries overlapping a query that one domain knows about.
+  /*! These are the domain's own entries and its ghosts, which is every
+      entry near a query that stays within halo_width of the domain.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps(unsigned int domain, const Query &query, Fn &&fn,
+                      bool include_touch = true) const
+  {
+    if (!visit_tree(m_domains[domain].owned, query, fn, include_touch))
+      visit_tree(m_domains[domain].ghosts, query, fn, include_touch);
+  }
+
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query, bool include_touch = true) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch);
+    return overlaps;
+  }
+
+ private:
+  static constexpr unsigned int NULL_ENTRY = 0xffffffff;
+
+  struct domain {
+    tree_type owned;
+    tree_type ghosts;
+  };
+
+  struct entry {
+    /// The AABB as last inserted or updated.
+    aabb bb;
+
+    /// The owning domain, or the next free entry once removed.
+    unsigned int domain = 0;
+
+    /// The entry's handle in its owner's tree.
+    typename tree_type::node_id id = {};
+
+    /// The domains holding a ghost of the entry, and the ghosts' handles.
+    std::vector<std::pair<unsigned int, typename tree_type::node_id>> ghosts;
+
+    bool used = false;
+
+    /// Whether the entry is waiting to migrate.
+    bool pending = false;
+  };
+
+  unsigned int to_index(node_id id) const
+  {
+    assert(contains(id) && "stale or invalid node_id");
+    return std::uint32_t(id);
+  }
+
+  //! Run a query over one tree, reporting whether the callback stopped it.
+  template <class Query, class Fn>
+  bool visit_tree(const tree_type &t, const Query &query, Fn &fn, bool include_touch) const
+  {
+    using rt = decltype(detail::call_with_args(fn, node_id{}, aabb{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    bool stopped = false;
+    t.visit_overlaps(
+        query,
+        [&](typename tree_type::node_id, const aabb &, unsigned int index) {
+          const auto &bb = m_entries[index].bb;
+          if constexpr (fn_returns_action) {
+            stopped = detail::call_with_args(fn, node_id(index), bb) == visit_stop;
+            return stopped ? visit_stop : visit_continue;
+          }
+          else {
+            detail::call_with_args(fn, node_id(index), bb);
+            return visit_continue;
+          }
+        },
+        include_touch);
+    return stopped;
+  }
+
+  //! Test whether an entry reaches within the halo of a domain.
+  bool in_halo(const aabb &bb, unsigned int domain) const
+  {
+    aabb region = domain_bounds(domain);
+    for (unsigned int d = 0; d < Dim; d++) {
+      region.lowerBound[d] -= m_halo;
+      region.upperBound[d] += m_halo;
+    }
+    summary s = {domain, 1, region.lowerBound.values, region.upperBound.values};
+    return s.may_overlap(bb, m_bounds);
+  }
+
+  //! Bring an entry's ghosts in line with where it now is.
+  void refresh_ghosts(unsigned int index)
+  {
+    auto &e = m_entries[index];
+    std::vector<std::pair<unsigned int, typename tree_type::node_id>> kept;
+    for (auto [domain, ghost] : e.ghosts) {
+      if (domain != e.domain && in_halo(e.bb, domain)) {
+        m_domains[domain].ghosts.update(ghost, e.bb);
+        kept.emplace_back(domain, ghost);
+      }
+      else {
+        m_domains[domain].ghosts.remove(ghost);
+      }
+    }
+    e.ghosts = std::move(kept);
+
+    for (unsigned int domain : neighbours(e.domain)) {
+      bool held = std::any_of(e.ghosts.begin(), e.ghosts.end(),
+                              [domain](const auto &g) { return g.first == domain; });
+      if (!held && in_halo(e.bb, domain))
+        e.ghosts.emplace_back(domain, m_domains[domain].ghosts.insert(e.bb, index));
+    }
+  }
+
+  //! The domains sharing a face, edge or corner with one, itself excluded.
+  /*! Entries are assumed smaller than a domain, so only these can need a
+      ghost. Along periodic axes the neighbours wrap.
+   */
+  std::vector<unsigned int> neighbours(unsigned int domain) const
+  {
+    std::array<long, Dim> c;
+    for (unsigned int d = 0, rest = domain; d < Dim; d++) {
+      c[d] = rest % m_divisions[d];
+      rest /= m_divisions[d];
+    }
+
+    std::vector<unsigned int> out;
+    std::array<int, Dim> offset;
+    offset.fill(-1);
+    while (true) {
+      unsigned int neighbour = 0, stride = 1;
+      bool valid = true;
+      for (unsigned int d = 0; d < Dim && valid; d++) {
+        long n = c[d] + offset[d];
+        if (n < 0 || n >= long(m_divisions[d])) {
+          if (m_bounds[d] == 0)
+            valid = false;
+          n = (n + m_divisions[d]) % m_divisions[d];
+        }
+        neighbour += n * stride;
+        stride *= m_divisions[d];
+      }
+      if (valid && neighbour != domain &&
+          std::find(out.begin(), out.end(), neighbour) == out.end())
+        out.push_back(neighbour);
+
+      unsigned int d = 0;
+      for (; d < Dim && offset[d] == 1; d++)
+        offset[d] = -1;
+      if (d == Dim)
+        return out;
+      offset[d]++;
+    }
+  }
+
+  /// The simulation box.
+  aabb m_box;
+
+  /// The number of domains along each axis.
+  vec<unsigned int> m_divisions;
+
+  /// The width of each domain along each axis.
+  vec<double> m_width;
+
+  /// The distance from a domain within which entries are ghosted.
+  ValTy m_halo;
+
+  /// The periodic box, zero along non-periodic axes.
+  vec<ValTy> m_bounds;
+
+  /// The domains, the first axis varying fastest.
+  std::vector<domain> m_domains;
+
+  /// Every entry, by handle.
+  std::vector<entry> m_entries;
+
+  /// The entries marked to migrate.
+  std::vector<unsigned int> m_pending;
+
+  /// The first removed entry, free for reuse.
+  unsigned int m_freeEntry = NULL_ENTRY;
+
+  /// The number of entries.
+  unsigned int m_size = 0;
+};
+
+#define TYPEDEFS(suffix, dim, type) \
+  using forest##suffix = forest<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_FOREST_H */
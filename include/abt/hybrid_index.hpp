@@ -0,0 +1,520 @@
+#ifndef _ABT_HYBRID_INDEX_H
+#define _ABT_HYBRID_INDEX_H
+
+#include <abt/aabb_tree.hpp>
+
+namespace abt {
+
+/*! \brief A broad phase splitting entries between a cell grid and a tree.
+
+    Entries no wider than the cell size along any axis go to a hashed
+    uniform grid, keyed by the cell holding their lower corner, where
+    inserting, moving and querying a dense region of similar sizes costs a
+    few hash lookups. Wider entries, and outliers in sparse or polydisperse
+    regions, go to a tree. Queries search both and report through one
+    callback, with the ids this index hands out.
+
+    Along periodic axes the grid wraps, with as many cells as fit in the
+    periodic box, so its cells may be a little wider than the cell size.
+ */
+template <unsigned Dim, typename ValTy = double>
+class hybrid_index {
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy, unsigned int>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  /// A handle to an entry of the index.
+  enum class node_id : std::uint32_t {};
+
+  /// The fraction of entries the automatic cell size keeps in the grid.
+  static constexpr double grid_fraction = 0.9;
+
+  //! Constructor.
+  /*! \param cell_size
+          The largest extent an entry may have to go in the grid.
+
+      \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  explicit hybrid_index(double cell_size, const vec<ValTy> &periodic_bounds = {})
+      : m_tree(periodic_bounds), m_cellSize(cell_size), m_bounds(periodic_bounds)
+  {
+    assert(cell_size > 0);
+    for (unsigned int d = 0; d < Dim; d++) {
+      m_cellWidth[d] = cell_size;
+      if (m_bounds[d] != 0) {
+        m_cellCount[d] = std::max(1.0, std::floor(m_bounds[d] / cell_size));
+        m_cellWidth[d] = m_bounds[d] / m_cellCount[d];
+      }
+    }
+  }
+
+  //! Constructor.
+  /*! The cell size is picked so that grid_fraction of the entries fit in
+      the grid, and the rest go to the tree. Entries are inserted in order,
+      so entry i gets node_id(i).
+
+      \param bbs
+          The AABBs of the entries.
+
+      \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+   */
+  explicit hybrid_index(std::span<const aabb> bbs, const vec<ValTy> &periodic_bounds = {})
+      : hybrid_index(pick_cell_size(bbs), periodic_bounds)
+  {
+    m_entries.reserve(bbs.size());
+    for (const auto &bb : bbs)
+      insert(bb);
+  }
+
+  /// Return the number of entries in the index.
+  unsigned int size() const { return m_size; }
+
+  /// The number of entries held by the grid and by the tree.
+  unsigned int grid_size() const { return m_size - m_tree.size(); }
+  unsigned int tree_size() const { return m_tree.size(); }
+
+  /// The largest extent of an entry that goes in the grid.
+  double cell_size() const { return m_cellSize; }
+
+  /// The periodic box given at construction, zero along non-periodic axes.
+  const vec<ValTy> &periodic_bounds() const { return m_bounds; }
+
+  //! Insert an entry.
+  /*! \return
+          The handle of the new entry.
+   */
+  node_id insert(const aabb &bb)
+  {
+    unsigned int index;
+    if (m_freeEntry != NULL_ENTRY) {
+      index = m_freeEntry;
+      m_freeEntry = m_entries[index].slot;
+    }
+    else {
+      index = m_entries.size();
+      m_entries.emplace_back();
+    }
+    place(index, bb);
+    m_size++;
+    return node_id(index);
+  }
+
+  /// Remove an entry.
+  void remove(node_id id)
+  {
+    unsigned int index = to_index(id);
+    unplace(index);
+    m_entries[index].used = false;
+    m_entries[index].slot = m_freeEntry;
+    m_freeEntry = index;
+    m_size--;
+  }
+
+  //! Move an entry, between the grid and the tree if its size demands.
+  /*! \return
+          Whether the entry moved to another cell, or was reinserted.
+   */
+  bool update(node_id id, const aabb &bb)
+  {
+    unsigned int index = to_index(id);
+    auto &e = m_entries[index];
+    if (e.in_tree && !fits_grid(bb)) {
+      e.bb = bb;
+      return m_tree.update(e.tree_id, bb);
+    }
+    if (!e.in_tree && fits_grid(bb) && cell_key(bb) == e.cell) {
+      e.bb = bb;
+      return false;
+    }
+    unplace(index);
+    place(index, bb);
+    return true;
+  }
+
+  /// Test whether a handle refers to an entry of the index.
+  bool contains(node_id id) const
+  {
+    auto index = std::uint32_t(id);
+    return index < m_entries.size() && m_entries[index].used;
+  }
+
+  /// Get the AABB of an entry, as inserted.
+  const aabb &get_aabb(node_id id) const { return m_entries[to_index(id)].bb; }
+
+  //! Query the index to find candidate interactions for an AABB.
+  /*! \param query
+          The AABB or point.
+
+      \param include_touch
+          Does touching constitute an overlap?
+
+      \return
+          The ids of the overlapping entries.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query, bool include_touch = true) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch);
+    return overlaps;
+  }
+
+  template <class Query>
+  bool any_overlap(const Query &query, bool include_touch = true) const
+  {
+    bool overlap = false;
+    visit_overlaps(
+        query,
+        [&] {
+          overlap = true;
+          return visit_stop;
+        },
+        include_touch);
+    return overlap;
+  }
+
+  //! Visit the entries overlapping a query, in the grid and then the tree.
+  /*! \param fn
+          Called as fn(id), fn(bb) or fn(id, bb), and may return
+          visit_stop to end the query.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query, Fn &&fn, bool include_touch = true) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    static_assert(query_is_point || std::is_same_v<Query, aabb>,
+                  "Only point or aabb queries are supported");
+
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), node_id{}, aabb{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    auto report = [&](unsigned int index) {
+      if constexpr (fn_returns_action) {
+        return detail::call_with_args(std::forward<Fn>(fn), node_id(index),
+                                      m_entries[index].bb) == visit_stop;
+      }
+      else {
+        detail::call_with_args(std::forward<Fn>(fn), node_id(index), m_entries[index].bb);
+        return false;
+      }
+    };
+
+    if (!m_cells.empty()) {
+      aabb box;
+      if constexpr (query_is_point) {
+        box.lowerBound = box.upperBound = query;
+      }
+      else {
+        box = query;
+      }
+      if (visit_grid(box, include_touch, report))
+        return;
+    }
+
+    if (m_tree.size() != 0) {
+      m_tree.visit_overlaps(
+          query,
+          [&](typename tree_type::node_id, const aabb &, unsigned int index) {
+            return report(index) ? visit_stop : visit_continue;
+          },
+          include_touch);
+    }
+  }
+
+ private:
+  static constexpr unsigned int NULL_ENTRY = 0xffffffff;
+
+  /// Bits of a cell key per axis.
+  static constexpr unsigned int key_bits = 64 / Dim;
+
+  struct entry {
+    /// The AABB as inserted.
+    aabb bb;
+
+    /// The grid cell of the entry, unless it is in the tree.
+    std::uint64_t cell = 0;
+
+    /// The entry's handle in the tree.
+    typename tree_type::node_id tree_id = {};
+
+    /// The position in the cell, or the next free entry once removed.
+    unsigned int slot = 0;
+
+    bool in_tree = false;
+    bool used = false;
+  };
+
+  unsigned int to_index(node_id id) const
+  {
+    assert(contains(id) && "stale or invalid node_id");
+    return std::uint32_t(id);
+  }
+
+  //! The cell size keeping grid_fraction of the entries in the grid.
+  static double pick_cell_size(std::span<const aabb> bbs)
+  {
+    std::vector<double> extents;
+    extents.reserve(bbs.size());
+    for (const auto &bb : bbs) {
+      double extent = 0;
+      for (unsigned int d = 0; d < Dim; d++)
+        extent = std::max(extent, double(bb.upperBound[d]) - double(bb.lowerBound[d]));
+      extents.push_back(extent);
+    }
+    if (extents.empty())
+      return 1;
+
+    auto nth = extents.begin() + std::size_t(grid_fraction * (extents.size() - 1));
+    std::nth_element(extents.begin(), nth, extents.end());
+    return *nth > 0 ? *nth : 1;
+  }
+
+  bool fits_grid(const aabb &bb) const
+  {
+    for (unsigned int d = 0; d < Dim; d++) {
+      if (double(bb.upperBound[d]) - double(bb.lowerBound[d]) > m_cellSize)
+        return false;
+    }
+    return true;
+  }
+
+  //! The cell of a coordinate along an axis, wrapped if periodic.
+  long cell_of(unsigned int d, double x) const
+  {
+    long c = std::floor(x / m_cellWidth[d]);
+    return m_bounds[d] != 0 ? wrap(d, c) : c;
+  }
+
+  long wrap(unsigned int d, long c) const
+  {
+    long n = m_cellCount[d];
+    return ((c % n) + n) % n;
+  }
+
+  std::uint64_t pack(const std::array<long, Dim> &c) const
+  {
+    constexpr std::uint64_t mask =
+        key_bits == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << key_bits) - 1;
+    std::uint64_t key = 0;
+    for (unsigned int d = 0; d < Dim; d++)
+      key |= (std::uint64_t(c[d]) & mask) << (d * key_bits);
+    return key;
+  }
+
+  std::uint64_t cell_key(const aabb &bb) const
+  {
+    std::array<long, Dim> c;
+    for (unsigned int d = 0; d < Dim; d++)
+      c[d] = cell_of(d, bb.lowerBound[d]);
+    return pack(c);
+  }
+
+  void place(unsigned int index, const aabb &bb)
+  {
+    auto &e = m_entries[index];
+    e.bb = bb;
+    e.used = true;
+    e.in_tree = !fits_grid(bb);
+    if (e.in_tree) {
+      e.tree_id = m_tree.insert(bb, index);
+      return;
+    }
+    e.cell = cell_key(bb);
+    auto &cell = m_cells[e.cell];
+    e.slot = cell.size();
+    cell.push_back(index);
+  }
+
+  void unplace(unsigned int index)
+  {
+    auto &e = m_entries[index];
+    if (e.in_tree) {
+      m_tree.remove(e.tree_id);
+      return;
+    }
+    auto it = m_cells.find(e.cell);
+    auto &cell = it->second;
+    m_entries[cell.back()].slot = e.slot;
+    cell[e.slot] = cell.back();
+    cell.pop_back();
+    if (cell.empty())
+      m_cells.erase(it);
+  }
+
+  //! Report the grid entries overlapping a box, returning whether to stop.
+  /*! An entry overlapping the box has its lower corner at most one cell
+      below it, so the cells searched start one below the box. Along a
+      periodic axis the cells are wrapped, and each entry is shifted by the
+      periods the unwrapped cell is away from it. A box reaching around a
+      periodic axis visits each of its cells once, and then an entry may
+      overlap the box in an image other than the one its cell was reached
+      at, so every image is tested.
+   */
+  template <class Report>
+  bool visit_grid(const aabb &box, bool include_touch, Report &report) const
+  {
+    std::array<long, Dim> first, last;
+    double cells = 1;
+    bool wraps = false;
+    for (unsigned int d = 0; d < Dim; d++) {
+      first[d] = std::floor((double(box.lowerBound[d]) - m_cellWidth[d]) / m_cellWidth[d]);
+      last[d] = std::floor(double(box.upperBound[d]) / m_cellWidth[d]);
+      if (m_bounds[d] != 0 && last[d] - first[d] + 1 > long(m_cellCount[d])) {
+        last[d] = first[d] + long(m_cellCount[d]) - 1;
+        wraps = true;
+      }
+      cells *= last[d] - first[d] + 1;
+    }
+
+    // A box spanning more cells than are occupied tests every entry.
+    if (cells > m_cells.size()) {
+      for (const auto &[key, members] : m_cells) {
+        for (unsigned int index : members) {
+          if (overlaps_image(m_entries[index].bb, box, include_touch) && report(index))
+            return true;
+        }
+      }
+      return false;
+    }
+
+    std::array<long, Dim> c = first, wrapped;
+    vec<double> shift = {};
+    while (true) {
+      for (unsigned int d = 0; d < Dim; d++) {
+        wrapped[d] = c[d];
+        shift[d] = 0;
+        if (m_bounds[d] != 0) {
+          wrapped[d] = wrap(d, c[d]);
+          shift[d] = double(c[d] - wrapped[d]) / m_cellCount[d] * m_bounds[d];
+        }
+      }
+
+      auto it = m_cells.find(pack(wrapped));
+      if (it != m_cells.end()) {
+        for (unsigned int index : it->second) {
+          const auto &bb = m_entries[index].bb;
+          bool hit = wraps ? overlaps_image(bb, box, include_touch)
+                           : overlaps_shifted(bb, shift, box, include_touch);
+          if (hit && report(index))
+            return true;
+        }
+      }
+
+      unsigned int d = 0;
+      for (; d < Dim && c[d] == last[d]; d++)
+        c[d] = first[d];
+      if (d == Dim)
+        return false;
+      c[d]++;
+    }
+  }
+
+  /// The shift moving an entry's lower corner into the periodic box.
+  double wrap_offset(unsigned int d, const aabb &bb) const
+  {
+    if (m_bounds[d] == 0)
+      return 0;
+    return -std::floor(double(bb.lowerBound[d]) / m_bounds[d]) * m_bounds[d];
+  }
+
+  static bool overlaps_axis(double lower, double upper, double lo, double hi,
+                            bool include_touch)
+  {
+    return include_touch ? !(upper < lo || lower > hi) : !(upper <= lo || lower >= hi);
+  }
+
+  //! Test an entry, moved to its grid cell and then by shift, against a box.
+  bool overlaps_shifted(const aabb &bb,
+                        const vec<double> &shift,
+                        const aabb &box,
+                        bool include_touch) const
+  {
+    for (unsigned int d = 0; d < Dim; d++) {
+      double offset = shift[d] + wrap_offset(d, bb);
+      if (!overlaps_axis(bb.lowerBound[d] + offset, bb.upperBound[d] + offset,
+                         box.lowerBound[d], box.upperBound[d], include_touch))
+        return false;
+    }
+    return true;
+  }
+
+  //! Test an entry against a box in any periodic image.
+  /*! Along a periodic axis only the first image whose upper bound reaches
+      the box, and the one after it for a box it merely touches, can
+      overlap before the images pass the box.
+   */
+  bool overlaps_image(const aabb &bb, const aabb &box, bool include_touch) const
+  {
+    for (unsigned int d = 0; d < Dim; d++) {
+      double lower = bb.lowerBound[d], upper = bb.upperBound[d];
+      bool hit;
+      if (m_bounds[d] != 0) {
+        double period = m_bounds[d];
+        double offset = std::ceil((double(box.lowerBound[d]) - upper) / period) * period;
+        hit = overlaps_axis(lower + offset, upper + offset, box.lowerBound[d],
+                            box.upperBound[d], include_touch) ||
+              overlaps_axis(lower + offset + period, upper + offset + period,
+                            box.lowerBound[d], box.upperBound[d], include_touch);
+      }
+      else {
+        hit = overlaps_axis(lower, upper, box.lowerBound[d], box.upperBound[d],
+                            include_touch);
+      }
+      if (!hit)
+        return false;
+    }
+    return true;
+  }
+
+  /// The entries too large for the grid, with their index as payload.
+  tree_type m_tree;
+
+  /// The extent below which entries go in the grid.
+  double m_cellSize;
+
+  /// The periodic box, zero along non-periodic axes.
+  vec<ValTy> m_bounds;
+
+  /// The width of the cells along each axis.
+  vec<double> m_cellWidth;
+
+  /// The number of cells along each periodic axis.
+  vec<double> m_cellCount = {};
+
+  /// The occupied cells, each listing its entries.
+  std::unordered_map<std::uint64_t, std::vector<unsigned int>> m_cells;
+
+  /// Every entry, by handle.
+  std::vector<entry> m_entries;
+
+  /// The first removed entry, free for reuse.
+  unsigned int m_freeEntry = NULL_ENTRY;
+
+  /// The number of entries.
+  unsigned int m_size = 0;
+};
+
+#define TYPEDEFS(suffix, dim, type) \
+  using hybrid_index##suffix = hybrid_index<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_HYBRID_INDEX_H */
@@ -0,0 +1,358 @@
+#ifndef _ABT_QUANTIZED_TREE_H
+#define _ABT_QUANTIZED_TREE_H
+
+#include <abt/aabb_tree.hpp>
+
+namespace abt {
+
+/*! \brief A read-only, memory-lean copy of a binary tree.
+
+    Every internal node stores the bounds of its two children as Bits-bit
+    codes within its own box, rounded outward so that the decoded box
+    always contains the child. Only the leaves keep their AABBs in full
+    precision, in a side array, and they are tested exactly, so queries
+    report the same entries as the source tree. Like wide_tree it is a
+    snapshot: it reports the node ids of the tree it was made from but
+    does not follow later changes to it.
+ */
+template <unsigned Dim, typename ValTy = double, unsigned Bits = 8>
+class quantized_tree {
+  static_assert(Bits == 8 || Bits == 16, "Only 8 or 16 bit codes are supported");
+
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using node_id = typename tree_type::node_id;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  /// Constructor (empty).
+  quantized_tree() = default;
+
+  //! Constructor.
+  /*! \param t
+          The binary tree to compress.
+   */
+  explicit quantized_tree(const tree_type &t)
+      : m_bounds(t.periodic_bounds())
+  {
+    if (t.m_root == tree_type::NULL_NODE)
+      return;
+
+    const auto &root = t.m_nodes[t.m_root];
+    for (unsigned int d = 0; d < Dim; d++) {
+      m_rootLower[d] = root.bb.lowerBound[d];
+      m_rootUpper[d] = root.bb.upperBound[d];
+    }
+
+    m_nodes.reserve(t.size());
+    m_leaves.reserve(t.size());
+    m_root = compress(t, t.m_root, m_rootLower, m_rootUpper);
+  }
+
+  /// Return the number of entries in the tree.
+  unsigned int size() const { return m_leaves.size(); }
+
+  /// Return the number of bytes held by the nodes and leaves.
+  std::size_t memory_usage() const
+  {
+    return m_nodes.capacity() * sizeof(node) + m_leaves.capacity() * sizeof(leaf);
+  }
+
+  //! Query the tree to find candidate interactions for an AABB.
+  /*! \param query
+          The AABB or point.
+
+      \param include_touch
+          Does touching constitute an overlap?
+
+      \param bounds
+          The periodic box, zero along non-periodic axes, or zero to use
+          the periodic box of the source tree.
+
+      \return
+          The ids of the overlapping entries.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query,
+                                    bool include_touch = true,
+                                    const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
+    return overlaps;
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
+    static_assert(query_is_point || query_is_aabb,
+                  "Only point or aabb queries are supported");
+
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), node_id{}, aabb{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    if (m_leaves.empty())
+      return;
+
+    // Walk the tree for one image of the query, reporting whether to stop.
+    // An entry an earlier image reached is skipped.
+    auto walk = [&](const Query &image, std::span<const Query> earlier) {
+      vec<double> queryLower, queryUpper;
+      for (unsigned int d = 0; d < Dim; d++) {
+        if constexpr (query_is_point) {
+          queryLower[d] = queryUpper[d] = image[d];
+        }
+        else {
+          queryLower[d] = image.lowerBound[d];
+          queryUpper[d] = image.upperBound[d];
+        }
+      }
+
+      auto hit = [&](const vec<double> &lo, const vec<double> &hi) {
+        for (unsigned int d = 0; d < Dim; d++) {
+          if (!overlaps_axis(lo[d], hi[d], queryLower[d], queryUpper[d], include_touch))
+            return false;
+        }
+        return true;
+      };
+
+      // Leaves are tested against their exact AABBs, reporting whether to stop.
+      auto visit_leaf = [&](unsigned int index) {
+        const auto &l = m_leaves[index];
+        vec<double> lo, hi;
+        for (unsigned int d = 0; d < Dim; d++) {
+          lo[d] = l.lowerBound[d];
+          hi[d] = l.upperBound[d];
+        }
+        if (!hit(lo, hi) ||
+            tree_type::reached_before(l.lowerBound.values, l.upperBound.values,
+                                      earlier, include_touch))
+          return false;
+        if constexpr (fn_returns_action) {
+          return detail::call_with_args(std::forward<Fn>(fn), l.id,
+                                        aabb{l.lowerBound, l.upperBound}) == visit_stop;
+        }
+        else {
+          detail::call_with_args(std::forward<Fn>(fn), l.id,
+                                 aabb{l.lowerBound, l.upperBound});
+          return false;
+        }
+      };
+
+      if (m_root & LEAF_FLAG)
+        return visit_leaf(m_root & ~LEAF_FLAG);
+      if (!hit(m_rootLower, m_rootUpper))
+        return false;
+
+      // Each entry carries the decoded box of its node. The walk carries on
+      // into the first child that hits and only stacks the second.
+      static thread_local std::vector<frame> stack(64);
+      stack.clear();
+      frame f{m_root, m_rootLower, m_rootUpper};
+
+      while (true) {
+        const auto &n = m_nodes[f.index];
+        frame next[2];
+        unsigned int hits = 0;
+
+        for (unsigned int c = 0; c < 2; c++) {
+          if (n.child[c] & LEAF_FLAG) {
+            if (visit_leaf(n.child[c] & ~LEAF_FLAG))
+              return true;
+            continue;
+          }
+
+          frame &child = next[hits];
+          child.index = n.child[c];
+          decode(n, c, f.lowerBound, f.upperBound, child.lowerBound, child.upperBound);
+          if (hit(child.lowerBound, child.upperBound))
+            hits++;
+        }
+
+        if (hits == 2)
+          stack.push_back(next[1]);
+        if (hits > 0) {
+          f = next[0];
+        }
+        else if (!stack.empty()) {
+          f = stack.back();
+          stack.pop_back();
+        }
+        else {
+          return false;
+        }
+      }
+    };
+
+    // Periodic queries are split into their images once, as tree does.
+    const auto &period = bounds == vec<ValTy>{} ? m_bounds : bounds;
+    tree_type::visit_images(query, aabb{point(m_rootLower), point(m_rootUpper)}, period,
+                            walk);
+  }
+
+ private:
+  /// Set in a child reference when the child is a leaf.
+  static constexpr unsigned int LEAF_FLAG = 0x80000000;
+
+  /// The largest code.
+  static constexpr unsigned int max_code = (1u << Bits) - 1;
+
+  using code = std::conditional_t<Bits == 8, std::uint8_t, std::uint16_t>;
+
+  /// An internal node: the coded bounds of both children and their references.
+  struct node {
+    std::array<std::array<code, Dim>, 2> lowerBound;
+    std::array<std::array<code, Dim>, 2> upperBound;
+    std::array<unsigned int, 2> child;
+  };
+
+  /// A leaf: its exact bounds and its id in the source tree.
+  struct leaf {
+    point lowerBound;
+    point upperBound;
+    node_id id;
+  };
+
+  /// A node to visit and its decoded box.
+  struct frame {
+    unsigned int index;
+    vec<double> lowerBound = {};
+    vec<double> upperBound = {};
+  };
+
+  static bool overlaps_axis(double lower1, double upper1, double lower2,
+                            double upper2, bool touchIsOverlap)
+  {
+    return touchIsOverlap ? !(upper2 < lower1 || lower2 > upper1)
+                          : !(upper2 <= lower1 || lower2 >= upper1);
+  }
+
+  //! The position of a code within a box, the same for building and queries.
+  static double position(double lower, double upper, unsigned int q)
+  {
+    constexpr double scale = 1.0 / max_code;
+    return lower + (upper - lower) * (q * scale);
+  }
+
+  //! Decode the box of a child from the box of its parent.
+  static void decode(const node &n,
+                     unsigned int c,
+                     const vec<double> &lower,
+                     const vec<double> &upper,
+                     vec<double> &childLower,
+                     vec<double> &childUpper)
+  {
+    for (unsigned int d = 0; d < Dim; d++) {
+      childLower[d] = position(lower[d], upper[d], n.lowerBound[c][d]);
+      childUpper[d] = position(lower[d], upper[d], n.upperBound[c][d]);
+    }
+  }
+
+  //! Code a bound within a box, rounding outward.
+  /*! \param outward
+          -1 to round a lower bound down, +1 to round an upper bound up.
+   */
+  static code quantize(double lower, double upper, double x, int outward)
+  {
+    if (!(upper > lower))
+      return outward < 0 ? 0 : max_code;
+
+    long q = std::lround((x - lower) / (upper - lower) * max_code);
+    q = std::clamp<long>(q, 0, max_code);
+    // Step outward until the decoded bound really contains x.
+    if (outward < 0) {
+      while (q > 0 && position(lower, upper, q) > x)
+        q--;
+    }
+    else {
+      while (q < long(max_code) && position(lower, upper, q) < x)
+        q++;
+    }
+    return code(q);
+  }
+
+  //! Compress the binary subtree below a node.
+  /*! \param lower
+          The decoded lower bound of the node, which contains its AABB.
+
+      \param upper
+          The decoded upper bound of the node.
+
+      \return
+          The reference to the compressed node, or to the leaf.
+   */
+  unsigned int compress(const tree_type &t,
+                        unsigned int index,
+                        const vec<double> &lower,
+                        const vec<double> &upper)
+  {
+    const auto &nodes = t.m_nodes;
+    if (nodes[index].isLeaf()) {
+      const auto &bb = nodes[index].bb;
+      m_leaves.push_back({bb.lowerBound, bb.upperBound, t.to_id(index)});
+      return (m_leaves.size() - 1) | LEAF_FLAG;
+    }
+
+    unsigned int compressed = m_nodes.size();
+    m_nodes.emplace_back();
+
+    std::array<unsigned int, 2> children = {nodes[index].left, nodes[index].right};
+    for (unsigned int c = 0; c < 2; c++) {
+      const auto &bb = nodes[children[c]].bb;
+      node &n = m_nodes[compressed];
+      for (unsigned int d = 0; d < Dim; d++) {
+        n.lowerBound[c][d] = quantize(lower[d], upper[d], bb.lowerBound[d], -1);
+        n.upperBound[c][d] = quantize(lower[d], upper[d], bb.upperBound[d], +1);
+      }
+
+      vec<double> childLower, childUpper;
+      decode(n, c, lower, upper, childLower, childUpper);
+      unsigned int child = compress(t, children[c], childLower, childUpper);
+      m_nodes[compressed].child[c] = child;
+    }
+    return compressed;
+  }
+
+  /// The internal nodes.
+  std::vector<node> m_nodes;
+
+  /// The reference to the root, a leaf if the tree holds one entry.
+  unsigned int m_root = 0;
+
+  /// The full-precision box of the root.
+  vec<double> m_rootLower = {}, m_rootUpper = {};
+
+  /// The leaves, with their full-precision bounds.
+  std::vector<leaf> m_leaves;
+
+  /// The periodic box of the source tree.
+  vec<ValTy> m_bounds = {};
+};
+
+// Utility typedefs
+#define TYPEDEFS(suffix, dim, type) \
+  using quantized_tree##suffix = quantized_tree<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_QUANTIZED_TREE_H */
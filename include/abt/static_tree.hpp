@@ -0,0 +1,279 @@
+#ifndef _ABT_STATIC_TREE_H
+#define _ABT_STATIC_TREE_H
+
+#include <abt/aabb_tree.hpp>
+
+namespace abt {
+
+/*! \brief An immutable tree over a fixed set of AABBs, built for queries.
+
+    The hierarchy comes from the bulk builder and is stored depth first:
+    the left child of a node directly follows it, and every node records
+    the index just past its subtree. A query then walks the array forwards
+    without a stack, stepping into a node that overlaps and skipping over
+    one that does not. Bounds are tight, with no skin, and there is no
+    parent, free list or height to carry. Entries keep the ids a bulk built
+    tree would give them: the index of their AABB in the input.
+ */
+template <unsigned Dim, typename ValTy = double>
+class static_tree {
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using node_id = typename tree_type::node_id;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  /// Constructor (empty).
+  static_tree() = default;
+
+  //! Constructor.
+  /*! \param bbs
+          The AABBs of the entries.
+
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  explicit static_tree(std::span<const aabb> bbs, const build_options &options = {})
+      : static_tree(vec<ValTy>{}, bbs, options)
+  {
+  }
+
+  //! Constructor.
+  /*! \param periodic_bounds
+          The periodic box, zero along non-periodic axes.
+
+      \param bbs
+          The AABBs of the entries.
+
+      \param options
+          The bulk construction algorithm and the number of threads.
+   */
+  static_tree(const vec<ValTy> &periodic_bounds,
+              std::span<const aabb> bbs,
+              const build_options &options = {})
+      : m_bounds(periodic_bounds), m_boxes(bbs.begin(), bbs.end())
+  {
+    if (bbs.empty())
+      return;
+
+    auto internal = bulk_builder<Dim, ValTy>::build(bbs, options);
+    unsigned int count = bbs.size();
+
+    // Children precede their parents, so one pass sizes every subtree.
+    std::vector<unsigned int> leafCount(internal.size());
+    auto leaves_below = [&](unsigned int ref) {
+      return ref < count ? 1u : leafCount[ref - count];
+    };
+    for (unsigned int i = 0; i < internal.size(); i++)
+      leafCount[i] = leaves_below(internal[i].left) + leaves_below(internal[i].right);
+
+    m_nodes.reserve(2 * count - 1);
+    std::vector<unsigned int> stack = {internal.empty() ? 0 : count + unsigned(internal.size()) - 1};
+    while (!stack.empty()) {
+      unsigned int ref = stack.back();
+      stack.pop_back();
+
+      node n;
+      unsigned int index = m_nodes.size();
+      n.skip = index + 2 * leaves_below(ref) - 1;
+      if (ref < count) {
+        n.lowerBound = bbs[ref].lowerBound.values;
+        n.upperBound = bbs[ref].upperBound.values;
+        n.entry = ref;
+      }
+      else {
+        const auto &in = internal[ref - count];
+        n.lowerBound = in.bb.lowerBound.values;
+        n.upperBound = in.bb.upperBound.values;
+        stack.push_back(in.right);
+        stack.push_back(in.left);
+      }
+      m_nodes.push_back(n);
+    }
+  }
+
+  /// Return the number of entries in the tree.
+  unsigned int size() const { return m_boxes.size(); }
+
+  /// Return the number of bytes held by the nodes and entry AABBs.
+  std::size_t memory_usage() const
+  {
+    return m_nodes.capacity() * sizeof(node) + m_boxes.capacity() * sizeof(aabb);
+  }
+
+  /// The periodic box given at construction, zero along non-periodic axes.
+  const vec<ValTy> &periodic_bounds() const { return m_bounds; }
+
+  /// Get the AABB of an entry.
+  const aabb &get_aabb(node_id id) const { return m_boxes[std::uint64_t(id)]; }
+
+  //! Query the tree to find candidate interactions for an AABB.
+  /*! \param query
+          The AABB or point.
+
+      \param include_touch
+          Does touching constitute an overlap?
+
+      \param bounds
+          The periodic box, zero along non-periodic axes, or zero to use
+          the periodic box given at construction.
+
+      \return
+          The ids of the overlapping entries.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query,
+                                    bool include_touch = true,
+                                    const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
+    return overlaps;
+  }
+
+  template <class Query>
+  bool any_overlap(const Query &query, bool include_touch = true,
+                   const vec<ValTy> &bounds = {}) const
+  {
+    return any_overlap(
+        query, [] { return true; }, include_touch, bounds);
+  }
+
+  template <class Query, class Fn>
+  bool any_overlap(const Query &query, Fn &&fn, bool include_touch = true,
+                   const vec<ValTy> &bounds = {}) const
+  {
+    bool overlap = false;
+    auto wrap_fn = [&overlap, &fn](node_id id, const aabb &bb) {
+      bool success = detail::call_with_args(std::forward<Fn>(fn), id, bb);
+      overlap |= success;
+      return success ? visit_stop : visit_continue;
+    };
+    visit_overlaps(query, wrap_fn, include_touch, bounds);
+    return overlap;
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
+    static_assert(query_is_point || query_is_aabb,
+                  "Only point or aabb queries are supported");
+
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), node_id{}, aabb{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    if (m_nodes.empty())
+      return;
+    const auto &period = bounds == vec<ValTy>{} ? m_bounds : bounds;
+
+    // Walk the array for one image of the query, reporting whether to stop.
+    // An entry an earlier image reached is skipped. Touching is a template
+    // argument so that the plain case stays a tight loop of comparisons.
+    auto walk = [&](const Query &image, std::span<const Query> earlier, auto touch) {
+      constexpr bool Touch = decltype(touch)::value;
+      vec<ValTy> queryLower, queryUpper;
+      for (unsigned int d = 0; d < Dim; d++) {
+        if constexpr (query_is_point) {
+          queryLower[d] = queryUpper[d] = image[d];
+        }
+        else {
+          queryLower[d] = image.lowerBound[d];
+          queryUpper[d] = image.upperBound[d];
+        }
+      }
+      auto hit = [&](const node &n) {
+        for (unsigned int d = 0; d < Dim; d++) {
+          const ValTy lo = n.lowerBound[d], hi = n.upperBound[d];
+          if (Touch ? (queryUpper[d] < lo || queryLower[d] > hi)
+                    : (queryUpper[d] <= lo || queryLower[d] >= hi))
+            return false;
+        }
+        return true;
+      };
+
+      const unsigned int end = m_nodes.size();
+      for (unsigned int i = 0; i < end;) {
+        const auto &n = m_nodes[i];
+        if (!hit(n)) {
+          i = n.skip;
+          continue;
+        }
+        if (n.entry != NULL_ENTRY &&
+            !tree_type::reached_before(n.lowerBound, n.upperBound, earlier, Touch)) {
+          if constexpr (fn_returns_action) {
+            if (detail::call_with_args(std::forward<Fn>(fn), node_id(n.entry),
+                                       m_boxes[n.entry]) == visit_stop)
+              return true;
+          }
+          else {
+            detail::call_with_args(std::forward<Fn>(fn), node_id(n.entry), m_boxes[n.entry]);
+          }
+        }
+        i++;
+      }
+      return false;
+    };
+
+    // Periodic queries are split into their images once, as tree does.
+    const auto &root = m_nodes.front();
+    tree_type::visit_images(query, aabb{root.lowerBound, root.upperBound}, period,
+                            [&](const Query &image, std::span<const Query> earlier) {
+                              return include_touch
+                                         ? walk(image, earlier, std::true_type{})
+                                         : walk(image, earlier, std::false_type{});
+                            });
+  }
+
+ private:
+  /// Marks an internal node.
+  static constexpr unsigned int NULL_ENTRY = 0xffffffff;
+
+  /// A node of the depth-first layout.
+  struct node {
+    /// The tight bounds of the subtree.
+    vec<ValTy> lowerBound;
+    vec<ValTy> upperBound;
+
+    /// The index just past the subtree, where a walk skipping it goes next.
+    unsigned int skip;
+
+    /// The input index of a leaf, NULL_ENTRY for an internal node.
+    unsigned int entry = NULL_ENTRY;
+  };
+
+  /// The periodic box, zero along non-periodic axes.
+  vec<ValTy> m_bounds = {};
+
+  /// The nodes in depth-first order, the root first.
+  std::vector<node> m_nodes;
+
+  /// The AABBs of the entries, by input index.
+  std::vector<aabb> m_boxes;
+};
+
+#define TYPEDEFS(suffix, dim, type) \
+  using static_tree##suffix = static_tree<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_STATIC_TREE_H */
@@ -0,0 +1,305 @@
+#ifndef _ABT_TREE_VIEW_H
+#define _ABT_TREE_VIEW_H
+
+#include <abt/aabb_tree.hpp>
+
+#include <filesystem>
+#include <fstream>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ABT_HAS_MMAP 1
+#endif
+
+namespace abt {
+
+namespace detail {
+//! A section of a saved tree, indexed with a bounds check.
+/*! Indices read from the file are checked as they are followed, so a
+    corrupt child or handle is reported rather than read past the section.
+ */
+template <class T>
+class checked_section {
+ public:
+  checked_section() = default;
+  checked_section(const T *values, std::size_t size) : m_values(values), m_size(size) {}
+
+  const T &operator[](std::size_t i) const
+  {
+    if (i >= m_size) [[unlikely]]
+      throw std::runtime_error("abt: corrupt tree");
+    return m_values[i];
+  }
+
+ private:
+  const T *m_values = nullptr;
+  std::size_t m_size = 0;
+};
+
+//! A traversal stack that takes no more pushes per walk than a tree has nodes.
+/*! A walk over a sound tree pushes each node at most once, so a walk
+    pushing more has met a cycle among the saved children.
+ */
+template <class T>
+class bounded_stack {
+ public:
+  bounded_stack(std::vector<T> &values, std::size_t limit) : m_values(values), m_limit(limit) {}
+
+  void clear()
+  {
+    m_values.clear();
+    m_pushes = 0;
+  }
+
+  bool empty() const { return m_values.empty(); }
+  std::size_t size() const { return m_values.size(); }
+
+  void push_back(const T &value)
+  {
+    if (m_pushes++ == m_limit) [[unlikely]]
+      throw std::runtime_error("abt: corrupt tree");
+    m_values.push_back(value);
+  }
+
+  void pop_back() { m_values.pop_back(); }
+  const T &back() const { return m_values.back(); }
+
+ private:
+  std::vector<T> &m_values;
+  std::size_t m_limit;
+  std::size_t m_pushes = 0;
+};
+}  // namespace detail
+
+/*! \brief Read-only queries straight over a tree saved by tree::save().
+
+    The view reads the saved nodes and branches where they lie, so opening
+    one parses nothing and allocates nothing: map() only maps the file, and
+    its pages are shared through the page cache by every process mapping
+    it. The view reports the node ids the saved tree handed out.
+
+    Opening checks the header only, and the nodes are trusted no further
+    than that: every child and handle index is checked against its section
+    as a query follows it, and a walk longer than the tree has nodes is cut
+    off, so a corrupt file throws std::runtime_error from the query that
+    meets the damage rather than reading out of bounds.
+ */
+template <unsigned Dim, typename ValTy = double, typename Payload = void *>
+class tree_view {
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy, Payload>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using node_id = typename tree_type::node_id;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  //! Constructor.
+  /*! \param bytes
+          A saved tree, starting on a file_alignment boundary. The view
+          does not own the memory, which must outlive it.
+
+      Throws std::runtime_error if the bytes are not a tree of this layout,
+      or the sections its header describes do not fit in them.
+   */
+  explicit tree_view(std::span<const std::byte> bytes)
+  {
+    if (bytes.size() < sizeof(detail::file_header) ||
+        reinterpret_cast<std::uintptr_t>(bytes.data()) % detail::file_alignment != 0)
+      throw std::runtime_error("abt: not a saved tree");
+    m_header = reinterpret_cast<const detail::file_header *>(bytes.data());
+    if (!tree_type::matches_layout(*m_header))
+      throw std::runtime_error("abt: not a tree saved with this layout");
+    if (!tree_type::valid_sections(*m_header, bytes.size()))
+      throw std::runtime_error("abt: corrupt or truncated tree");
+
+    auto section = [&](std::uint64_t offset) { return bytes.data() + offset; };
+    m_bounds = reinterpret_cast<const vec<ValTy> *>(section(m_header->bounds_offset));
+    m_nodes = {reinterpret_cast<const node *>(section(m_header->nodes_offset)),
+               m_header->node_capacity};
+    m_branches = {reinterpret_cast<const branch *>(section(m_header->branches_offset)),
+                  m_header->node_capacity};
+    m_handles = {reinterpret_cast<const handle *>(section(m_header->handles_offset)),
+                 m_header->handle_count};
+  }
+
+  tree_view(const tree_view &) = delete;
+  tree_view &operator=(const tree_view &) = delete;
+
+  tree_view(tree_view &&other) noexcept { swap(other); }
+
+  tree_view &operator=(tree_view &&other) noexcept
+  {
+    swap(other);
+    return *this;
+  }
+
+  ~tree_view()
+  {
+#ifdef ABT_HAS_MMAP
+    if (m_mapping)
+      ::munmap(m_mapping, m_mapping_size);
+#endif
+  }
+
+  void swap(tree_view &other) noexcept
+  {
+    std::swap(m_header, other.m_header);
+    std::swap(m_bounds, other.m_bounds);
+    std::swap(m_nodes, other.m_nodes);
+    std::swap(m_branches, other.m_branches);
+    std::swap(m_handles, other.m_handles);
+    std::swap(m_mapping, other.m_mapping);
+    std::swap(m_mapping_size, other.m_mapping_size);
+  }
+
+#ifdef ABT_HAS_MMAP
+  //! Map a file written by tree::save() and view it.
+  /*! Throws std::runtime_error if the file cannot be mapped or is not a
+      tree of this layout.
+   */
+  static tree_view map(const std::filesystem::path &path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("abt: cannot open " + path.string());
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+      mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+      throw std::runtime_error("abt: cannot map " + path.string());
+
+    std::size_t size = st.st_size;
+    try {
+      tree_view view({static_cast<const std::byte *>(mapping), size});
+      view.m_mapping = mapping;
+      view.m_mapping_size = size;
+      return view;
+    }
+    catch (...) {
+      ::munmap(mapping, size);
+      throw;
+    }
+  }
+#endif
+
+  /// Return the number of entries in the tree.
+  unsigned int size() const { return m_header->leaf_count; }
+
+  /// The periodic box of the saved tree, zero along non-periodic axes.
+  const vec<ValTy> &periodic_bounds() const { return *m_bounds; }
+
+  /// Test whether a handle refers to an entry of the saved tree.
+  bool contains(node_id id) const
+  {
+    auto slot = tree_type::handle_slot(id);
+    return slot < m_header->handle_count &&
+           m_handles[slot].generation == tree_type::handle_generation(id);
+  }
+
+  /// Get the AABB of an entry.
+  aabb get_aabb(node_id id) const { return m_nodes[to_unsigned(id)].bb; }
+
+  /// Return the payload of an entry.
+  Payload data(node_id id) const { return m_nodes[to_unsigned(id)].user_data; }
+
+  //! Visit the entries overlapping a query, as tree::visit_overlaps does.
+  /*! Throws std::runtime_error if the walk meets a child index out of
+      range or a cycle.
+   */
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    static_assert(std::is_same_v<Query, point> || std::is_same_v<Query, aabb>,
+                  "Only point or aabb queries are supported");
+    if (size() == 0)
+      return;
+
+    static thread_local std::vector<unsigned int> values;
+    detail::bounded_stack<unsigned int> stack(values, m_header->node_capacity);
+    detail::no_counters counters;
+    tree_type::traverse_overlaps(m_nodes, m_branches, m_header->root, query,
+                                 std::forward<Fn>(fn), include_touch,
+                                 bounds == vec<ValTy>{} ? *m_bounds : bounds, stack,
+                                 counters);
+  }
+
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query,
+                                    bool include_touch = true,
+                                    const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
+    return overlaps;
+  }
+
+ private:
+  using node = typename tree_type::node;
+  using branch = typename tree_type::branch;
+  using handle = typename tree_type::handle;
+
+  /// The node of a handle, both indices checked as they are followed.
+  unsigned int to_unsigned(node_id id) const
+  {
+    assert(contains(id) && "stale or invalid node_id");
+    return m_handles[tree_type::handle_slot(id)].node;
+  }
+
+  /// The sections of the saved tree.
+  const detail::file_header *m_header = nullptr;
+  const vec<ValTy> *m_bounds = nullptr;
+  detail::checked_section<node> m_nodes;
+  detail::checked_section<branch> m_branches;
+  detail::checked_section<handle> m_handles;
+
+  /// The mapping made by map(), unmapped with the view.
+  void *m_mapping = nullptr;
+  std::size_t m_mapping_size = 0;
+};
+
+//! Save a tree to a file, see tree::save().
+template <unsigned Dim, typename ValTy, typename Payload>
+void save(const tree<Dim, ValTy, Payload> &t, const std::filesystem::path &path)
+{
+  std::ofstream os(path, std::ios::binary);
+  if (!os)
+    throw std::runtime_error("abt: cannot open " + path.string());
+  t.save(os);
+}
+
+//! Load a tree from a file written by save(), see tree::load().
+template <class Tree>
+Tree load(const std::filesystem::path &path)
+{
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    throw std::runtime_error("abt: cannot open " + path.string());
+  return Tree::load(is);
+}
+
+#define TYPEDEFS(suffix, dim, type) \
+  using tree_view##suffix = tree_view<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_TREE_VIEW_H */
@@ -0,0 +1,614 @@
+#ifndef _ABT_WIDE_TREE_H
+#define _ABT_WIDE_TREE_H
+
+#include <abt/aabb_tree.hpp>
+
+#if defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace abt {
+
+namespace detail {
+/*! \brief Overlap test of one query against all lanes of a wide node.
+
+    The bounds are stored per axis, one lane per child, so that every axis
+    is a single vector comparison. The portable version is written so that
+    compilers can vectorise it for any lane type; the specialisations below
+    spell out the kernels for the common floating point widths.
+ */
+template <typename ValTy, unsigned Width>
+struct wide_kernel {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<ValTy, Width>, Dim> &lowerBound,
+      const std::array<std::array<ValTy, Width>, Dim> &upperBound,
+      const std::array<ValTy, Dim> &queryLower,
+      const std::array<ValTy, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    std::array<bool, Width> hit;
+    hit.fill(true);
+    for (unsigned int d = 0; d < Dim; d++) {
+      if (touchIsOverlap) {
+        for (unsigned int l = 0; l < Width; l++)
+          hit[l] &= (queryLower[d] <= upperBound[d][l]) &
+                    (queryUpper[d] >= lowerBound[d][l]);
+      }
+      else {
+        for (unsigned int l = 0; l < Width; l++)
+          hit[l] &= (queryLower[d] < upperBound[d][l]) &
+                    (queryUpper[d] > lowerBound[d][l]);
+      }
+    }
+
+    unsigned int mask = 0;
+    for (unsigned int l = 0; l < Width; l++)
+      mask |= unsigned(hit[l]) << l;
+    return mask;
+  }
+};
+
+#if defined(__AVX__)
+template <>
+struct wide_kernel<double, 4> {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<double, 4>, Dim> &lowerBound,
+      const std::array<std::array<double, 4>, Dim> &upperBound,
+      const std::array<double, Dim> &queryLower,
+      const std::array<double, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    __m256d hit = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    for (unsigned int d = 0; d < Dim; d++) {
+      __m256d lo = _mm256_loadu_pd(lowerBound[d].data());
+      __m256d hi = _mm256_loadu_pd(upperBound[d].data());
+      __m256d ql = _mm256_set1_pd(queryLower[d]);
+      __m256d qh = _mm256_set1_pd(queryUpper[d]);
+      if (touchIsOverlap)
+        hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(ql, hi, _CMP_LE_OQ),
+                                               _mm256_cmp_pd(qh, lo, _CMP_GE_OQ)));
+      else
+        hit = _mm256_and_pd(hit, _mm256_and_pd(_mm256_cmp_pd(ql, hi, _CMP_LT_OQ),
+                                               _mm256_cmp_pd(qh, lo, _CMP_GT_OQ)));
+    }
+    return _mm256_movemask_pd(hit);
+  }
+};
+
+template <>
+struct wide_kernel<float, 8> {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<float, 8>, Dim> &lowerBound,
+      const std::array<std::array<float, 8>, Dim> &upperBound,
+      const std::array<float, Dim> &queryLower,
+      const std::array<float, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    __m256 hit = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (unsigned int d = 0; d < Dim; d++) {
+      __m256 lo = _mm256_loadu_ps(lowerBound[d].data());
+      __m256 hi = _mm256_loadu_ps(upperBound[d].data());
+      __m256 ql = _mm256_set1_ps(queryLower[d]);
+      __m256 qh = _mm256_set1_ps(queryUpper[d]);
+      if (touchIsOverlap)
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(ql, hi, _CMP_LE_OQ),
+                                               _mm256_cmp_ps(qh, lo, _CMP_GE_OQ)));
+      else
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(ql, hi, _CMP_LT_OQ),
+                                               _mm256_cmp_ps(qh, lo, _CMP_GT_OQ)));
+    }
+    return _mm256_movemask_ps(hit);
+  }
+};
+#endif
+
+#if defined(__AVX512F__)
+template <>
+struct wide_kernel<double, 8> {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<double, 8>, Dim> &lowerBound,
+      const std::array<std::array<double, 8>, Dim> &upperBound,
+      const std::array<double, Dim> &queryLower,
+      const std::array<double, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    __mmask8 hit = 0xff;
+    for (unsigned int d = 0; d < Dim; d++) {
+      __m512d lo = _mm512_loadu_pd(lowerBound[d].data());
+      __m512d hi = _mm512_loadu_pd(upperBound[d].data());
+      __m512d ql = _mm512_set1_pd(queryLower[d]);
+      __m512d qh = _mm512_set1_pd(queryUpper[d]);
+      if (touchIsOverlap) {
+        hit = _mm512_mask_cmp_pd_mask(hit, ql, hi, _CMP_LE_OQ);
+        hit = _mm512_mask_cmp_pd_mask(hit, qh, lo, _CMP_GE_OQ);
+      }
+      else {
+        hit = _mm512_mask_cmp_pd_mask(hit, ql, hi, _CMP_LT_OQ);
+        hit = _mm512_mask_cmp_pd_mask(hit, qh, lo, _CMP_GT_OQ);
+      }
+    }
+    return hit;
+  }
+};
+#endif
+
+#if defined(__SSE__) || defined(_M_X64)
+template <>
+struct wide_kernel<float, 4> {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<float, 4>, Dim> &lowerBound,
+      const std::array<std::array<float, 4>, Dim> &upperBound,
+      const std::array<float, Dim> &queryLower,
+      const std::array<float, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    __m128 hit = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (unsigned int d = 0; d < Dim; d++) {
+      __m128 lo = _mm_loadu_ps(lowerBound[d].data());
+      __m128 hi = _mm_loadu_ps(upperBound[d].data());
+      __m128 ql = _mm_set1_ps(queryLower[d]);
+      __m128 qh = _mm_set1_ps(queryUpper[d]);
+      if (touchIsOverlap)
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(ql, hi), _mm_cmpge_ps(qh, lo)));
+      else
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmplt_ps(ql, hi), _mm_cmpgt_ps(qh, lo)));
+    }
+    return _mm_movemask_ps(hit);
+  }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+template <>
+struct wide_kernel<float, 4> {
+  template <unsigned Dim>
+  static unsigned int overlap_mask(
+      const std::array<std::array<float, 4>, Dim> &lowerBound,
+      const std::array<std::array<float, 4>, Dim> &upperBound,
+      const std::array<float, Dim> &queryLower,
+      const std::array<float, Dim> &queryUpper,
+      bool touchIsOverlap)
+  {
+    uint32x4_t hit = vdupq_n_u32(~0u);
+    for (unsigned int d = 0; d < Dim; d++) {
+      float32x4_t lo = vld1q_f32(lowerBound[d].data());
+      float32x4_t hi = vld1q_f32(upperBound[d].data());
+      float32x4_t ql = vdupq_n_f32(queryLower[d]);
+      float32x4_t qh = vdupq_n_f32(queryUpper[d]);
+      if (touchIsOverlap)
+        hit = vandq_u32(hit, vandq_u32(vcleq_f32(ql, hi), vcgeq_f32(qh, lo)));
+      else
+        hit = vandq_u32(hit, vandq_u32(vcltq_f32(ql, hi), vcgtq_f32(qh, lo)));
+    }
+
+    const uint32x4_t bits = {1, 2, 4, 8};
+    return vaddvq_u32(vandq_u32(hit, bits));
+  }
+};
+#endif
+}  // namespace detail
+
+/*! \brief A read-only wide BVH collapsed from a binary tree.
+
+    Every node holds up to Width children whose bounds are stored axis by
+    axis, so a query tests all of them with one vector comparison per axis
+    and only descends into the lanes that hit. The tree is a snapshot: it
+    reports the node ids of the tree it was made from, but does not follow
+    later changes to it.
+ */
+template <unsigned Dim, typename ValTy = double, unsigned Width = 4>
+class wide_tree {
+  static_assert(Width >= 2 && Width <= 16, "Width must be between 2 and 16");
+
+ public:
+  using value_type = ValTy;
+  using tree_type = tree<Dim, ValTy>;
+  using aabb = typename tree_type::aabb;
+  using point = typename tree_type::point;
+  using node_id = typename tree_type::node_id;
+  using ray = typename tree_type::ray;
+  template <typename Ty>
+  using vec = std::array<Ty, Dim>;
+
+  /// Constructor (empty).
+  wide_tree() = default;
+
+  //! Constructor.
+  /*! \param t
+          The binary tree to collapse.
+   */
+  explicit wide_tree(const tree_type &t)
+      : m_bounds(t.periodic_bounds())
+  {
+    if (t.m_root == tree_type::NULL_NODE)
+      return;
+
+    m_nodes.reserve(2 * t.size() / (Width - 1) + 1);
+    m_boxes.reserve(t.size());
+    m_ids.reserve(t.size());
+    collapse(t, t.m_root);
+  }
+
+  /// Return the number of entries in the tree.
+  unsigned int size() const { return m_ids.size(); }
+
+  /// Return the number of wide nodes.
+  unsigned int node_count() const { return m_nodes.size(); }
+
+  //! Query the tree to find candidate interactions for an AABB.
+  /*! \param query
+          The AABB or point.
+
+      \param include_touch
+          Does touching constitute an overlap?
+
+      \param bounds
+          The periodic box, zero along non-periodic axes.
+
+      \return
+          The ids of the overlapping entries.
+   */
+  template <class Query>
+  std::vector<node_id> get_overlaps(const Query &query,
+                                    bool include_touch = true,
+                                    const vec<ValTy> &bounds = {}) const
+  {
+    std::vector<node_id> overlaps;
+    visit_overlaps(
+        query, [&](node_id id) { overlaps.push_back(id); }, include_touch, bounds);
+    return overlaps;
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch = true,
+                      const vec<ValTy> &bounds = {}) const
+  {
+    static thread_local std::vector<unsigned int> stack(64);
+    return visit_overlaps(query, std::forward<Fn>(fn), include_touch, bounds, stack);
+  }
+
+  template <class Query, class Fn>
+  void visit_overlaps(const Query &query,
+                      Fn &&fn,
+                      bool include_touch,
+                      const vec<ValTy> &bounds,
+                      std::vector<unsigned> &stack) const
+  {
+    constexpr bool query_is_point = std::is_same_v<Query, point>;
+    constexpr bool query_is_aabb = std::is_same_v<Query, aabb>;
+    static_assert(query_is_point || query_is_aabb,
+                  "Only point or aabb queries are supported");
+
+    using rt = decltype(detail::call_with_args(std::forward<Fn>(fn), node_id{}, aabb{}));
+    constexpr bool fn_returns_action = std::is_convertible_v<rt, visit_action>;
+    static_assert(fn_returns_action || std::is_same_v<rt, void>,
+                  "Only void or visit_action return types are allowed");
+
+    if (m_nodes.empty())
+      return;
+
+    // Walk the tree for one image of the query, reporting whether to stop.
+    // An entry an earlier image reached is skipped.
+    auto walk = [&](const Query &image, std::span<const Query> earlier) {
+      // A point is the degenerate box with both corners on it.
+      vec<ValTy> queryLower, queryUpper;
+      if constexpr (query_is_point) {
+        queryLower = queryUpper = image.values;
+      }
+      else {
+        queryLower = image.lowerBound.values;
+        queryUpper = image.upperBound.values;
+      }
+
+      stack.clear();
+      stack.push_back(0);
+
+      while (!stack.empty()) {
+        const auto &n = m_nodes[stack.back()];
+        stack.pop_back();
+
+        unsigned int mask = detail::wide_kernel<ValTy, Width>::template overlap_mask<Dim>(
+            n.lowerBound, n.upperBound, queryLower, queryUpper, include_touch);
+        mask &= (1u << n.count) - 1;
+
+        for (; mask != 0; mask &= mask - 1) {
+          unsigned int child = n.child[std::countr_zero(mask)];
+          if (!(child & LEAF_FLAG)) {
+            stack.push_back(child);
+            continue;
+          }
+
+          auto leaf = child & ~LEAF_FLAG;
+          const auto &bb = m_boxes[leaf];
+          if (tree_type::reached_before(bb.lowerBound.values, bb.upperBound.values,
+                                        earlier, include_touch))
+            continue;
+          if constexpr (fn_returns_action) {
+            if (detail::call_with_args(std::forward<Fn>(fn), m_ids[leaf], bb) ==
+                visit_stop)
+              return true;
+          }
+          else {
+            detail::call_with_args(std::forward<Fn>(fn), m_ids[leaf], bb);
+          }
+        }
+      }
+      return false;
+    };
+
+    // Periodic queries are split into their images once, as tree does.
+    const auto &period = bounds == vec<ValTy>{} ? m_bounds : bounds;
+    tree_type::visit_images(query, root_box(), period, walk);
+  }
+
+  //! Visit the entries whose AABBs a ray passes through, front to back.
+  /*! As tree::visit_ray, with all the lanes of a node slab-tested together.
+   */
+  template <class Fn>
+  void visit_ray(const ray &r,
+                 Fn &&fn,
+                 double tMax = std::numeric_limits<double>::infinity(),
+                 const vec<ValTy> &bounds = {}) const
+  {
+    constexpr bool call_with_bb = std::is_invocable_v<Fn, node_id, const aabb &, double>;
+    using rt = typename std::conditional_t<
+        call_with_bb, std::invoke_result<Fn, node_id, const aabb &, double>,
+        std::invoke_result<Fn, node_id, double>>::type;
+    static_assert(std::is_same_v<rt, void> || std::is_same_v<rt, visit_action> ||
+                      std::is_floating_point_v<rt>,
+                  "Only void, visit_action or new tMax return types are allowed");
+
+    if (m_nodes.empty())
+      return;
+
+    static thread_local std::vector<std::pair<unsigned int, double>> stack(64);
+    const auto &period = bounds == vec<ValTy>{} ? m_bounds : bounds;
+    const aabb root = root_box();
+    auto images = detail::ray_images(r, root.lowerBound.values, root.upperBound.values,
+                                     tMax, period);
+    for (const auto &[tRoot, image] : images) {
+      if (tRoot > tMax)
+        break;
+
+      stack.clear();
+      stack.emplace_back(0, tRoot);
+      while (!stack.empty()) {
+        auto [child, tEnter] = stack.back();
+        stack.pop_back();
+        if (tEnter > tMax)
+          continue;
+
+        if (child & LEAF_FLAG) {
+          unsigned int leaf = child & ~LEAF_FLAG;
+          if constexpr (std::is_same_v<rt, void>) {
+            if constexpr (call_with_bb)
+              fn(m_ids[leaf], m_boxes[leaf], tEnter);
+            else
+              fn(m_ids[leaf], tEnter);
+          }
+          else {
+            rt result;
+            if constexpr (call_with_bb)
+              result = fn(m_ids[leaf], m_boxes[leaf], tEnter);
+            else
+              result = fn(m_ids[leaf], tEnter);
+
+            if constexpr (std::is_same_v<rt, visit_action>) {
+              if (result == visit_stop)
+                return;
+            }
+            else {
+              tMax = std::min<double>(tMax, result);
+            }
+          }
+          continue;
+        }
+
+        const auto &n = m_nodes[child];
+        std::array<double, Width> t;
+        unsigned int mask = ray_mask(n, image, tMax, t) & ((1u << n.count) - 1);
+
+        // Push the hits far to near so that the nearest is visited first.
+        // There are at most Width, so an insertion sort as they come in.
+        std::array<unsigned int, Width> order;
+        unsigned int hits = 0;
+        for (; mask != 0; mask &= mask - 1) {
+          unsigned int lane = std::countr_zero(mask), h = hits++;
+          for (; h > 0 && t[order[h - 1]] < t[lane]; h--)
+            order[h] = order[h - 1];
+          order[h] = lane;
+        }
+        for (unsigned int h = 0; h < hits; h++)
+          stack.emplace_back(n.child[order[h]], t[order[h]]);
+      }
+    }
+  }
+
+  //! Find the first entry whose AABB a ray hits.
+  std::optional<std::pair<node_id, double>> cast_ray(
+      const ray &r,
+      double tMax = std::numeric_limits<double>::infinity(),
+      const vec<ValTy> &bounds = {}) const
+  {
+    std::optional<std::pair<node_id, double>> closest;
+    visit_ray(
+        r,
+        [&](node_id id, double t) {
+          if (!closest || t < closest->second)
+            closest.emplace(id, t);
+          return t;
+        },
+        tMax, bounds);
+    return closest;
+  }
+
+ private:
+  /// Set in a child reference when the child is a leaf.
+  static constexpr unsigned int LEAF_FLAG = 0x80000000;
+
+  /// A node with up to Width children, bounds stored [axis][lane].
+  struct alignas(64) node {
+    std::array<std::array<ValTy, Width>, Dim> lowerBound = {};
+    std::array<std::array<ValTy, Width>, Dim> upperBound = {};
+    std::array<unsigned int, Width> child = {};
+    unsigned int count = 0;
+  };
+
+  //! Collapse the binary subtree below a node into wide nodes.
+  /*! Children are opened greedily, largest surface area first, until the
+      node is full or only leaves remain.
+
+      \return
+          The index of the wide node.
+   */
+  unsigned int collapse(const tree_type &t, unsigned int root)
+  {
+    const auto &nodes = t.m_nodes;
+    std::array<unsigned int, Width> children;
+    unsigned int count = 0;
+
+    if (nodes[root].isLeaf()) {
+      children[count++] = root;
+    }
+    else {
+      children[count++] = nodes[root].left;
+      children[count++] = nodes[root].right;
+    }
+
+    while (count < Width) {
+      unsigned int best = Width;
+      for (unsigned int c = 0; c < count; c++) {
+        const auto &n = nodes[children[c]];
+        if (!n.isLeaf() && (best == Width || n.bb.surfaceArea >
+                                                 nodes[children[best]].bb.surfaceArea))
+          best = c;
+      }
+      if (best == Width)
+        break;
+
+      unsigned int opened = children[best];
+      children[best] = nodes[opened].left;
+      children[count++] = nodes[opened].right;
+    }
+
+    unsigned int index = m_nodes.size();
+    m_nodes.emplace_back();
+    m_nodes[index].count = count;
+
+    for (unsigned int c = 0; c < count; c++) {
+      const auto &bb = nodes[children[c]].bb;
+      for (unsigned int d = 0; d < Dim; d++) {
+        m_nodes[index].lowerBound[d][c] = bb.lowerBound[d];
+        m_nodes[index].upperBound[d][c] = bb.upperBound[d];
+      }
+
+      unsigned int child;
+      if (nodes[children[c]].isLeaf()) {
+        child = m_ids.size() | LEAF_FLAG;
+        m_boxes.push_back(bb);
+        m_ids.push_back(t.to_id(children[c]));
+      }
+      else {
+        child = collapse(t, children[c]);
+      }
+      m_nodes[index].child[c] = child;
+    }
+    return index;
+  }
+
+  //! Slab-test a ray against every lane of a node.
+  /*! Written lane-wise without branches so that the compiler can
+      vectorise it; ray tests are far less common than overlap tests, so
+      they have no hand-written kernels.
+
+      \param tEnter
+          Set to where the ray enters each lane.
+
+      \return
+          The mask of the lanes the ray hits up to tMax.
+   */
+  static unsigned int ray_mask(const node &n,
+                               const ray &r,
+                               double tMax,
+                               std::array<double, Width> &tEnter)
+  {
+    std::array<double, Width> tNear, tFar;
+    tNear.fill(0);
+    tFar.fill(tMax);
+    for (unsigned int d = 0; d < Dim; d++) {
+      const double origin = r.origin[d], inverse = r.inverse[d];
+      const bool parallel = r.direction[d] == 0;
+      for (unsigned int l = 0; l < Width; l++) {
+        double t1 = (n.lowerBound[d][l] - origin) * inverse;
+        double t2 = (n.upperBound[d][l] - origin) * inverse;
+        if (parallel) {
+          // Inside the slab along this axis for all t, or for none.
+          bool inside = origin >= n.lowerBound[d][l] && origin <= n.upperBound[d][l];
+          t1 = inside ? 0 : std::numeric_limits<double>::infinity();
+          t2 = inside ? tMax : std::numeric_limits<double>::infinity();
+        }
+        tNear[l] = std::max(tNear[l], std::min(t1, t2));
+        tFar[l] = std::min(tFar[l], std::max(t1, t2));
+      }
+    }
+
+    unsigned int mask = 0;
+    for (unsigned int l = 0; l < Width; l++)
+      mask |= unsigned(tNear[l] <= tFar[l]) << l;
+    tEnter = tNear;
+    return mask;
+  }
+
+  //! The bounds of the root, for the periodic images of a query.
+  aabb root_box() const
+  {
+    point lower, upper;
+    const auto &root = m_nodes[0];
+    for (unsigned int d = 0; d < Dim; d++) {
+      lower[d] = *std::min_element(root.lowerBound[d].begin(),
+                                   root.lowerBound[d].begin() + root.count);
+      upper[d] = *std::max_element(root.upperBound[d].begin(),
+                                   root.upperBound[d].begin() + root.count);
+    }
+    return {lower, upper};
+  }
+
+  /// The wide nodes, the root first.
+  std::vector<node> m_nodes;
+
+  /// The AABBs of the leaves.
+  std::vector<aabb> m_boxes;
+
+  /// The ids of the leaves in the source tree.
+  std::vector<node_id> m_ids;
+
+  /// The periodic box of the source tree.
+  vec<ValTy> m_bounds = {};
+};
+
+// Utility typedefs
+#define TYPEDEFS(suffix, dim, type) \
+  using wide_tree##suffix = wide_tree<dim, type>
+
+TYPEDEFS(2d, 2, double);
+TYPEDEFS(2f, 2, float);
+TYPEDEFS(2i, 2, int);
+TYPEDEFS(3d, 3, double);
+TYPEDEFS(3f, 3, float);
+TYPEDEFS(3i, 3, int);
+
+#undef TYPEDEFS
+
+}  // namespace abt
+
+#endif /* _ABT_WIDE_TREE_H */
@@ -1,6 +1,20 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 #include <abt/aabb_tree.hpp>
+#include <abt/device_tree.hpp>
+#include <abt/forest.hpp>
+#include <abt/hybrid_index.hpp>
+#include <abt/quantized_tree.hpp>
+#include <abt/static_tree.hpp>
+#include <abt/tree_view.hpp>
+#include <abt/wide_tree.hpp>
+
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <utility>
 
 using namespace abt;
 TEST_CASE("point")
@@ -155,3 +169,1857 @@ TEST_CASE_TEMPLATE("optimal tree 2d", T, double, float, int, short)
   t.insert({{2, 2}, {4, 4}});
   REQUIRE(t.size() == 1);
 }
+
+TEST_CASE_TEMPLATE("bulk build 3d", T, double, float, int)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> pos(0, 100), size(1, 5);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 500; i++) {
+    int x = pos(rng), y = pos(rng), z = pos(rng);
+    bbs.push_back({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}});
+  }
+
+  auto brute_force = [&](const aabb &query) {
+    unsigned int count = 0;
+    for (const auto &bb : bbs)
+      count += bb.overlaps(query, true);
+    return count;
+  };
+
+  for (auto strategy : {build_strategy::binned_sah, build_strategy::lbvh,
+                        build_strategy::ploc}) {
+    tree t(bbs, strategy);
+    REQUIRE(t.size() == bbs.size());
+    t.validate();
+    for (unsigned int i = 0; i < bbs.size(); i += 25) {
+      REQUIRE(t.get_overlaps(bbs[i]).size() == brute_force(bbs[i]));
+    }
+
+    t.rebuild(strategy);
+    REQUIRE(t.size() == bbs.size());
+    for (unsigned int i = 0; i < bbs.size(); i += 25) {
+      REQUIRE(t.get_overlaps(bbs[i]).size() == brute_force(bbs[i]));
+    }
+  }
+
+  tree empty(std::vector<aabb>{});
+  REQUIRE(empty.size() == 0);
+  REQUIRE(empty.get_height() == 0);
+  empty.insert(bbs[0]);
+  REQUIRE(empty.size() == 1);
+}
+
+TEST_CASE_TEMPLATE("parallel bulk build 2d", T, double, float)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<T> pos(0, 1000), size(0.1, 2);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 50000; i++) {
+    T x = pos(rng), y = pos(rng);
+    bbs.push_back({{x, y}, {x + size(rng), y + size(rng)}});
+  }
+
+  tree serial(bbs);
+  for (auto strategy : {build_strategy::binned_sah, build_strategy::lbvh,
+                        build_strategy::ploc}) {
+    tree t(bbs, build_options{.strategy = strategy, .threads = 4});
+    REQUIRE(t.size() == bbs.size());
+    t.validate();
+    for (unsigned int i = 0; i < bbs.size(); i += 2500) {
+      REQUIRE(t.get_overlaps(bbs[i]).size() ==
+              serial.get_overlaps(bbs[i]).size());
+    }
+
+    t.rebuild({.strategy = strategy, .threads = 3});
+    t.validate();
+    REQUIRE(t.size() == bbs.size());
+    for (unsigned int i = 0; i < bbs.size(); i += 2500) {
+      REQUIRE(t.get_overlaps(bbs[i]).size() ==
+              serial.get_overlaps(bbs[i]).size());
+    }
+  }
+}
+
+TEST_CASE_TEMPLATE("incremental updates 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<int> pos(0, 200), size(1, 10);
+  auto random_box = [&]() -> aabb {
+    int x = pos(rng), y = pos(rng);
+    return {{x, y}, {x + size(rng), y + size(rng)}};
+  };
+
+  tree t;
+  std::vector<node_id> ids;
+  for (int i = 0; i < 300; i++)
+    ids.push_back(t.insert(random_box()));
+
+  auto brute_force = [&](const auto &query) {
+    unsigned int count = 0;
+    for (auto id : ids)
+      count += t.get_aabb(id).overlaps(query, true);
+    return count;
+  };
+
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 50; i++) {
+      auto j = rng() % ids.size();
+      t.update(ids[j], random_box());
+    }
+    for (int i = 0; i < 10; i++) {
+      auto j = rng() % ids.size();
+      t.remove(ids[j]);
+      ids.erase(ids.begin() + j);
+      ids.push_back(t.insert(random_box()));
+    }
+    t.validate();
+    REQUIRE(t.size() == ids.size());
+
+    auto query = random_box();
+    REQUIRE(t.get_overlaps(query).size() == brute_force(query));
+    REQUIRE(t.get_overlaps(query.lowerBound).size() ==
+            brute_force(query.lowerBound));
+  }
+}
+
+TEST_CASE_TEMPLATE("wide tree 3d", T, double, float, int)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+  using point = tree::point;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<int> pos(0, 100), size(1, 8);
+  tree t;
+  for (int i = 0; i < 2000; i++) {
+    int x = pos(rng), y = pos(rng), z = pos(rng);
+    t.insert({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}});
+  }
+
+  auto sorted = [](std::vector<node_id> ids) {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+
+  auto check = [&](const auto &wide) {
+    REQUIRE(wide.size() == t.size());
+    for (int i = 0; i < 50; i++) {
+      int x = pos(rng), y = pos(rng), z = pos(rng);
+      aabb query{{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}};
+      for (bool touch : {true, false}) {
+        REQUIRE(sorted(wide.get_overlaps(query, touch)) ==
+                sorted(t.get_overlaps(query, touch)));
+        REQUIRE(sorted(wide.get_overlaps(query.lowerBound, touch)) ==
+                sorted(t.get_overlaps(query.lowerBound, touch)));
+      }
+    }
+
+    unsigned int count = 0;
+    wide.visit_overlaps(point{50, 50, 50}, [&] {
+      count++;
+      return visit_stop;
+    });
+    REQUIRE(count <= 1);
+  };
+
+  check(wide_tree<3, T, 4>(t));
+  check(wide_tree<3, T, 8>(t));
+  REQUIRE(wide_tree<3, T, 8>(t).node_count() < wide_tree<3, T, 4>(t).node_count());
+  REQUIRE(wide_tree<3, T>(tree{}).size() == 0);
+  REQUIRE(wide_tree<3, T>(tree{}).get_overlaps(point{0, 0, 0}).empty());
+
+  // Entries near the edges of a periodic box.
+  std::array<T, 3> bounds = {10, 10, 10};
+  tree periodic;
+  periodic.insert({{0, 0, 0}, {2, 2, 2}});
+  periodic.insert({{1, 1, 1}, {3, 3, 3}});
+  periodic.insert({{5, 5, 5}, {7, 7, 7}});
+  wide_tree<3, T> wide(periodic);
+  for (auto query : {point{10, 1, 1}, point{11, 11, 1}, point{-1, 6, 6}}) {
+    REQUIRE(sorted(wide.get_overlaps(query, true, bounds)) ==
+            sorted(periodic.get_overlaps(query, true, bounds)));
+  }
+  REQUIRE(wide.get_overlaps(point{11, 11, 1}, true, bounds).size() == 2);
+}
+
+TEST_CASE_TEMPLATE("batched queries 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using point = tree::point;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(5);
+  std::uniform_int_distribution<int> pos(0, 100), size(1, 6);
+  auto random_box = [&]() -> aabb {
+    int x = pos(rng), y = pos(rng);
+    return {{x, y}, {x + size(rng), y + size(rng)}};
+  };
+
+  tree t;
+  for (int i = 0; i < 1000; i++)
+    t.insert(random_box());
+
+  std::vector<aabb> boxes;
+  std::vector<point> points;
+  for (int i = 0; i < 300; i++) {
+    boxes.push_back(random_box());
+    points.push_back(boxes.back().upperBound);
+  }
+
+  std::array<T, 2> bounds = {100, 100};
+  std::vector<std::pair<std::size_t, node_id>> pairs;
+  for (bool touch : {true, false}) {
+    t.get_overlaps_batch(boxes, pairs, touch, bounds);
+    std::vector<std::vector<node_id>> found(boxes.size());
+    for (auto [q, id] : pairs)
+      found[q].push_back(id);
+    for (std::size_t q = 0; q < boxes.size(); q++) {
+      auto expected = t.get_overlaps(boxes[q], touch, bounds);
+      std::sort(expected.begin(), expected.end());
+      std::sort(found[q].begin(), found[q].end());
+      REQUIRE(found[q] == expected);
+    }
+
+    t.get_overlaps_batch(points, pairs, touch);
+    std::size_t count = 0;
+    for (const auto &pt : points)
+      count += t.get_overlaps(pt, touch).size();
+    REQUIRE(pairs.size() == count);
+  }
+
+  // Stopping one query leaves the others running.
+  std::vector<unsigned int> hits(boxes.size());
+  t.visit_overlaps_batch(std::span<const aabb>(boxes),
+                         [&](std::size_t q, node_id, const aabb &) {
+                           hits[q]++;
+                           return q % 2 ? visit_stop : visit_continue;
+                         });
+  for (std::size_t q = 0; q < boxes.size(); q++) {
+    auto expected = t.get_overlaps(boxes[q]).size();
+    REQUIRE(hits[q] == (q % 2 ? std::min<std::size_t>(expected, 1) : expected));
+  }
+}
+
+TEST_CASE_TEMPLATE("pair overlaps 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+  using pair = std::pair<node_id, node_id>;
+
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<double> pos(0, 100), size(1, 6);
+  auto random_box = [&]() -> aabb {
+    T x = pos(rng), y = pos(rng);
+    return {{x, y}, {T(x + size(rng)), T(y + size(rng))}};
+  };
+
+  tree small, large;
+  std::vector<node_id> smallIds, largeIds;
+  for (int i = 0; i < 400; i++)
+    smallIds.push_back(small.insert(random_box()));
+  for (int i = 0; i < 200; i++)
+    largeIds.push_back(large.insert(random_box()));
+
+  std::array<T, 2> bounds = {100, 100};
+  std::vector<std::array<T, 2>> periods = {{}};
+  if constexpr (std::is_floating_point_v<T>)
+    periods.push_back(bounds);
+
+  for (const auto &period : periods) {
+    // The minimum image of the second box, seen from the first.
+    auto overlap = [&](const aabb &bb1, const aabb &bb2) {
+      auto shifted = bb1;
+      for (unsigned int d = 0; d < 2; d++) {
+        T delta = bb2.centre[d] - bb1.centre[d];
+        T shift = 0;
+        if (delta < -(period[d] / 2))
+          shift = -period[d];
+        else if (delta >= period[d] / 2)
+          shift = period[d];
+        shifted.lowerBound[d] += shift;
+        shifted.upperBound[d] += shift;
+      }
+      return bb2.overlaps(shifted, true);
+    };
+
+    std::vector<pair> expected, found;
+    for (std::size_t i = 0; i < smallIds.size(); i++)
+      for (std::size_t j = i + 1; j < smallIds.size(); j++)
+        if (overlap(small.get_aabb(smallIds[i]), small.get_aabb(smallIds[j])))
+          expected.emplace_back(std::min(smallIds[i], smallIds[j]),
+                                std::max(smallIds[i], smallIds[j]));
+    small.visit_self_overlaps(
+        [&](node_id id1, node_id id2) {
+          found.emplace_back(std::min(id1, id2), std::max(id1, id2));
+        },
+        true, period);
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    REQUIRE(!expected.empty());
+    REQUIRE(found == expected);
+
+    expected.clear();
+    found.clear();
+    for (auto id1 : smallIds)
+      for (auto id2 : largeIds)
+        if (overlap(small.get_aabb(id1), large.get_aabb(id2)))
+          expected.emplace_back(id1, id2);
+    small.visit_overlaps(
+        large, [&](node_id id1, node_id id2) { found.emplace_back(id1, id2); },
+        true, period);
+    std::sort(expected.begin(), expected.end());
+    std::sort(found.begin(), found.end());
+    REQUIRE(found == expected);
+  }
+
+  unsigned int count = 0;
+  small.visit_self_overlaps([&](node_id, node_id) {
+    count++;
+    return visit_stop;
+  });
+  REQUIRE(count == 1);
+  REQUIRE(tree{}.size() == 0);
+  tree{}.visit_self_overlaps([](node_id, node_id) { REQUIRE(false); });
+}
+
+TEST_CASE_TEMPLATE("parallel queries 3d", T, double, float)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(13);
+  std::uniform_real_distribution<T> pos(0, 100), size(0.5, 2);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 20000; i++) {
+    T x = pos(rng), y = pos(rng), z = pos(rng);
+    bbs.push_back({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}});
+  }
+  tree t(bbs);
+
+  auto sorted = [](std::vector<node_id> ids) {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+
+  // One query covering most of the tree.
+  aabb big{{10, 10, 10}, {90, 90, 90}};
+  auto expected = sorted(t.get_overlaps(big));
+  for (unsigned int threads : {1u, 2u, 4u, 7u})
+    REQUIRE(sorted(t.get_overlaps_parallel(big, true, {}, threads)) == expected);
+
+  std::array<T, 3> bounds = {100, 100, 100};
+  aabb edge{{-5, -5, -5}, {5, 5, 5}};
+  REQUIRE(sorted(t.get_overlaps_parallel(edge, true, bounds, 4)) ==
+          sorted(t.get_overlaps(edge, true, bounds)));
+
+  std::atomic<unsigned int> count = 0;
+  t.visit_overlaps_parallel(
+      big,
+      [&](unsigned int, node_id) {
+        count++;
+        return visit_stop;
+      },
+      true, {}, 4);
+  REQUIRE(count >= 1);
+  REQUIRE(count < expected.size());
+
+  // Leaves reached while the top levels are opened stop the search too.
+  std::vector<aabb> row;
+  for (int i = 0; i < 64; i++)
+    row.push_back({{T(i), 0, 0}, {T(i + 1), 1, 1}});
+  tree few(row);
+  unsigned int calls = 0;
+  few.visit_overlaps_parallel(
+      aabb{{0, 0, 0}, {64, 1, 1}},
+      [&](unsigned int thread, node_id) {
+        REQUIRE(thread == 0);
+        calls++;
+        return visit_stop;
+      },
+      true, {}, 16);
+  REQUIRE(calls == 1);
+
+  // A parallel query started from a callback of another, while that one
+  // holds the workers, runs on threads of its own.
+  aabb small{{40, 40, 40}, {45, 45, 45}};
+  auto inner = t.get_overlaps(small).size();
+  std::atomic<std::size_t> nested = 0, outer = 0;
+  t.visit_overlaps_parallel(
+      small,
+      [&](unsigned int, node_id) {
+        outer++;
+        nested += t.get_overlaps_parallel(small, true, {}, 2).size();
+      },
+      true, {}, 3);
+  REQUIRE(outer == inner);
+  REQUIRE(nested == inner * inner);
+
+  // Batches split between threads give the same pairs.
+  std::vector<std::pair<std::size_t, node_id>> serial, parallel;
+  t.get_overlaps_batch(bbs, serial);
+  t.get_overlaps_batch(bbs, parallel, true, {}, 4);
+  std::sort(serial.begin(), serial.end());
+  std::sort(parallel.begin(), parallel.end());
+  REQUIRE(parallel == serial);
+}
+
+TEST_CASE("snapshot queries during updates")
+{
+  using tree = tree2d;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<double> pos(0, 100);
+  auto random_box = [&]() -> aabb {
+    double x = pos(rng), y = pos(rng);
+    return {{x, y}, {x + 1, y + 1}};
+  };
+
+  tree t;
+  std::vector<node_id> ids;
+  for (int i = 0; i < 2000; i++)
+    ids.push_back(t.insert(random_box()));
+
+  // Taking a snapshot keeps it in the tree, so a const tree cannot.
+  auto can_snapshot = [](auto &c) { return requires { c.snapshot(); }; };
+  REQUIRE(can_snapshot(t));
+  REQUIRE(!can_snapshot(std::as_const(t)));
+
+  auto first = t.snapshot();
+  REQUIRE(t.snapshot() == first);
+  t.update(ids[0], random_box(), true);
+  REQUIRE(t.snapshot() != first);
+  REQUIRE(first->size() == t.size());
+
+  std::atomic<std::shared_ptr<const tree>> published = t.snapshot();
+  std::atomic<bool> done = false;
+  std::atomic<unsigned int> checks = 0, failures = 0;
+
+  std::thread reader([&] {
+    while (!done || checks == 0) {
+      auto view = published.load();
+      // Every entry of a consistent tree finds at least itself.
+      view->for_each([&](node_id, const aabb &bb) {
+        failures += !view->any_overlap(bb);
+      });
+      view->validate();
+      checks++;
+    }
+  });
+
+  for (int step = 0; step < 50; step++) {
+    for (int i = 0; i < 100; i++)
+      t.update(ids[rng() % ids.size()], random_box(), true);
+    t.remove(ids.back());
+    ids.pop_back();
+    ids.push_back(t.insert(random_box()));
+    published = t.snapshot();
+  }
+  done = true;
+  reader.join();
+  REQUIRE(checks > 0);
+  REQUIRE(failures == 0);
+  REQUIRE(published.load()->size() == t.size());
+}
+
+TEST_CASE_TEMPLATE("batched updates 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(21);
+  std::uniform_int_distribution<int> pos(0, 300), size(1, 6), step(-3, 3);
+  tree t;
+  t.skin_width = 2;
+  std::vector<node_id> ids;
+  std::vector<aabb> current;
+  for (int i = 0; i < 2000; i++) {
+    int x = pos(rng), y = pos(rng);
+    current.push_back({{x, y}, {x + size(rng), y + size(rng)}});
+    ids.push_back(t.insert(current.back()));
+  }
+
+  auto brute_force = [&](const aabb &query) {
+    unsigned int count = 0;
+    for (auto id : ids)
+      count += t.get_aabb(id).overlaps(query, true);
+    return count;
+  };
+
+  for (double ratio : {1.0, 0.0}) {
+    for (int sweep = 0; sweep < 5; sweep++) {
+      std::vector<std::pair<node_id, aabb>> moves;
+      unsigned int escapes = 0;
+      for (std::size_t i = 0; i < ids.size(); i += 1 + rng() % 3) {
+        auto &bb = current[i];
+        T dx = step(rng), dy = step(rng);
+        bb = aabb{{T(bb.lowerBound[0] + dx), T(bb.lowerBound[1] + dy)},
+                  {T(bb.upperBound[0] + dx), T(bb.upperBound[1] + dy)}};
+        escapes += !t.get_aabb(ids[i]).contains(bb);
+        moves.emplace_back(ids[i], bb);
+      }
+
+      REQUIRE(t.update_batch(moves, ratio) == escapes);
+      REQUIRE(t.size() == ids.size());
+      t.validate();
+      for (std::size_t i = 0; i < ids.size(); i++)
+        REQUIRE(t.get_aabb(ids[i]).contains(current[i]));
+      for (int q = 0; q < 20; q++) {
+        int x = pos(rng), y = pos(rng);
+        aabb query{{x, y}, {x + 10, y + 10}};
+        REQUIRE(t.get_overlaps(query).size() == brute_force(query));
+      }
+    }
+  }
+}
+
+TEST_CASE_TEMPLATE("incremental optimisation 3d", T, double, float, int)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(23);
+  std::uniform_int_distribution<int> pos(0, 200), size(1, 6);
+  tree t;
+  std::vector<node_id> ids;
+  // Sorted insertion makes a poor tree to start from.
+  for (int x = 0; x < 200; x += 4) {
+    for (int i = 0; i < 20; i++) {
+      int y = pos(rng), z = pos(rng);
+      ids.push_back(t.insert({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}}));
+    }
+  }
+
+  auto brute_force = [&](const aabb &query) {
+    unsigned int count = 0;
+    for (auto id : ids)
+      count += t.get_aabb(id).overlaps(query, true);
+    return count;
+  };
+
+  REQUIRE(tree{}.optimize(10) == 0);
+  double cost = t.get_sah_cost();
+  unsigned int changed = 0;
+  for (int step = 0; step < 20; step++) {
+    changed += t.optimize(100);
+    t.validate();
+    REQUIRE(t.get_sah_cost() <= cost * (1 + 1e-9));
+    cost = t.get_sah_cost();
+  }
+  REQUIRE(changed > 0);
+  REQUIRE(t.size() == ids.size());
+  for (int q = 0; q < 20; q++) {
+    int x = pos(rng), y = pos(rng), z = pos(rng);
+    aabb query{{x, y, z}, {x + 10, y + 10, z + 10}};
+    REQUIRE(t.get_overlaps(query).size() == brute_force(query));
+  }
+}
+
+TEST_CASE("adaptive skin 2d")
+{
+  using tree = tree2d;
+  using aabb = tree::aabb;
+
+  tree t;
+  t.skin_width = 0.5;
+  auto small = t.insert({{0, 0}, {1, 1}});
+  REQUIRE(t.get_aabb(small) == aabb{{-0.5, -0.5}, {1.5, 1.5}});
+
+  // Relative skins scale with the size of each entry.
+  t.skin = skin_mode::relative;
+  auto large = t.insert({{0, 0}, {10, 4}});
+  REQUIRE(t.get_aabb(large) == aabb{{-5, -2}, {15, 6}});
+
+  // A displacement hint stretches the box along the motion.
+  t.skin = skin_mode::absolute;
+  t.update(small, {{0, 0}, {1, 1}}, {3, -2}, true);
+  REQUIRE(t.get_aabb(small) == aabb{{-0.5, -2.5}, {4.5, 1.5}});
+
+  // Entries that keep escaping get a wider skin and stop escaping.
+  t.adaptive_skin = true;
+  unsigned int reinserts = 0;
+  for (int step = 1; step <= 40; step++) {
+    double x = 0.4 * step;
+    reinserts += t.update(small, {{x, 0}, {x + 1, 1}});
+  }
+  REQUIRE(reinserts < 10);
+  REQUIRE(t.get_aabb(small).upperBound[0] - t.get_aabb(small).lowerBound[0] > 3);
+
+  // Static entries have their skin tightened again.
+  auto width = [&] { return t.get_aabb(small).upperBound[1] - t.get_aabb(small).lowerBound[1]; };
+  double wide = width();
+  for (int step = 0; step < 1000; step++)
+    t.update(small, {{16, 0}, {17, 1}});
+  REQUIRE(width() < wide);
+  REQUIRE(width() > 1);
+  t.validate();
+}
+
+TEST_CASE_TEMPLATE("ray queries 3d", T, double, float)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+  using ray = tree::ray;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(29);
+  std::uniform_real_distribution<T> pos(0, 100), size(0.5, 3);
+  std::uniform_real_distribution<double> dir(-1, 1);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 5000; i++) {
+    T x = pos(rng), y = pos(rng), z = pos(rng);
+    bbs.push_back({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}});
+  }
+  tree t(bbs);
+  wide_tree<3, T> w(t);
+
+  auto sorted = [](std::vector<node_id> ids) {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+  auto brute_force = [&](const ray &r, double tMax, const std::array<T, 3> &bounds = {}) {
+    std::vector<node_id> hits;
+    std::optional<double> first;
+    t.for_each([&](node_id id, const aabb &bb) {
+      for (int i = -2; i <= 2; i++)
+        for (int j = -2; j <= 2; j++)
+          for (int k = -2; k <= 2; k++) {
+            std::array<int, 3> shift = {i, j, k};
+            auto image = r;
+            bool skip = false;
+            for (int d = 0; d < 3; d++) {
+              skip |= bounds[d] == 0 && shift[d] != 0;
+              image.origin[d] -= shift[d] * double(bounds[d]);
+            }
+            double tEnter;
+            if (!skip && image.intersects(bb.lowerBound, bb.upperBound, tMax, tEnter)) {
+              hits.push_back(id);
+              if (!first || tEnter < *first)
+                first = tEnter;
+            }
+          }
+    });
+    return std::make_pair(sorted(hits), first);
+  };
+
+  for (int q = 0; q < 50; q++) {
+    typename tree::point origin{pos(rng), pos(rng), pos(rng)};
+    std::array<double, 3> direction = {dir(rng), dir(rng), dir(rng)};
+    // Every few rays run parallel to an axis.
+    if (q % 5 == 0)
+      direction[q % 3] = 0;
+    ray r(origin, direction);
+    double tMax = q % 2 ? 40.0 : std::numeric_limits<double>::infinity();
+    auto [expected, first] = brute_force(r, tMax);
+
+    std::vector<node_id> all, wideAll;
+    t.visit_ray(r, [&](node_id id, double) { all.push_back(id); }, tMax);
+    w.visit_ray(r, [&](node_id id, double) { wideAll.push_back(id); }, tMax);
+    REQUIRE(sorted(all) == expected);
+    REQUIRE(sorted(wideAll) == expected);
+
+    auto hit = t.cast_ray(r, tMax);
+    auto wideHit = w.cast_ray(r, tMax);
+    REQUIRE(hit.has_value() == first.has_value());
+    REQUIRE(wideHit.has_value() == first.has_value());
+    if (first) {
+      REQUIRE(std::abs(hit->second - *first) < 1e-9);
+      REQUIRE(std::abs(wideHit->second - *first) < 1e-9);
+    }
+  }
+
+  // Visits are front to back, and a segment stops at its end point.
+  auto segment = ray::segment({-10, 50, 50}, {110, 50, 50});
+  double last = 0;
+  bool ordered = true;
+  t.visit_ray(segment, [&](node_id, double tEnter) {
+    ordered &= tEnter >= last;
+    last = tEnter;
+  }, 1);
+  REQUIRE(ordered);
+  REQUIRE(t.cast_ray(ray::segment({-10, -10, -10}, {-5, -5, -5}), 1) == std::nullopt);
+
+  unsigned int count = 0;
+  t.visit_ray(segment, [&](node_id, double) {
+    count++;
+    return visit_stop;
+  }, 1);
+  REQUIRE(count <= 1);
+
+  // Periodic segments wrap around the box.
+  std::array<T, 3> bounds = {100, 100, 0};
+  for (int q = 0; q < 20; q++) {
+    typename tree::point a{pos(rng), pos(rng), pos(rng)};
+    typename tree::point b{T(a[0] + 80 * dir(rng)), T(a[1] + 80 * dir(rng)), a[2]};
+    auto r = ray::segment(a, b);
+    auto [expected, first] = brute_force(r, 1, bounds);
+    std::vector<node_id> all, wideAll;
+    t.visit_ray(r, [&](node_id id, double) { all.push_back(id); }, 1, bounds);
+    w.visit_ray(r, [&](node_id id, double) { wideAll.push_back(id); }, 1, bounds);
+    REQUIRE(sorted(all) == expected);
+    REQUIRE(sorted(wideAll) == expected);
+    auto hit = t.cast_ray(r, 1, bounds);
+    REQUIRE(hit.has_value() == first.has_value());
+    if (first)
+      REQUIRE(std::abs(hit->second - *first) < 1e-9);
+  }
+}
+
+TEST_CASE_TEMPLATE("nearest and radius queries 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using point = tree::point;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(31);
+  std::uniform_int_distribution<int> pos(0, 999), size(1, 8);
+  tree t;
+  for (int i = 0; i < 3000; i++) {
+    int x = pos(rng), y = pos(rng);
+    t.insert({{x, y}, {x + size(rng), y + size(rng)}});
+  }
+
+  // The distance to the nearest image of a box along each axis.
+  auto distance = [](const point &pt, const aabb &bb, const std::array<T, 2> &bounds) {
+    double sum = 0;
+    for (int d = 0; d < 2; d++) {
+      double best = std::numeric_limits<double>::infinity();
+      for (int k = -1; k <= 1; k++) {
+        if (k != 0 && bounds[d] == 0)
+          continue;
+        double x = double(pt[d]) + k * double(bounds[d]);
+        best = std::min(best, std::max({bb.lowerBound[d] - x, x - bb.upperBound[d], 0.0}));
+      }
+      sum += best * best;
+    }
+    return std::sqrt(sum);
+  };
+  auto brute_force = [&](const point &pt, const std::array<T, 2> &bounds = {}) {
+    std::vector<std::pair<double, node_id>> all;
+    t.for_each([&](node_id id, const aabb &bb) { all.emplace_back(distance(pt, bb, bounds), id); });
+    std::sort(all.begin(), all.end());
+    return all;
+  };
+
+  for (std::array<T, 2> bounds : {std::array<T, 2>{}, std::array<T, 2>{1000, 0},
+                                   std::array<T, 2>{1000, 1000}}) {
+    for (int q = 0; q < 20; q++) {
+      point pt{T(pos(rng)), T(pos(rng))};
+      auto expected = brute_force(pt, bounds);
+
+      auto found = t.nearest(pt, 10, bounds);
+      REQUIRE(found.size() == 10);
+      for (unsigned int i = 0; i < found.size(); i++)
+        REQUIRE(std::abs(found[i].second - expected[i].first) < 1e-6);
+      REQUIRE(std::is_sorted(found.begin(), found.end(),
+                             [](auto &a, auto &b) { return a.second < b.second; }));
+
+      double radius = 25;
+      std::vector<node_id> within, expectedWithin;
+      t.visit_within_radius(pt, radius, [&](node_id id) { within.push_back(id); }, bounds);
+      for (auto &[d, id] : expected)
+        if (d <= radius)
+          expectedWithin.push_back(id);
+      std::sort(within.begin(), within.end());
+      std::sort(expectedWithin.begin(), expectedWithin.end());
+      REQUIRE(within == expectedWithin);
+    }
+  }
+
+  // An exact distance to the centres refines the order.
+  point pt{500, 500};
+  auto centre_distance = [&](const aabb &bb) {
+    double dx = bb.centre[0] - 500.0, dy = bb.centre[1] - 500.0;
+    return std::sqrt(dx * dx + dy * dy);
+  };
+  auto found = t.nearest(pt, 5, centre_distance);
+  std::vector<double> centres;
+  t.for_each([&](const aabb &bb) { centres.push_back(centre_distance(bb)); });
+  std::sort(centres.begin(), centres.end());
+  REQUIRE(found.size() == 5);
+  for (unsigned int i = 0; i < found.size(); i++)
+    REQUIRE(std::abs(found[i].second - centres[i]) < 1e-9);
+
+  REQUIRE(t.nearest(pt, 5000).size() == t.size());
+  REQUIRE(tree{}.nearest(pt, 3).empty());
+}
+
+TEST_CASE_TEMPLATE("periodic construction 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using point = tree::point;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(37);
+  std::uniform_int_distribution<int> pos(0, 99), size(1, 6), query(-10, 105);
+
+  for (std::array<T, 2> bounds : {std::array<T, 2>{100, 100}, std::array<T, 2>{100, 0}}) {
+    tree t(bounds);
+    t.skin_width = 0;
+    REQUIRE(t.periodic_bounds() == bounds);
+    for (int i = 0; i < 500; i++) {
+      int x = pos(rng), y = pos(rng);
+      t.insert({{x, y}, {x + size(rng), y + size(rng)}});
+    }
+    wide_tree<2, T> w(t);
+
+    auto sorted = [](std::vector<node_id> ids) {
+      std::sort(ids.begin(), ids.end());
+      return ids;
+    };
+    auto brute_force = [&](const aabb &q) {
+      std::vector<node_id> ids;
+      t.for_each([&](node_id id, const aabb &bb) {
+        bool hit = true;
+        for (int d = 0; d < 2; d++) {
+          bool axis = false;
+          for (int k = -1; k <= 1; k++) {
+            if (k != 0 && bounds[d] == 0)
+              continue;
+            int shift = k * bounds[d];
+            axis |= q.lowerBound[d] + shift <= bb.upperBound[d] &&
+                    q.upperBound[d] + shift >= bb.lowerBound[d];
+          }
+          hit &= axis;
+        }
+        if (hit)
+          ids.push_back(id);
+      });
+      return ids;
+    };
+
+    std::vector<aabb> queries;
+    for (int q = 0; q < 50; q++) {
+      int x = query(rng), y = query(rng);
+      queries.push_back({{x, y}, {x + size(rng), y + size(rng)}});
+    }
+    for (const auto &q : queries) {
+      auto expected = brute_force(q);
+      // Queries wrap around the tree's own box without being told.
+      REQUIRE(sorted(t.get_overlaps(q)) == expected);
+      REQUIRE(sorted(t.get_overlaps(q, true, bounds)) == expected);
+      REQUIRE(sorted(w.get_overlaps(q)) == expected);
+      REQUIRE(sorted(t.get_overlaps_parallel(q, true, {}, 2)) == expected);
+    }
+
+    std::vector<std::pair<std::size_t, node_id>> pairs;
+    t.get_overlaps_batch(queries, pairs);
+    std::size_t total = 0;
+    for (const auto &q : queries)
+      total += brute_force(q).size();
+    REQUIRE(pairs.size() == total);
+
+    // A point on the far edge is the same as one on the near edge.
+    REQUIRE(sorted(t.get_overlaps(point{100, 50})) == sorted(t.get_overlaps(point{0, 50})));
+  }
+
+  // A leaf reached by two images of a query wider than half the period is
+  // reported once, whether it is the root or deeper in the tree.
+  tree p({10, 10});
+  p.skin_width = 0;
+  auto across = p.insert({{8, 1}, {12, 2}});
+  aabb wide = {{1, 1}, {9, 9}};
+  REQUIRE(p.get_overlaps(wide) == std::vector<node_id>{across});
+  auto inside = p.insert({{3, 3}, {4, 4}});
+  std::vector<node_id> both = {across, inside};
+  std::sort(both.begin(), both.end());
+  auto found = p.get_overlaps(wide);
+  std::sort(found.begin(), found.end());
+  REQUIRE(found == both);
+  unsigned int visits = 0;
+  p.any_overlap(wide, [&] {
+    visits++;
+    return false;
+  });
+  REQUIRE(visits == 2);
+}
+
+TEST_CASE_TEMPLATE("distant periodic queries 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using point = tree::point;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(43);
+  std::uniform_int_distribution<int> pos(0, 39), size(1, 4), periods(-3, 3);
+  std::array<T, 2> bounds = {40, 40};
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 300; i++) {
+    int x = pos(rng), y = pos(rng);
+    bbs.push_back({{x, y}, {x + size(rng), y + size(rng)}});
+  }
+  tree t(bounds, bbs);
+  static_tree<2, T> frozen(bounds, bbs);
+  wide_tree<2, T> w(t);
+  quantized_tree<2, T, 16> q16(t);
+
+  auto sorted = [](std::vector<node_id> ids) {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+  auto brute_force = [&](const aabb &q) {
+    std::vector<node_id> ids;
+    t.for_each([&](node_id id, const aabb &bb) {
+      bool hit = true;
+      for (int d = 0; d < 2; d++) {
+        bool axis = false;
+        for (int k = -5; k <= 5; k++)
+          axis |= q.lowerBound[d] + k * bounds[d] <= bb.upperBound[d] &&
+                  q.upperBound[d] + k * bounds[d] >= bb.lowerBound[d];
+        hit &= axis;
+      }
+      if (hit)
+        ids.push_back(id);
+    });
+    return ids;
+  };
+
+  // Queries moved two or more periods away along some axis, some of them
+  // wider than the box.
+  std::vector<aabb> queries;
+  for (int i = 0; i < 60; i++) {
+    int x = pos(rng), y = pos(rng), dx = periods(rng), dy = periods(rng);
+    if (std::abs(dx) < 2 && std::abs(dy) < 2)
+      dx = dx < 0 ? -2 : 2;
+    int wx = i % 10 == 0 ? 45 : size(rng), wy = size(rng);
+    x += dx * bounds[0];
+    y += dy * bounds[1];
+    queries.push_back({{x, y}, {x + wx, y + wy}});
+  }
+
+  std::size_t total = 0;
+  for (const auto &q : queries) {
+    auto expected = brute_force(q);
+    total += expected.size();
+    REQUIRE(sorted(t.get_overlaps(q)) == expected);
+    REQUIRE(sorted(t.get_overlaps_parallel(q, true, {}, 3)) == expected);
+    REQUIRE(sorted(frozen.get_overlaps(q)) == expected);
+    REQUIRE(sorted(w.get_overlaps(q)) == expected);
+    REQUIRE(sorted(q16.get_overlaps(q)) == expected);
+  }
+
+  std::vector<std::pair<std::size_t, node_id>> pairs;
+  for (unsigned int threads : {1u, 3u}) {
+    t.get_overlaps_batch(queries, pairs, true, {}, threads);
+    REQUIRE(pairs.size() == total);
+    for (std::size_t i = 0; i < queries.size(); i++) {
+      std::vector<node_id> ids;
+      for (const auto &[q, id] : pairs) {
+        if (q == i)
+          ids.push_back(id);
+      }
+      REQUIRE(sorted(ids) == brute_force(queries[i]));
+    }
+  }
+
+  // A second tree moved by whole periods pairs up as the unmoved one does.
+  std::vector<aabb> moved;
+  for (const auto &bb : bbs)
+    moved.push_back(bb + std::array<T, 2>{T(2 * bounds[0]), T(-3 * bounds[1])});
+  tree near(bounds, bbs), far(bounds, moved);
+  std::size_t nearPairs = 0, farPairs = 0;
+  t.visit_overlaps(near, [&](node_id, node_id) { nearPairs++; });
+  t.visit_overlaps(far, [&](node_id, node_id) { farPairs++; });
+  REQUIRE(farPairs == nearPairs);
+
+  // Nearest entries are found from any image of the point.
+  auto nearest = t.nearest(point{13, 27}, 5);
+  auto distant = t.nearest(point{13 - 3 * bounds[0], 27 + 2 * bounds[1]}, 5);
+  REQUIRE(distant.size() == nearest.size());
+  for (std::size_t i = 0; i < nearest.size(); i++)
+    REQUIRE(std::abs(distant[i].second - nearest[i].second) < 1e-3);
+}
+
+TEST_CASE("surface area kernels")
+{
+  // Closed forms for 2d and 3d agree with the general formula in 4d.
+  REQUIRE(aabb2d{{0, 0}, {2, 3}}.get_surface_area() == 10);
+  REQUIRE(aabb3d{{0, 0, 0}, {2, 3, 4}}.get_surface_area() == 52);
+  REQUIRE(aabb<4, double>{{0, 0, 0, 0}, {1, 2, 3, 4}}.get_surface_area() ==
+          2 * (24 + 12 + 8 + 6));
+  REQUIRE(aabb<4, int>{{0, 0, 0, 0}, {1, 2, 3, 4}}.get_surface_area() ==
+          2 * (24 + 12 + 8 + 6));
+
+  // Small integer types keep their areas in a wide type.
+  static_assert(std::is_same_v<aabb<3, int8_t>::cost_type, std::int64_t>);
+  static_assert(std::is_same_v<aabb3f::cost_type, float>);
+  REQUIRE(aabb<3, int8_t>{{-100, -100, -100}, {100, 100, 100}}.get_surface_area() ==
+          6 * 200 * 200);
+  REQUIRE(aabb<2, short>{{0, 0}, {30000, 30000}}.surfaceArea == 120000);
+
+  // Touching as a template argument matches the runtime flag.
+  aabb2i a{{0, 0}, {2, 2}}, b{{2, 0}, {4, 2}};
+  REQUIRE(a.overlaps<true>(b) == a.overlaps(b, true));
+  REQUIRE(a.overlaps<false>(b) == a.overlaps(b, false));
+  REQUIRE(a.overlaps<true>(point2i{2, 2}));
+  REQUIRE(!a.overlaps<false>(point2i{2, 2}));
+}
+
+TEST_CASE_TEMPLATE("quantized tree 3d", T, double, float, int)
+{
+  using tree = tree<3, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(41);
+  std::uniform_int_distribution<int> pos(0, 1000), size(1, 20);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 5000; i++) {
+    int x = pos(rng), y = pos(rng), z = pos(rng);
+    bbs.push_back({{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}});
+  }
+
+  auto sorted = [](std::vector<node_id> ids) {
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+
+  std::array<T, 3> bounds = {1000, 1000, 0};
+  for (tree t : {tree(bbs), tree(bounds, bbs)}) {
+    quantized_tree<3, T, 8> q8(t);
+    quantized_tree<3, T, 16> q16(t);
+    REQUIRE(q8.size() == t.size());
+    REQUIRE(q8.memory_usage() < q16.memory_usage());
+
+    // Rounding outward never loses an overlap, and leaves are exact.
+    for (int q = 0; q < 100; q++) {
+      int x = pos(rng), y = pos(rng), z = pos(rng);
+      aabb query{{x, y, z}, {x + size(rng), y + size(rng), z + size(rng)}};
+      for (bool touch : {true, false}) {
+        auto expected = sorted(t.get_overlaps(query, touch));
+        REQUIRE(sorted(q8.get_overlaps(query, touch)) == expected);
+        REQUIRE(sorted(q16.get_overlaps(query, touch)) == expected);
+      }
+      REQUIRE(sorted(q8.get_overlaps(query.lowerBound)) ==
+              sorted(t.get_overlaps(query.lowerBound)));
+    }
+  }
+
+  // A single entry is a leaf at the root.
+  tree single;
+  single.insert({{1, 1, 1}, {2, 2, 2}});
+  quantized_tree<3, T> q(single);
+  REQUIRE(q.get_overlaps(aabb{{0, 0, 0}, {1, 1, 1}}).size() == 1);
+  REQUIRE(q.get_overlaps(aabb{{3, 3, 3}, {4, 4, 4}}).empty());
+  REQUIRE(quantized_tree<3, T>{}.get_overlaps(aabb{{0, 0, 0}, {1, 1, 1}}).empty());
+}
+
+TEST_CASE("node pool storage")
+{
+  using tree = tree2d;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  // Counts what the trees allocate.
+  struct counting_resource : std::pmr::memory_resource {
+    std::size_t allocated = 0, largest = 0, freed = 0;
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+      allocated += bytes;
+      largest = std::max(largest, bytes);
+      return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void *p, std::size_t bytes, std::size_t align) override
+    {
+      allocated -= bytes;
+      freed += bytes;
+      std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+      return this == &other;
+    }
+  };
+
+  std::mt19937 rng(43);
+  std::uniform_real_distribution<double> pos(0, 100);
+  auto random_box = [&] {
+    double x = pos(rng), y = pos(rng);
+    return aabb{{x, y}, {x + 1, y + 1}};
+  };
+
+  counting_resource contiguous, paged;
+  {
+    tree a(pool_options{&contiguous});
+    tree b(pool_options{&paged, 1000});
+    auto firstBox = random_box();
+    REQUIRE(b.insert(firstBox) == a.insert(firstBox));
+
+    std::vector<node_id> ids;
+    for (int i = 0; i < 5000; i++) {
+      auto bb = random_box();
+      ids.push_back(a.insert(bb));
+      REQUIRE(b.insert(bb) == ids.back());
+    }
+    a.validate();
+    b.validate();
+    REQUIRE(contiguous.allocated > 0);
+    REQUIRE(paged.allocated > 0);
+
+    // Pages are never moved, and growing adds one page at a time.
+    REQUIRE(paged.freed == 0);
+    REQUIRE(b.capacity() % 1024 == 0);
+    REQUIRE(b.capacity() - 2 * b.size() < 1024);
+    REQUIRE(paged.largest < contiguous.largest);
+
+    aabb query{{40, 40}, {60, 60}};
+    auto sorted = [](std::vector<node_id> v) {
+      std::sort(v.begin(), v.end());
+      return v;
+    };
+    REQUIRE(sorted(b.get_overlaps(query)) == sorted(a.get_overlaps(query)));
+
+    // Copies own their nodes, from the default resource.
+    std::size_t before = paged.allocated;
+    tree copy = b;
+    REQUIRE(paged.allocated == before);
+    REQUIRE(sorted(copy.get_overlaps(query)) == sorted(a.get_overlaps(query)));
+  }
+  REQUIRE(contiguous.allocated == 0);
+  REQUIRE(paged.allocated == 0);
+
+  // Reserving sizes the pool once.
+  tree t;
+  t.reserve(1000);
+  unsigned int capacity = t.capacity();
+  REQUIRE(capacity >= 1999);
+  for (int i = 0; i < 1000; i++)
+    t.insert(random_box());
+  REQUIRE(t.capacity() == capacity);
+  t.validate();
+}
+
+TEST_CASE_TEMPLATE("compaction 2d", T, double, float, int)
+{
+  using tree = tree<2, T>;
+  using aabb = tree::aabb;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(47);
+  std::uniform_int_distribution<int> pos(0, 500), size(1, 10);
+  tree t;
+  std::map<node_id, aabb> entries;
+  for (int i = 0; i < 4000; i++) {
+    int x = pos(rng), y = pos(rng);
+    aabb bb{{x, y}, {x + size(rng), y + size(rng)}};
+    entries[t.insert(bb)] = bb;
+  }
+  // Remove most entries at random.
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (rng() % 8 != 0) {
+      t.remove(it->first);
+      it = entries.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+  unsigned int capacity = t.capacity();
+
+  REQUIRE(!t.compact_if(0.01));
+  REQUIRE(t.capacity() == capacity);
+
+  // The handles survive the nodes being moved.
+  REQUIRE(t.compact_if(0.5));
+  t.validate();
+  REQUIRE(t.size() == entries.size());
+  REQUIRE(t.capacity() < capacity / 4);
+  for (auto &[id, bb] : entries) {
+    REQUIRE(t.contains(id));
+    REQUIRE(t.get_aabb(id).contains(bb));
+  }
+  for (int q = 0; q < 50; q++) {
+    int x = pos(rng), y = pos(rng);
+    aabb query{{x, y}, {x + 20, y + 20}};
+    auto found = t.get_overlaps(query);
+    unsigned int expected = 0;
+    for (auto &[id, bb] : entries)
+      expected += t.get_aabb(id).overlaps(query, true);
+    REQUIRE(found.size() == expected);
+    for (auto id : found)
+      REQUIRE(entries.count(id) == 1);
+  }
+
+  // The tree keeps working after compaction.
+  for (auto &[id, bb] : entries)
+    t.update(id, bb, true);
+  for (int i = 0; i < 1000; i++)
+    t.insert({{0, 0}, {1, 1}});
+  t.validate();
+
+  tree empty;
+  empty.compact();
+  empty.insert({{0, 0}, {1, 1}});
+  empty.validate();
+}
+
+TEST_CASE("stable handles")
+{
+  using tree = tree2d;
+  using node_id = tree::node_id;
+
+  tree t;
+  auto a = t.insert({{0, 0}, {1, 1}});
+  auto b = t.insert({{2, 2}, {3, 3}});
+  REQUIRE(t.contains(a));
+  t.remove(a);
+  REQUIRE(!t.contains(a));
+  REQUIRE(t.contains(b));
+
+  // The slot is reused, but the old handle stays stale.
+  auto c = t.insert({{4, 4}, {5, 5}});
+  REQUIRE(c != a);
+  REQUIRE(!t.contains(a));
+  REQUIRE(t.contains(c));
+  REQUIRE(t.get_overlaps(tree::point{4.5, 4.5}) == std::vector<node_id>{c});
+  REQUIRE(!t.contains(node_id(12345)));
+
+  // Bulk built trees hand out the entry indices.
+  std::vector<tree::aabb> bbs = {{{0, 0}, {1, 1}}, {{1, 1}, {2, 2}}, {{5, 5}, {6, 6}}};
+  tree bulk(bbs);
+  for (unsigned int i = 0; i < bbs.size(); i++)
+    REQUIRE(bulk.get_aabb(node_id(i)) == bbs[i]);
+
+  // Handles follow entries through rebuilds and compaction.
+  bulk.rebuild();
+  bulk.compact();
+  for (unsigned int i = 0; i < bbs.size(); i++)
+    REQUIRE(bulk.get_aabb(node_id(i)) == bbs[i]);
+  REQUIRE(bulk.get_overlaps(tree::point{5.5, 5.5}) == std::vector<node_id>{node_id(2)});
+}
+
+TEST_CASE("typed payload 2d")
+{
+  struct particle {
+    std::uint32_t index;
+    std::uint8_t species;
+  };
+  using tree = abt::tree<2, double, particle>;
+  using node_id = tree::node_id;
+
+  tree t;
+  auto a = t.insert({{0, 0}, {1, 1}}, particle{7, 1});
+  auto b = t.insert({{0.5, 0.5}, {1.5, 1.5}}, particle{9, 2});
+  t.insert({{4, 4}, {5, 5}}, particle{11, 1});
+  REQUIRE(t.data(a).index == 7);
+  REQUIRE(t.data(b).species == 2);
+
+  // Callbacks taking a third argument get the payload of each hit.
+  std::vector<node_id> hits;
+  t.visit_overlaps(tree::aabb{{0, 0}, {2, 2}},
+                   [&](node_id id, const tree::aabb &, const particle &p) {
+                     if (p.species == 2)
+                       hits.push_back(id);
+                   });
+  REQUIRE(hits == std::vector<node_id>{b});
+
+  std::uint32_t sum = 0;
+  t.for_each([&](node_id, const tree::aabb &, particle p) { sum += p.index; });
+  REQUIRE(sum == 27);
+
+  // Two-argument callbacks still work.
+  REQUIRE(t.get_overlaps(tree::point{4.5, 4.5}).size() == 1);
+}
+
+TEST_CASE("save, load and map 2d")
+{
+  using tree = tree2d;
+  using node_id = tree::node_id;
+
+  std::mt19937 rng(21);
+  std::uniform_real_distribution<double> pos(0, 10);
+  tree t({10, 0});
+  std::vector<node_id> ids;
+  for (int i = 0; i < 300; i++) {
+    double x = pos(rng), y = pos(rng);
+    ids.push_back(t.insert({{x, y}, {x + 0.5, y + 0.5}}));
+  }
+  for (int i = 0; i < 300; i += 3)
+    t.remove(ids[i]);
+
+  std::vector<tree::aabb> queries;
+  for (int i = 0; i < 50; i++) {
+    double x = pos(rng), y = pos(rng);
+    queries.push_back({{x - 1, y - 1}, {x + 1, y + 1}});
+  }
+  auto sorted = [](std::vector<node_id> v) {
+    std::sort(v.begin(), v.end());
+    return v;
+  };
+
+  std::stringstream ss;
+  t.save(ss);
+  tree loaded = tree::load(ss);
+  REQUIRE(loaded.size() == t.size());
+  REQUIRE(loaded.periodic_bounds() == t.periodic_bounds());
+  for (const auto &q : queries)
+    REQUIRE(sorted(loaded.get_overlaps(q)) == sorted(t.get_overlaps(q)));
+
+  // The loaded tree can still be updated.
+  auto extra = loaded.insert({{20, 20}, {21, 21}});
+  REQUIRE(loaded.get_overlaps(tree::point{20.5, 20.5}) == std::vector<node_id>{extra});
+
+  auto path = std::filesystem::temp_directory_path() / "abt_test_tree.bin";
+  save(t, path);
+  REQUIRE(load<tree>(path).size() == t.size());
+  {
+    auto view = tree_view2d::map(path);
+    REQUIRE(view.size() == t.size());
+    REQUIRE(!view.contains(ids[0]));
+    REQUIRE(view.get_aabb(ids[1]) == t.get_aabb(ids[1]));
+    for (const auto &q : queries)
+      REQUIRE(sorted(view.get_overlaps(q)) == sorted(t.get_overlaps(q)));
+  }
+  std::filesystem::remove(path);
+
+  // Trees of another layout are turned away.
+  std::stringstream other;
+  tree3d().save(other);
+  REQUIRE_THROWS(tree::load(other));
+
+  // So are truncated files and headers whose sections do not fit.
+  std::string bytes = ss.str();
+  std::stringstream truncated(bytes.substr(0, bytes.size() / 2));
+  REQUIRE_THROWS(tree::load(truncated));
+
+  // The view needs its bytes on a cache line boundary.
+  std::vector<std::max_align_t> buffer;
+  auto aligned = [&](const std::string &changed) {
+    buffer.assign(changed.size() / sizeof(std::max_align_t) + 64, {});
+    auto *start = reinterpret_cast<std::byte *>(buffer.data());
+    start += (detail::file_alignment - reinterpret_cast<std::uintptr_t>(start) % detail::file_alignment) %
+             detail::file_alignment;
+    std::memcpy(start, changed.data(), changed.size());
+    return start;
+  };
+
+  auto corrupt = [&](auto change) {
+    std::string copy = bytes;
+    detail::file_header header;
+    std::memcpy(&header, copy.data(), sizeof(header));
+    change(header);
+    std::memcpy(copy.data(), &header, sizeof(header));
+    return copy;
+  };
+  for (auto changed : {corrupt([](auto &h) { h.node_capacity = 0; }),
+                       corrupt([](auto &h) { h.node_capacity = 0xfffffff; }),
+                       corrupt([](auto &h) { h.node_count = h.node_capacity + 1; }),
+                       corrupt([](auto &h) { h.handles_offset = h.file_size; }),
+                       corrupt([](auto &h) { h.nodes_offset = ~std::uint64_t(0) << 6; })}) {
+    std::stringstream in(changed);
+    REQUIRE_THROWS(tree::load(in));
+
+    auto start = aligned(changed);
+    REQUIRE_THROWS(tree_view2d({start, changed.size()}));
+    REQUIRE_THROWS(tree_view2d({start, changed.size() / 2}));
+  }
+
+  // A sound header over corrupt nodes is turned away by load, and by the
+  // view's queries as they reach the damage.
+  auto relink = [&](unsigned int child) {
+    std::string copy = bytes;
+    detail::file_header header;
+    std::memcpy(&header, copy.data(), sizeof(header));
+    // The child references follow the children's bounds in a branch.
+    auto at = header.branches_offset + std::uint64_t(header.root) * header.branch_size +
+              4 * 2 * sizeof(float);
+    std::memcpy(copy.data() + at, &child, sizeof(child));
+    return copy;
+  };
+  detail::file_header header;
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  for (auto changed : {relink(0x7ffffff0), relink(0x80000000 | 0x7ffffff0), relink(header.root)}) {
+    std::stringstream in(changed);
+    REQUIRE_THROWS(tree::load(in));
+
+    tree_view2d view({aligned(changed), changed.size()});
+    REQUIRE_THROWS(view.get_overlaps(tree::aabb{{0, 0}, {10, 10}}));
+  }
+}
+
+TEST_CASE("inline stack overflow")
+{
+  // Pushes past the capacity spill to the heap rather than past the end.
+  detail::inline_stack<unsigned int, 4> stack;
+  for (unsigned int i = 0; i < 10; i++)
+    stack.push_back(i);
+  REQUIRE(stack.size() == 10);
+  for (unsigned int i = 0; i < 10; i++)
+    REQUIRE(stack[i] == i);
+  for (unsigned int i = 10; i-- > 0; stack.pop_back())
+    REQUIRE(stack.back() == i);
+  REQUIRE(stack.empty());
+}
+
+TEST_CASE_TEMPLATE("static tree 3d", T, double, float, int)
+{
+  using tree = abt::tree<3, T>;
+  using static_tree = abt::static_tree<3, T>;
+  using aabb = typename tree::aabb;
+  using node_id = typename tree::node_id;
+
+  std::mt19937 rng(22);
+  std::uniform_int_distribution<int> pos(0, 40);
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 500; i++) {
+    T x = pos(rng), y = pos(rng), z = pos(rng);
+    bbs.push_back({{x, y, z}, {T(x + 2), T(y + 2), T(z + 2)}});
+  }
+  typename tree::template vec<T> period = {42, 0, 42};
+  tree dynamic(period, bbs);
+  static_tree frozen(period, bbs);
+  REQUIRE(frozen.size() == bbs.size());
+  REQUIRE(frozen.get_aabb(node_id(7)) == bbs[7]);
+
+  auto sorted = [](std::vector<node_id> v) {
+    std::sort(v.begin(), v.end());
+    return v;
+  };
+  for (int i = 0; i < 100; i++) {
+    T x = pos(rng), y = pos(rng), z = pos(rng);
+    aabb q = {{x, y, z}, {T(x + 3), T(y + 3), T(z + 3)}};
+    for (bool touch : {true, false}) {
+      REQUIRE(sorted(frozen.get_overlaps(q, touch)) == sorted(dynamic.get_overlaps(q, touch)));
+      REQUIRE(sorted(frozen.get_overlaps(q, touch, {1000, 1000, 1000})) ==
+              sorted(dynamic.get_overlaps(q, touch, {1000, 1000, 1000})));
+    }
+    typename tree::point pt = {x, y, z};
+    REQUIRE(sorted(frozen.get_overlaps(pt)) == sorted(dynamic.get_overlaps(pt)));
+    REQUIRE(frozen.any_overlap(q) == dynamic.any_overlap(q));
+  }
+
+  // Returning visit_stop ends the walk.
+  unsigned int visited = 0;
+  frozen.visit_overlaps(aabb{{0, 0, 0}, {42, 42, 42}}, [&](node_id) {
+    visited++;
+    return visit_stop;
+  });
+  REQUIRE(visited == 1);
+
+  REQUIRE(static_tree().get_overlaps(aabb{{0, 0, 0}, {1, 1, 1}}).empty());
+  REQUIRE(static_tree(std::span<const aabb>(bbs.data(), 1)).get_overlaps(bbs[0]) ==
+          std::vector<node_id>{node_id(0)});
+}
+
+TEST_CASE("hybrid index 2d")
+{
+  using index = hybrid_index2d;
+  using aabb = index::aabb;
+  using node_id = index::node_id;
+
+  // Mostly unit boxes, with one in ten much larger.
+  std::mt19937 rng(23);
+  std::uniform_int_distribution<int> pos(0, 49), big(5, 10);
+  auto random_box = [&](int i) {
+    double x = pos(rng), y = pos(rng), w = i % 10 == 0 ? big(rng) : 1;
+    return aabb{{x, y}, {x + w, y + w}};
+  };
+  std::vector<aabb> bbs;
+  for (int i = 0; i < 400; i++)
+    bbs.push_back(random_box(i));
+
+  const index::vec<double> period = {50, 0};
+  index h(bbs, period);
+  REQUIRE(h.size() == 400);
+  REQUIRE(h.cell_size() == 1);
+  REQUIRE(h.grid_size() == 360);
+  REQUIRE(h.tree_size() == 40);
+  REQUIRE(h.get_aabb(node_id(10)) == bbs[10]);
+
+  std::map<node_id, aabb> live;
+  for (unsigned int i = 0; i < bbs.size(); i++)
+    live[node_id(i)] = bbs[i];
+
+  // Move a few entries across cells and between the grid and the tree,
+  // and replace a few others.
+  for (int i = 0; i < 400; i += 7) {
+    auto bb = random_box(i + 3);
+    h.update(node_id(i), bb);
+    live[node_id(i)] = bb;
+  }
+  for (int i = 1; i < 400; i += 11) {
+    h.remove(node_id(i));
+    live.erase(node_id(i));
+    REQUIRE(!h.contains(node_id(i)));
+  }
+  auto added = h.insert({{49.5, 3}, {50.5, 4}});
+  live[added] = {{49.5, 3}, {50.5, 4}};
+  REQUIRE(h.size() == live.size());
+
+  auto brute_force = [&](const aabb &q, bool touch) {
+    std::vector<node_id> hits;
+    for (const auto &[id, bb] : live) {
+      for (int k = -2; k <= 2; k++) {
+        aabb shifted = {{bb.lowerBound[0] + k * period[0], bb.lowerBound[1]},
+                        {bb.upperBound[0] + k * period[0], bb.upperBound[1]}};
+        if (shifted.overlaps(q, touch)) {
+          hits.push_back(id);
+          break;
+        }
+      }
+    }
+    return hits;
+  };
+  auto sorted = [](std::vector<node_id> v) {
+    std::sort(v.begin(), v.end());
+    return v;
+  };
+  for (int i = 0; i < 200; i++) {
+    double x = pos(rng), y = pos(rng);
+    aabb q = {{x - 1, y - 1}, {x + 2, y + 2}};
+    REQUIRE(sorted(h.get_overlaps(q)) == brute_force(q, true));
+  }
+  auto all = sorted(h.get_overlaps(aabb{{0, -1}, {49, 60}}));
+  all.erase(std::unique(all.begin(), all.end()), all.end());
+  REQUIRE(all.size() == live.size());
+  REQUIRE(h.any_overlap(index::point{0.2, 3.5}));
+
+  // An entry staying in the tree keeps the box it was moved to.
+  index g(1);
+  auto large = g.insert({{0, 0}, {5, 5}});
+  REQUIRE(g.tree_size() == 1);
+  g.update(large, {{100, 100}, {105, 105}});
+  REQUIRE(g.tree_size() == 1);
+  REQUIRE(g.get_aabb(large) == aabb{{100, 100}, {105, 105}});
+  g.visit_overlaps(aabb{{101, 101}, {102, 102}},
+                   [&](node_id id, const aabb &bb) {
+                     REQUIRE(id == large);
+                     REQUIRE(bb == aabb{{100, 100}, {105, 105}});
+                   });
+
+  // A query reaching around a periodic axis, over fewer cells than are
+  // occupied, walks the grid and still finds an entry past the wrap.
+  index w(1, {10, 10});
+  for (int i = 0; i < 80; i++)
+    w.insert({{i % 10 + 0.1, i / 10 + 2.1}, {i % 10 + 0.3, i / 10 + 2.3}});
+  auto edge = w.insert({{9.0, 0.5}, {9.2, 0.55}});
+  REQUIRE(w.get_overlaps(aabb{{0.5, 0.5}, {9.8, 0.6}}) == std::vector<node_id>{edge});
+  REQUIRE(w.get_overlaps(aabb{{-9.5, 0.5}, {-0.2, 0.6}}) == std::vector<node_id>{edge});
+}
+
+TEST_CASE("forest 2d")
+{
+  using forest = forest2d;
+  using aabb = forest::aabb;
+  using node_id = forest::node_id;
+
+  // Four domains of 10x10, periodic along x.
+  forest f({{0, 0}, {20, 20}}, {2, 2}, 1, {20, 0});
+  REQUIRE(f.domain_count() == 4);
+  REQUIRE(f.domain_of({5, 5}) == 0);
+  REQUIRE(f.domain_of({15, 5}) == 1);
+  REQUIRE(f.domain_of({5, 15}) == 2);
+  REQUIRE(f.domain_of({25, 15}) == 2);
+
+  auto inner = f.insert({{4, 4}, {5, 5}});
+  auto face = f.insert({{9.5, 4}, {10.2, 5}});
+  auto wrapped = f.insert({{0.2, 14}, {0.8, 15}});
+  REQUIRE(f.size() == 3);
+  REQUIRE(f.owner(face) == 0);
+
+  // Entries near a face are ghosted next door, across periodic faces too.
+  REQUIRE(f.ghosts(0).size() == 0);
+  REQUIRE(f.ghosts(1).size() == 1);
+  REQUIRE(f.ghosts(3).size() == 1);
+  std::vector<node_id> seen;
+  f.visit_overlaps(1, aabb{{10, 4}, {11, 5}}, [&](node_id id) { seen.push_back(id); });
+  REQUIRE(seen == std::vector<node_id>{face});
+  seen.clear();
+  f.visit_overlaps(3, aabb{{19.5, 14}, {20.5, 15}}, [&](node_id id) { seen.push_back(id); });
+  REQUIRE(seen == std::vector<node_id>{wrapped});
+
+  // Global queries report owned entries once.
+  REQUIRE(f.get_overlaps(aabb{{0, 0}, {20, 20}}).size() == 3);
+
+  // Leaving a domain only marks the entry until the batch migration.
+  f.update(face, {{10.5, 4}, {11.5, 5}});
+  REQUIRE(f.owner(face) == 0);
+  REQUIRE(f.pending() == 1);
+  auto moves = f.migrate();
+  REQUIRE(moves.size() == 1);
+  REQUIRE(moves[0].id == face);
+  REQUIRE(moves[0].from == 0);
+  REQUIRE(moves[0].to == 1);
+  REQUIRE(f.owner(face) == 1);
+  REQUIRE(f.owned(1).size() == 1);
+  REQUIRE(f.ghosts(0).size() == 1);
+  REQUIRE(f.ghosts(1).size() == 0);
+
+  // Summaries filter domains before any query is sent to them.
+  auto summaries = f.summaries();
+  static_assert(std::is_trivially_copyable_v<forest::summary>);
+  REQUIRE(summaries.size() == 4);
+  REQUIRE(summaries[3].count == 0);
+  REQUIRE(summaries[0].may_overlap(aabb{{3, 3}, {4.5, 4.5}}));
+  REQUIRE(!summaries[0].may_overlap(aabb{{6, 6}, {7, 7}}));
+  REQUIRE(!summaries[3].may_overlap(aabb{{0, 0}, {20, 20}}));
+
+  f.remove(inner);
+  f.remove(wrapped);
+  REQUIRE(f.size() == 1);
+  REQUIRE(f.ghosts(3).size() == 0);
+  REQUIRE(f.get_overlaps(aabb{{0, 0}, {20, 20}}) == std::vector<node_id>{face});
+}
+
+TEST_CASE_TEMPLATE("swept queries 2d", T, double, int)
+{
+  using tree = abt::tree<2, T>;
+  using aabb = typename tree::aabb;
+  using node_id = typename tree::node_id;
+
+  std::mt19937 rng(25);
+  std::uniform_int_distribution<int> pos(0, 99);
+  tree t;
+  t.skin_width = 0;
+  for (int i = 0; i < 1000; i++) {
+    T x = pos(rng), y = pos(rng);
+    t.insert({{x, y}, {T(x + 1), T(y + 1)}});
+  }
+
+  // A box moving fast along the diagonal.
+  aabb start = {{0, 0}, {2, 2}};
+  typename tree::template vec<T> move = {90, 90};
+  auto hits = t.get_swept_overlaps(start, move);
+  REQUIRE(!hits.empty());
+  for (unsigned int i = 1; i < hits.size(); i++)
+    REQUIRE(hits[i - 1].second <= hits[i].second);
+
+  // Check against the slab test of every entry, and against the box
+  // around the start and end, which reports far more.
+  abt::ray<2, T> r;
+  r.origin = {1, 1};
+  r.direction = {90, 90};
+  r.inverse = {1 / 90.0, 1 / 90.0};
+  std::map<node_id, double> expected;
+  t.for_each([&](node_id id, const aabb &bb) {
+    std::array<double, 2> lo = {bb.lowerBound[0] - 1.0, bb.lowerBound[1] - 1.0};
+    std::array<double, 2> hi = {bb.upperBound[0] + 1.0, bb.upperBound[1] + 1.0};
+    double tEnter;
+    if (r.intersects(lo, hi, 1.0, tEnter))
+      expected[id] = tEnter;
+  });
+  REQUIRE(hits.size() == expected.size());
+  for (auto [id, time] : hits)
+    REQUIRE(std::abs(expected.at(id) - time) < 1e-9);
+  REQUIRE(t.get_overlaps(aabb{{0, 0}, {92, 92}}).size() > 5 * hits.size());
+
+  // Stopping at the first contact.
+  std::vector<node_id> first;
+  t.visit_swept_overlaps(start, move, [&](node_id id, const aabb &, double) {
+    first.push_back(id);
+    return visit_stop;
+  });
+  REQUIRE(first == std::vector<node_id>{hits[0].first});
+
+  // A periodic box wraps the sweep.
+  tree p({100, 100});
+  p.skin_width = 0;
+  auto target = p.insert({{5, 5}, {6, 6}});
+  auto wrapped = p.get_swept_overlaps({{96, 96}, {97, 97}}, {10, 10});
+  REQUIRE(wrapped.size() == 1);
+  REQUIRE(wrapped[0].first == target);
+  REQUIRE(std::abs(wrapped[0].second - 0.8) < 1e-9);
+}
+
+TEST_CASE("tree stats and query counters")
+{
+  using tree = tree2d;
+  using node_id = tree::node_id;
+
+  tree empty;
+  auto none = empty.stats();
+  REQUIRE(none.leaves == 0);
+  REQUIRE(none.leaf_depths.empty());
+  REQUIRE(none.free_nodes == empty.capacity());
+
+  // Four boxes in a row: a balanced tree has every leaf at depth 2, and
+  // neighbouring boxes only touch, so siblings share no volume.
+  tree t;
+  t.skin_width = 0;
+  std::vector<node_id> ids;
+  for (int i = 0; i < 4; i++)
+    ids.push_back(t.insert({{double(i), 0}, {i + 1.0, 1}}));
+  t.rebuild();
+  auto s = t.stats();
+  REQUIRE(s.leaves == 4);
+  REQUIRE(s.height == 2);
+  REQUIRE(s.leaf_depths == std::vector<unsigned int>{0, 0, 4});
+  REQUIRE(s.sibling_overlap == 0);
+  REQUIRE(s.free_nodes == t.capacity() - 7);
+  REQUIRE(s.memory_bytes > 0);
+  REQUIRE(std::abs(s.sah_cost - t.get_sah_cost()) < 1e-12);
+
+  // Removing leaves holes in the pool, which compaction closes.
+  t.remove(ids[0]);
+  t.remove(ids[1]);
+  REQUIRE(t.stats().fragmentation > 0);
+  t.compact();
+  REQUIRE(t.stats().fragmentation == 0);
+
+  // Counters add up over queries; a query between the boxes visits the
+  // root and finds nothing below it.
+  tree u;
+  u.skin_width = 0;
+  u.insert({{0, 0}, {1, 1}});
+  u.insert({{4, 0}, {5, 1}});
+  u.insert({{8, 0}, {9, 1}});
+  query_counters counters;
+  unsigned int hits = 0;
+  u.visit_overlaps(tree::aabb{{2, 0}, {3, 1}}, [&] { hits++; }, counters);
+  REQUIRE(hits == 0);
+  REQUIRE(counters.nodes_visited == 1);
+  REQUIRE(counters.false_positives == 1);
+  u.visit_overlaps(tree::point{8.5, 0.5}, [&] { hits++; }, counters);
+  REQUIRE(hits == 1);
+  REQUIRE(counters.nodes_visited >= 2);
+  REQUIRE(counters.leaves_tested >= 1);
+  REQUIRE(counters.stack_high_water >= 1);
+}
+
+TEST_CASE("branch and bound insertion")
+{
+  using tree = tree3d;
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> coord(0, 50);
+  std::vector<tree::aabb> bbs;
+  for (int i = 0; i < 2000; i++) {
+    double x = coord(rng), y = coord(rng), z = coord(rng);
+    bbs.push_back({{x, y, z}, {x + 1, y + 1, z + 1}});
+  }
+
+  tree greedy, searched;
+  searched.insertion = insert_strategy::branch_and_bound;
+  for (const auto &bb : bbs) {
+    greedy.insert(bb);
+    searched.insert(bb);
+  }
+  searched.validate();
+  REQUIRE(searched.get_sah_cost() < greedy.get_sah_cost());
+
+  // Queries and updates see the same entries whichever way they went in.
+  tree::aabb query{{10, 10, 10}, {20, 20, 20}};
+  auto expected = greedy.get_overlaps(query);
+  auto found = searched.get_overlaps(query);
+  std::sort(expected.begin(), expected.end());
+  std::sort(found.begin(), found.end());
+  REQUIRE(found == expected);
+
+  for (unsigned int i = 0; i < bbs.size(); i += 3) {
+    auto bb = bbs[i];
+    for (unsigned int d = 0; d < 3; d++) {
+      bb.lowerBound[d] += 5;
+      bb.upperBound[d] += 5;
+    }
+    searched.update(tree::node_id(i), bb);
+  }
+  searched.validate();
+  REQUIRE(searched.size() == bbs.size());
+
+  std::stringstream file;
+  searched.save(file);
+  REQUIRE(tree::load(file).insertion == insert_strategy::branch_and_bound);
+}
+
+TEST_CASE("allocation-free queries")
+{
+  using tree = tree2d;
+  using node_id = tree::node_id;
+  static_assert(std::is_trivially_copyable_v<tree::point>);
+  static_assert(std::is_trivially_copyable_v<tree::aabb>);
+  static_assert(std::is_nothrow_move_constructible_v<tree::point>);
+
+  std::vector<tree::aabb> bbs;
+  for (int i = 0; i < 100; i++)
+    bbs.push_back({{double(i % 10), double(i / 10)}, {i % 10 + 0.5, i / 10 + 0.5}});
+  tree t{std::span<const tree::aabb>(bbs)};
+
+  // A buffer too small is filled, and the count says how large to retry.
+  tree::aabb query{{0, 0}, {2.9, 2.9}};
+  std::array<node_id, 4> small;
+  REQUIRE(t.get_overlaps(query, std::span<node_id>(small)) == 9);
+
+  std::array<node_id, 16> large;
+  auto count = t.get_overlaps(query, std::span<node_id>(large));
+  REQUIRE(count == 9);
+  std::vector<node_id> found(large.begin(), large.begin() + count);
+  auto expected = t.get_overlaps(query);
+  std::sort(found.begin(), found.end());
+  std::sort(expected.begin(), expected.end());
+  REQUIRE(found == expected);
+  for (auto id : small)
+    REQUIRE(std::find(expected.begin(), expected.end(), id) != expected.end());
+
+  // Periodic queries keep their images in place too, unless they are wider
+  // than the box and need more than 2^Dim of them.
+  tree p({10, 10}, bbs);
+  REQUIRE(p.get_overlaps(query, std::span<node_id>(large)) == 9);
+  std::vector<node_id> all(bbs.size());
+  REQUIRE(p.get_overlaps(tree::aabb{{-5, -5}, {25, 25}}, std::span<node_id>(all)) == bbs.size());
+}
+
+TEST_CASE("device tree 2d")
+{
+  using tree = tree2d;
+  using node_id = tree::node_id;
+  REQUIRE(backend_available(backend::cpu));
+
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> coord(0, 20);
+  std::vector<tree::aabb> bbs, queries;
+  for (int i = 0; i < 500; i++) {
+    double x = coord(rng), y = coord(rng);
+    bbs.push_back({{x, y}, {x + 0.5, y + 0.5}});
+    x = coord(rng), y = coord(rng);
+    queries.push_back({{x, y}, {x + 1, y + 1}});
+  }
+
+  // Whatever backend is picked, its batches agree with single queries on
+  // the host.
+  for (auto where : {backend::cpu, default_backend()}) {
+    device_tree2d t({20, 20}, bbs, where);
+    REQUIRE(t.size() == bbs.size());
+
+    std::vector<std::pair<std::size_t, node_id>> found, expected;
+    t.get_overlaps_batch(queries, found, true, {}, 3);
+    for (std::size_t q = 0; q < queries.size(); q++) {
+      for (auto id : t.host().get_overlaps(queries[q]))
+        expected.emplace_back(q, id);
+    }
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(found == expected);
+
+    std::vector<std::pair<node_id, node_id>> pairs;
+    t.get_overlapping_pairs(pairs);
+    std::size_t expectedPairs = 0;
+    for (std::size_t i = 0; i < bbs.size(); i++) {
+      for (auto id : t.host().get_overlaps(bbs[i]))
+        expectedPairs += std::size_t(id) > i;
+    }
+    REQUIRE(pairs.size() == expectedPairs);
+    for (auto [a, b] : pairs)
+      REQUIRE(std::size_t(a) < std::size_t(b));
+  }
+}